@@ -1,94 +1,439 @@
 (defconstant eof (gensym "EOF"))
 
-(defconstant utf8-unix
-  (ext:make-encoding
-   :charset charset:utf-8
-   :line-terminator :unix
-   :input-error-action #\uFFFD
-   :output-error-action :error))
+(deftype octet () '(unsigned-byte 8))
+
+(deftype octets () '(simple-array (unsigned-byte 8) (*)))
+
+(defconstant block-size 4096)
+
+(declaim (inline make-octets))
+(defun make-octets (n)
+  (make-array n :element-type 'octet))
+
+;; UTF-8 is done here rather than by the implementation, so that it is
+;; the same on every Lisp and decodes straight out of the read buffer.
+;; Malformed input decodes to U+FFFD.
+
+(defun utf8-char (buf i end)
+  "Returns the code point at I in BUF and the number of bytes it takes."
+  (declare (type octets buf) (type fixnum i end) (optimize speed))
+  (let* ((b (aref buf i))
+         (n (cond ((< b #x80) (return-from utf8-char (values b 1)))
+                  ((< b #xc2) 0)
+                  ((< b #xe0) 1)
+                  ((< b #xf0) 2)
+                  ((< b #xf5) 3)
+                  (t 0)))
+         (code (logand b (ash #x3f (- n)))))
+    (declare (type fixnum n code))
+    (when (or (= n 0) (>= (+ i n) end))
+      (return-from utf8-char (values #xfffd 1)))
+    (loop for k of-type fixnum from 1 to n
+          for c of-type octet = (aref buf (+ i k))
+          do (unless (= #x80 (logand c #xc0))
+               (return-from utf8-char (values #xfffd 1)))
+             (setf code (logior (ash code 6) (logand c #x3f))))
+    (if (or (< code (svref #(0 #x80 #x800 #x10000) n))
+            (<= #xd800 code #xdfff)
+            (> code #x10ffff))
+        (values #xfffd 1)
+        (values code (1+ n)))))
+
+(defun utf8-decode (buf start end)
+  (declare (type octets buf) (type fixnum start end) (optimize speed))
+  (if (loop for i of-type fixnum from start below end
+            always (< (aref buf i) #x80))
+      (let ((string (make-string (- end start))))
+        (loop for i of-type fixnum from start below end
+              for j of-type fixnum from 0
+              do (setf (schar string j) (code-char (aref buf i))))
+        string)
+      (let ((string (make-string (- end start)))
+            (i start)
+            (j 0))
+        (declare (type fixnum i j))
+        (loop while (< i end)
+              do (multiple-value-bind (code n) (utf8-char buf i end)
+                   (declare (type fixnum code n))
+                   (setf (schar string j) (code-char code))
+                   (incf i n)
+                   (incf j)))
+        (subseq string 0 j))))
+
+(defun utf8-length (string)
+  (declare (type string string) (optimize speed))
+  (let ((n 0))
+    (declare (type fixnum n))
+    (loop for char across string
+          for code of-type fixnum = (char-code char)
+          do (incf n (cond ((< code #x80) 1)
+                           ((< code #x800) 2)
+                           ((< code #x10000)
+                            (when (<= #xd800 code #xdfff)
+                              (error "Cannot write ~S as UTF-8" char))
+                            3)
+                           (t 4))))
+    n))
+
+(defun utf8-encode (string buf start)
+  "Encodes STRING into BUF from START, which has room for all of it."
+  (declare (type string string) (type octets buf) (type fixnum start)
+           (optimize speed))
+  (let ((i start))
+    (declare (type fixnum i))
+    (flet ((put (byte)
+             (setf (aref buf i) byte)
+             (incf i)))
+      (declare (inline put))
+      (loop for char across string
+            for code of-type fixnum = (char-code char)
+            do (cond ((< code #x80)
+                      (put code))
+                     ((< code #x800)
+                      (put (logior #xc0 (ash code -6)))
+                      (put (logior #x80 (logand code #x3f))))
+                     ((< code #x10000)
+                      (put (logior #xe0 (ash code -12)))
+                      (put (logior #x80 (logand (ash code -6) #x3f)))
+                      (put (logior #x80 (logand code #x3f))))
+                     (t
+                      (put (logior #xf0 (ash code -18)))
+                      (put (logior #x80 (logand (ash code -12) #x3f)))
+                      (put (logior #x80 (logand (ash code -6) #x3f)))
+                      (put (logior #x80 (logand code #x3f)))))))
+    i))
 
 (defun utf8->string (bytes)
-  (ext:convert-string-from-bytes bytes utf8-unix))
+  (let ((buf (coerce bytes 'octets)))
+    (utf8-decode buf 0 (length buf))))
 
 (defun string->utf8 (string)
-  (ext:convert-string-to-bytes string utf8-unix))
+  (let ((buf (make-octets (utf8-length string))))
+    (utf8-encode string buf 0)
+    buf))
 
-(defun read-varint-or-nil (in)
-  (let ((byte (read-byte in nil nil)))
-    (when byte
-      (let ((value 0) (shift 0))
-        (loop (setf value (logior value (ash (logand #x7f byte) shift)))
-              (when (= 0 (logand #x80 byte)) (return value))
-              (setf byte (read-byte in))
-              (incf shift 7))))))
-
-(defun read-varint (in)
-  (or (read-varint-or-nil in) (error "eof when trying to read varint")))
-
-(defun write-varint (out value)
-  (cond ((< value #x80)
-         (write-byte value out))
+;; Symbols read from the stream are uninterned, as before, but each name
+;; is made into a symbol only once. The cache is keyed by the name's
+;; bytes, so looking up a symbol seen before does not cons.
+
+(defvar *symbols* (make-hash-table))
+
+(defun octets-hash (buf start end)
+  (declare (type octets buf) (type fixnum start end) (optimize speed))
+  (let ((hash 0))
+    (declare (type (unsigned-byte 16) hash))
+    (loop for i of-type fixnum from start below end
+          do (setf hash (logand #xffff (+ (* hash 31) (aref buf i)))))
+    hash))
+
+(defun octets-symbol (buf start end)
+  (declare (type octets buf) (type fixnum start end) (optimize speed))
+  (let ((hash (octets-hash buf start end)))
+    (dolist (entry (gethash hash *symbols*))
+      (let ((name (car entry)))
+        (declare (type octets name))
+        (when (and (= (length name) (- end start))
+                   (loop for i of-type fixnum from 0
+                         for j of-type fixnum from start below end
+                         always (= (aref name i) (aref buf j))))
+          (return-from octets-symbol (cdr entry)))))
+    (let ((symbol (make-symbol (utf8-decode buf start end))))
+      (push (cons (subseq buf start end) symbol) (gethash hash *symbols*))
+      symbol)))
+
+;; Floats travel as the 8 bytes of an IEEE 754 double, least significant
+;; byte first. Infinities and NaNs have no portable Lisp representation,
+;; so they are read as a nonfinite-float holding their bits, which is
+;; written back as the same float.
+
+(defstruct (nonfinite-float (:constructor make-nonfinite-float (bits)))
+  (bits 0 :type (unsigned-byte 64)))
+
+(defun bits->float64 (bits)
+  (declare (type (unsigned-byte 64) bits))
+  (let ((sign (if (logbitp 63 bits) -1 1))
+        (e (ldb (byte 11 52) bits))
+        (m (ldb (byte 52 0) bits)))
+    (cond ((= e #x7ff)
+           (make-nonfinite-float bits))
+          ((= e 0)
+           (* sign (scale-float (coerce m 'double-float) -1074)))
+          (t
+           (* sign (scale-float (coerce (+ m (ash 1 52)) 'double-float)
+                                (- e 1075)))))))
+
+(defun float64->bits (x)
+  (multiple-value-bind (m e sign)
+      (integer-decode-float (coerce x 'double-float))
+    (let ((bits (if (minusp sign) (ash 1 63) 0)))
+      (unless (zerop m)
+        (loop while (and (< m (ash 1 52)) (> e -1074))
+              do (setf m (ash m 1) e (1- e)))
+        (setf bits (logior bits
+                           (if (< m (ash 1 52))
+                               m
+                               (logior (ash (+ e 1075) 52)
+                                       (ldb (byte 52 0) m))))))
+      bits)))
+
+;; A reader decodes from a buffer that is filled from its stream in
+;; blocks. The bytes from start to end have been read but not decoded.
+
+(defstruct reader
+  (stream nil)
+  (buf (make-octets block-size) :type octets)
+  (start 0 :type fixnum)
+  (end 0 :type fixnum))
+
+;; Readers that still hold bytes read ahead from their stream. A block
+;; read can take in the start of the next message, so those bytes have
+;; to wait here for the next read-binary-sexp on the same stream. Once a
+;; reader is drained it is dropped and kept for reuse.
+(defvar *readers* '())
+(defvar *spare-reader* nil)
+
+(defun stream-reader (in)
+  (or (cdr (assoc in *readers*))
+      (let ((rd (or *spare-reader* (make-reader))))
+        (setf *spare-reader* nil
+              (reader-stream rd) in
+              (reader-start rd) 0
+              (reader-end rd) 0)
+        rd)))
+
+(defun release-reader (rd)
+  (setf *readers* (delete rd *readers* :key #'cdr))
+  (cond ((< (reader-start rd) (reader-end rd))
+         (push (cons (reader-stream rd) rd) *readers*))
         (t
-         (write-byte (logior #x80 (logand value #x7f)) out)
-         (write-varint out (ash value -7)))))
+         (setf (reader-stream rd) nil)
+         (when (= block-size (length (reader-buf rd)))
+           (setf *spare-reader* rd)))))
+
+(defun read-some (in buf start end)
+  "Reads at least one byte into BUF from START, but no more than END and
+no more than is there without blocking. Returns the new end, which is
+START at end of file."
+  (declare (type octets buf) (type fixnum start end))
+  #+sbcl
+  (+ start (sb-sys:read-n-bytes in buf start (- end start) nil))
+  #+clisp
+  (ext:read-byte-sequence buf in :start start :end end :interactive t)
+  #-(or sbcl clisp)
+  (let ((byte (read-byte in nil nil)))
+    (cond (byte (setf (aref buf start) byte)
+                (1+ start))
+          (t start))))
+
+(defun reader-fill (rd n)
+  "Reads until at least N bytes are buffered. Returns NIL at end of file."
+  (declare (type reader rd) (type fixnum n) (optimize speed))
+  (loop
+    (let* ((buf (reader-buf rd))
+           (start (reader-start rd))
+           (have (- (reader-end rd) start)))
+      (declare (type fixnum have))
+      (when (>= have n)
+        (return t))
+      (when (or (< (length buf) n) (= have (length buf)))
+        (setf buf (make-octets (max n (* 2 (length buf))))))
+      (unless (and (= start 0) (eq buf (reader-buf rd)))
+        (replace buf (reader-buf rd) :start2 start :end2 (reader-end rd)))
+      (setf (reader-buf rd) buf
+            (reader-start rd) 0
+            (reader-end rd) have)
+      (let ((end (read-some (reader-stream rd) buf have (length buf))))
+        (declare (type fixnum end))
+        (when (= end have)
+          (return nil))
+        (setf (reader-end rd) end)))))
+
+(declaim (inline reader-take))
+(defun reader-take (rd n)
+  "Takes N bytes off the buffer and returns the offset where they start."
+  (declare (type reader rd) (type fixnum n) (optimize speed))
+  (let ((start (reader-start rd)))
+    (when (< (- (reader-end rd) start) n)
+      (unless (reader-fill rd n)
+        (error "Short read"))
+      (setf start (reader-start rd)))
+    (setf (reader-start rd) (+ start n))
+    start))
 
-(defun read-varbytes (in)
-  (let* ((n (read-varint in))
-         (b (make-array n)))
-    (if (= n (read-sequence b in)) b (error "Short read"))))
+(defun read-varint (rd)
+  (declare (type reader rd) (optimize speed))
+  (let ((value 0)
+        (shift 0))
+    (declare (type (unsigned-byte 64) value) (type fixnum shift))
+    (loop
+      (let* ((i (reader-take rd 1))
+             (byte (aref (reader-buf rd) i)))
+        (when (> shift 56)
+          (return (read-big-varint rd value shift byte)))
+        (setf value (logior value (ash (logand byte #x7f) shift)))
+        (when (< byte #x80)
+          (return value))
+        (incf shift 7)))))
 
-(defun write-varbytes (out b)
-  (write-varint out (length b))
-  (write-sequence b out))
+(defun read-big-varint (rd value shift byte)
+  (loop
+    (setf value (logior value (ash (logand byte #x7f) shift)))
+    (when (< byte #x80)
+      (return value))
+    (incf shift 7)
+    (let ((i (reader-take rd 1)))
+      (setf byte (aref (reader-buf rd) i)))))
+
+(defun read-float64 (rd)
+  (declare (type reader rd) (optimize speed))
+  (let ((start (reader-take rd 8))
+        (buf (reader-buf rd))
+        (bits 0))
+    (declare (type (unsigned-byte 64) bits))
+    (loop for i of-type fixnum from 7 downto 0
+          do (setf bits (logior (ash bits 8) (aref buf (+ start i)))))
+    (bits->float64 bits)))
+
+(defmacro with-varbytes ((buf start end) rd &body body)
+  "Runs BODY with the bytes of a varbytes from START to END in BUF."
+  (let ((n (gensym "N")))
+    `(let* ((,n (read-varint ,rd))
+            (,start (reader-take ,rd ,n))
+            (,end (+ ,start ,n))
+            (,buf (reader-buf ,rd)))
+       (declare (type fixnum ,start ,end))
+       ,@body)))
+
+(defun read-sexp (rd)
+  (read-tagged rd (read-varint rd)))
+
+(defun read-tagged (rd tag)
+  (case tag
+    (#x0 '())
+    (#x1 'false)
+    (#x2 'true)
+    (#x3 (with-varbytes (buf start end) rd (subseq buf start end)))
+    (#x4 (read-varint rd))
+    (#x5 (- (read-varint rd)))
+    (#x6 (read-float64 rd))
+    (#xc (let* ((head (list (read-sexp rd)))
+                (tail head))
+           (loop
+             (let ((tag (read-varint rd)))
+               (unless (= tag #xc)
+                 (setf (cdr tail) (read-tagged rd tag))
+                 (return head))
+               (setf (cdr tail) (list (read-sexp rd))
+                     tail (cdr tail))))))
+    (#xd (let* ((n (read-varint rd))
+                (v (make-array n)))
+           (dotimes (i n v)
+             (setf (aref v i) (read-sexp rd)))))
+    (#xe (with-varbytes (buf start end) rd (utf8-decode buf start end)))
+    (#xf (with-varbytes (buf start end) rd (octets-symbol buf start end)))
+    (t   (error "Read unknown type tag: #x~2,'0X" tag))))
 
 (defun read-binary-sexp (in)
-  (let ((tag (read-varint-or-nil in)))
-    (case tag
-      ((nil) eof)
-      (#x0 '())
-      (#x1 'false)
-      (#x2 'true)
-      (#x3 (read-varbytes in))
-      (#x4 (read-varint in))
-      (#x5 (- (read-varint in)))
-      (#xc (let* ((a (read-binary-sexp in))
-                  (d (read-binary-sexp in)))
-             (cons a d)))
-      (#xd (let* ((n (read-varint in))
-                  (v (make-array n)))
-             (dotimes (i n v)
-               (setf (aref v i) (read-binary-sexp in)))))
-      (#xe (utf8->string (read-varbytes in)))
-      (#xf (make-symbol (utf8->string (read-varbytes in))))
-      (t   (error "Read unknown type tag: #x~2,'0X" tag)))))
+  (let ((rd (stream-reader in)))
+    (cond ((reader-fill rd 1)
+           (prog1 (read-sexp rd)
+             (release-reader rd)))
+          (t
+           (release-reader rd)
+           eof))))
 
-(defun write-binary-sexp (out x)
+;; write-binary-sexp encodes into this buffer, which is reused from one
+;; message to the next and grows as needed, and then writes it out with
+;; one write-sequence.
+
+(defvar *write-buffer* (make-octets block-size))
+(defvar *write-end* 0)
+(declaim (type octets *write-buffer*) (type fixnum *write-end*))
+
+(defun write-room (n)
+  (declare (type fixnum n) (optimize speed))
+  (let ((need (+ *write-end* n)))
+    (when (> need (length *write-buffer*))
+      (let ((new (make-octets (max need (* 2 (length *write-buffer*))))))
+        (replace new *write-buffer* :end2 *write-end*)
+        (setf *write-buffer* new)))))
+
+(declaim (inline put-octet))
+(defun put-octet (byte)
+  (declare (type octet byte) (optimize speed))
+  (write-room 1)
+  (setf (aref *write-buffer* *write-end*) byte)
+  (incf *write-end*))
+
+(defun put-varint (value)
+  (declare (type unsigned-byte value) (optimize speed))
+  (loop
+    (when (< value #x80)
+      (return (put-octet value)))
+    (put-octet (logior #x80 (logand value #x7f)))
+    (setf value (ash value -7))))
+
+(defun put-octets (bytes)
+  (let ((n (length bytes)))
+    (put-varint n)
+    (write-room n)
+    (replace *write-buffer* bytes :start1 *write-end*)
+    (incf *write-end* n)))
+
+(defun put-string (string)
+  (let ((n (utf8-length string)))
+    (put-varint n)
+    (write-room n)
+    (setf *write-end* (utf8-encode string *write-buffer* *write-end*))))
+
+(defun put-float64 (x)
+  (let ((bits (if (nonfinite-float-p x)
+                  (nonfinite-float-bits x)
+                  (float64->bits x))))
+    (dotimes (i 8)
+      (put-octet (ldb (byte 8 (* 8 i)) bits)))))
+
+(defun put-sexp (x)
   (cond ((null x)
-         (write-varint out 0))
+         (put-varint 0))
         ((eql 'false x)
-         (write-varint out 1))
+         (put-varint 1))
         ((eql 'true x)
-         (write-varint out 2))
+         (put-varint 2))
         ((integerp x)
-         (write-varint out (if (>= x 0) #x4 #x5))
-         (write-varint out (abs x)))
+         (put-varint (if (>= x 0) #x4 #x5))
+         (put-varint (abs x)))
+        ((or (floatp x) (nonfinite-float-p x))
+         (put-varint #x6)
+         (put-float64 x))
         ((consp x)
-         (write-varint out #xc)
-         (write-binary-sexp out (car x))
-         (write-binary-sexp out (cdr x)))
+         (loop while (consp x)
+               do (put-varint #xc)
+                  (put-sexp (pop x)))
+         (put-sexp x))
         ((stringp x)
-         (write-varint out #xe)
-         (write-varbytes out (string->utf8 x)))
+         (put-varint #xe)
+         (put-string x))
         ((symbolp x)
-         (write-varint out #xf)
-         (write-varbytes out (string->utf8 (symbol-name x))))
+         (put-varint #xf)
+         (put-string (symbol-name x)))
         ((vectorp x)
          (cond ((equal (array-element-type x) '(unsigned-byte 8))
-                (write-varint out 3)
-                (write-varbytes out x))
+                (put-varint 3)
+                (put-octets x))
                (t
-                (write-varint out #xd)
+                (put-varint #xd)
+                (put-varint (length x))
                 (dotimes (i (length x))
-                  (write-binary-sexp out (aref x i))))))
+                  (put-sexp (aref x i))))))
         (t
          (error "Don't know how to write that kind of object: ~S" x))))
+
+(defun write-binary-sexp (out x)
+  (setf *write-end* 0)
+  (put-sexp x)
+  (write-sequence *write-buffer* out :end *write-end*)
+  (setf *write-end* 0)
+  ;; Do not hold on to a buffer that one big message blew up.
+  (when (> (length *write-buffer*) (* 256 block-size))
+    (setf *write-buffer* (make-octets block-size))))
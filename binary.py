@@ -1,14 +1,30 @@
 #! /usr/bin/env python3
 
+import re
+import select
+import struct
+import subprocess
 import sys
-from collections import namedtuple
+import weakref
+from collections import deque, namedtuple
 from io import BytesIO
 
+try:
+    import _binary_accel
+except ImportError:
+    _binary_accel = None
+
 
 Eof = namedtuple("Eof", "")
 
 
+class Error(Exception):
+    pass
+
+
 class Sym:
+    __slots__ = ("name",)
+
     def __init__(self, name):
         self.name = name
 
@@ -16,141 +32,822 @@ class Sym:
         return self.name
 
 
-def _byte(b):
-    return bytes((b,))
+_float = struct.Struct("<d")
+_symbols = {}
+# Sexps nest at most this many levels deep, as SEXP_BINARY_MAX_DEPTH in
+# sexp_binary_read.h. The pure decoder takes two Python frames a level,
+# which keeps it well inside the default recursion limit.
+_MAX_DEPTH = 400
 
 
-def read_varint_or_none(inp):
-    value = None
-    shift = 0
-    while True:
-        c = inp.read(1)
-        if c == b"":
-            raise EOFError("Unexpected EOF while reading bytes")
-        i = ord(c)
-        value = value or 0
-        value |= (i & 0x7f) << shift
-        shift += 7
-        if not (i & 0x80):
-            break
-    return value
+def _intern(name):
+    sym = _symbols.get(name)
+    if sym is None:
+        sym = _symbols[name] = Sym(name)
+    return sym
 
 
-def read_varint(inp):
-    value = read_varint_or_none(inp)
-    if value is None:
-        raise IOError("Expected varint but got eof")
-    return value
+if _binary_accel:
+    _binary_accel.set_symbol_factory(_intern)
 
 
-def write_varint(out, value):
-    buf = b""
-    while value > 0x7f:
-        buf += _byte(0x80 | (value & 0x7f))
-        value >>= 7
-    buf += _byte(value)
-    out.write(buf)
+class _Short(Exception):
+    """The buffer ends before the object does. When skipping, pos and
+    pending say where to resume: the sexp at pos and pending - 1 more
+    after it are still to be skipped."""
 
+    def __init__(self, end, pos=None, pending=None):
+        self.end = end
+        self.pos = pos
+        self.pending = pending
 
-def read_varbytes(inp):
-    n = read_varint(inp)
-    buf = inp.read(n)
-    if len(buf) != n:
-        raise IOError("Not enough varbytes")
-    return buf
 
+def _decode_varint(view, pos):
+    byte = view[pos]
+    if byte < 0x80:
+        return byte, pos + 1
+    value = byte & 0x7f
+    shift = 7
+    while True:
+        pos += 1
+        byte = view[pos]
+        value |= (byte & 0x7f) << shift
+        if byte < 0x80:
+            return value, pos + 1
+        shift += 7
 
-def write_varbytes(out, buf):
-    write_varint(out, len(buf))
-    out.write(buf)
 
+def _decode_varbytes(view, pos):
+    n, pos = _decode_varint(view, pos)
+    end = pos + n
+    if end > len(view):
+        raise _Short(end)
+    return view[pos:end], end
 
-def read_binary_sexp_tagged(inp, tag):
+
+def _decode_tagged(view, tag, pos, depth=1):
+    if tag == 0xc:
+        elts = []
+        while True:
+            elt, pos = _decode(view, pos, depth)
+            elts.append(elt)
+            tag, pos = _decode_varint(view, pos)
+            if tag == 0:
+                return elts, pos
+            if tag != 0xc:
+                raise Error("Improper list")
+    if tag == 0xe:
+        buf, pos = _decode_varbytes(view, pos)
+        return str(buf, "utf8"), pos
+    if tag == 4:
+        return _decode_varint(view, pos)
     if tag == 0:
-        return None
+        return None, pos
     if tag == 1:
-        return False
+        return False, pos
     if tag == 2:
-        return True
+        return True, pos
     if tag == 3:
-        return read_varbytes(inp)
-    if tag == 4:
-        return read_varint(inp)
+        buf, pos = _decode_varbytes(view, pos)
+        return bytes(buf), pos
     if tag == 5:
-        return -read_varint(inp)
-    if tag == 0xc:
+        value, pos = _decode_varint(view, pos)
+        return -value, pos
+    if tag == 6:
+        if pos + 8 > len(view):
+            raise _Short(pos + 8)
+        return _float.unpack_from(view, pos)[0], pos + 8
+    if tag == 0xd:
+        n, pos = _decode_varint(view, pos)
         elts = []
+        for _ in range(n):
+            elt, pos = _decode(view, pos, depth)
+            elts.append(elt)
+        return tuple(elts), pos
+    if tag == 0xf:
+        buf, pos = _decode_varbytes(view, pos)
+        return _intern(str(buf, "utf8")), pos
+    raise Error("Read unknown type tag: 0x%x" % tag)
+
+
+def _decode(view, pos, depth=0):
+    tag, pos = _decode_varint(view, pos)
+    if depth >= _MAX_DEPTH:
+        raise Error("Nested too deep")
+    return _decode_tagged(view, tag, pos, depth + 1)
+
+
+def _skip(view, pos, pending=1):
+    # Returns the position just past the sexp at pos, and pending - 1 more
+    # after it, without decoding them. A _Short says where to resume.
+    if _binary_accel:
+        end = _binary_accel.skip(view, pos, pending)
+        if isinstance(end, tuple):
+            pos, pending, need = end
+            raise _Short(need, pos, pending)
+        if end is not None:
+            return end
+    while pending:
+        mark = pos
+        try:
+            tag, pos = _decode_varint(view, pos)
+            if tag in (3, 0xe, 0xf):
+                n, pos = _decode_varint(view, pos)
+                pos += n
+                if pos > len(view):
+                    raise _Short(pos)
+            elif tag in (4, 5):
+                n, pos = _decode_varint(view, pos)
+            elif tag == 6:
+                pos += 8
+                if pos > len(view):
+                    raise _Short(pos)
+            elif tag == 0xc:
+                pending += 2
+            elif tag == 0xd:
+                n, pos = _decode_varint(view, pos)
+                if pos + n > len(view):
+                    raise _Short(pos + n)  # every element takes a byte
+                pending += n
+            elif tag > 2:
+                raise Error("Read unknown type tag: 0x%x" % tag)
+        except _Short as short:
+            raise _Short(short.end, mark, pending)
+        except IndexError:
+            raise _Short(len(view) + 1, mark, pending)
+        pending -= 1
+    return pos
+
+
+def _decode_lazy(view, pos, depth=0):
+    tag, start = _decode_varint(view, pos)
+    if depth >= _MAX_DEPTH:
+        raise Error("Nested too deep")
+    if tag == 0xc:
+        return LazyList(view, pos, depth + 1)
+    if tag == 0xd:
+        return LazyVector(view, pos, depth + 1)
+    return _decode_tagged(view, tag, start, depth + 1)[0]
+
+
+class _Lazy:
+    """A list or vector decoded one element at a time, when accessed.
+
+    An element is found by skipping over the ones before it, and skipping
+    a string or bytevector only reads its length. Lists and vectors
+    inside are lazy in turn. decode() gives the ordinary list or tuple.
+    """
+
+    def __init__(self, view, pos, depth=1):
+        self._view = view
+        self._start = pos
+        self._depth = depth
+        self._offsets = []
+        self._values = {}
+
+    def __getitem__(self, i):
+        if isinstance(i, slice):
+            return [self[j] for j in range(*i.indices(len(self)))]
+        if i < 0:
+            i += len(self)
+        if i < 0 or not self._find(i):
+            raise IndexError("index out of range")
+        try:
+            return self._values[i]
+        except KeyError:
+            value = self._values[i] = _decode_lazy(self._view,
+                                                   self._offsets[i],
+                                                   self._depth)
+            return value
+
+    def __iter__(self):
+        i = 0
+        while self._find(i):
+            yield self[i]
+            i += 1
+
+    def __eq__(self, other):
+        return self.decode() == other
+
+    __hash__ = None
+
+    def __repr__(self):
+        return repr(self.decode())
+
+    def decode(self):
+        return _decode(self._view, self._start, self._depth - 1)[0]
+
+
+class LazyList(_Lazy):
+    def __init__(self, view, pos, depth=1):
+        super().__init__(view, pos, depth)
+        self._next = pos  # the pair tag of the next element, or None
+
+    def _find(self, i):
+        offsets = self._offsets
+        while len(offsets) <= i and self._next is not None:
+            tag, pos = _decode_varint(self._view, self._next)
+            if tag == 0:
+                self._next = None
+            elif tag == 0xc:
+                offsets.append(pos)
+                self._next = _skip(self._view, pos)
+            else:
+                raise Error("Improper list")
+        return i < len(offsets)
+
+    def __len__(self):
+        self._find(sys.maxsize)
+        return len(self._offsets)
+
+
+class LazyVector(_Lazy):
+    def __init__(self, view, pos, depth=1):
+        super().__init__(view, pos, depth)
+        _, pos = _decode_varint(view, pos)
+        self._len, self._next = _decode_varint(view, pos)
+
+    def _find(self, i):
+        offsets = self._offsets
+        while len(offsets) <= i and len(offsets) < self._len:
+            offsets.append(self._next)
+            if len(offsets) < self._len:
+                self._next = _skip(self._view, self._next)
+        return i < len(offsets)
+
+    def __len__(self):
+        return self._len
+
+
+class Reader:
+    """Reads sexps from a binary stream in large chunks.
+
+    Bytes after the current sexp may be read ahead, so once a stream has
+    a Reader it should only be read through that Reader. Streams without
+    read1(), which cannot be read without blocking for more than is
+    there, are read exactly as far as each sexp goes.
+    """
+
+    def __init__(self, inp, bufsize=65536):
+        self.bufsize = bufsize
+        self._read1 = getattr(inp, "read1", None)
+        self._read = inp.read
+        self._buf = b""
+        self._view = memoryview(self._buf)
+        self._pos = 0
+        self._queue = deque()
+        # Where skipping the next sexp resumes, relative to _pos, and how
+        # many sexps from there are still to be skipped.
+        self._scan = (0, 1)
+
+    def _fill(self, need):
+        # Reads until at least need bytes past the read position are
+        # buffered. Returns False at EOF. Bytes once buffered are never
+        # changed, since lazy sexps may still be viewing them: new input
+        # goes after them, or into a new buffer that at least doubles so
+        # that a big sexp arriving in small reads is not copied much.
+        have = len(self._view) - self._pos
+        if not self._read1:
+            chunks = [self._buf[self._pos:]]
+            while have < need:
+                chunk = self._read(min(need - have, max(have, self.bufsize)))
+                if not chunk:
+                    break
+                chunks.append(chunk)
+                have += len(chunk)
+            self._buf = b"".join(chunks)
+            self._view = memoryview(self._buf)
+            self._pos = 0
+            return have >= need
+        buf = self._buf
+        start, end = self._pos, len(self._view)
+        if start + need > len(buf) or (not have and
+                                       len(buf) > 16 * self.bufsize):
+            buf, start, end = self._grow(buf, start, end, need), 0, have
+        while end - start < need:
+            if end == len(buf):
+                buf = self._grow(buf, start, end, need)
+                start, end = 0, end - start
+            chunk = self._read1(len(buf) - end)
+            if not chunk:
+                break
+            buf[end:end + len(chunk)] = chunk
+            end += len(chunk)
+        self._buf = buf
+        self._view = memoryview(buf)[:end]
+        self._pos = start
+        return end - start >= need
+
+    def _grow(self, buf, start, end, need):
+        # need comes from lengths in the stream, which may be corrupt, so
+        # memory only grows as fast as bytes actually arrive.
+        have = end - start
+        new = bytearray(max(min(need, 8 * have), 2 * have, self.bufsize))
+        new[:have] = memoryview(buf)[start:end]
+        return new
+
+    def _need(self):
+        # Returns how many bytes past the read position the next sexp
+        # takes, or at least how many it needs if they are not all here.
+        # A sexp arriving over many reads is skipped once, not once for
+        # each read, since skipping resumes where the last one stopped.
+        offset, pending = self._scan
+        try:
+            end = _skip(self._view, self._pos + offset, pending)
+        except _Short as short:
+            self._scan = (short.pos - self._pos, short.pending)
+            return short.end - self._pos
+        self._scan = (0, 1)
+        return end - self._pos
+
+    def buffered(self):
+        """Returns True if bytes have been read ahead of the last sexp."""
+        return bool(self._queue) or self._pos < len(self._view)
+
+    def read(self):
+        """Returns the next sexp, or Eof() at the end of the stream."""
         while True:
-            elts.append(read_binary_sexp_nested(inp))
-            tail_tag = read_varint(inp)
-            if tail_tag == 0:
+            if self._queue:
+                return self._queue.popleft()
+            # Skipping is cheap, so wait until the next sexp is all here
+            # rather than decoding it again after every partial read.
+            need = self._need()
+            if need > len(self._view) - self._pos:
+                if not self._fill(need):
+                    break
+                continue
+            if _binary_accel:
+                objs, pos, stuck = _binary_accel.decode(self._view, self._pos)
+                if objs:
+                    self._queue.extend(objs)
+                    self._pos = pos
+                    continue
+            obj, self._pos = _decode(self._view, self._pos)
+            return obj
+        if self._pos == len(self._view):
+            return Eof()
+        raise EOFError("Unexpected EOF while reading bytes")
+
+    def read_lazy(self):
+        """Like read(), but a list or vector comes back as a LazyList or
+        LazyVector over the buffered bytes, with nothing in it decoded
+        yet. A sexp that read() has already decoded is returned as is."""
+        if self._queue:
+            return self._queue.popleft()
+        while True:
+            need = self._need()
+            if need <= len(self._view) - self._pos:
+                end = self._pos + need
+                obj = _decode_lazy(self._view[:end], self._pos)
+                self._pos = end
+                return obj
+            if not self._fill(need):
                 break
-            if tail_tag != 0xc:
-                raise Error("Improper list")
-        return elts
-    if tag == 0xd:
-        raise Error("Vector not implemented")
-    if tag == 0xe:
-        return read_varbytes(inp).decode("utf8")
-    if tag == 0xf:
-        return Sym(read_varbytes(inp).decode("utf8"))
+        if self._pos == len(self._view):
+            return Eof()
+        raise EOFError("Unexpected EOF while reading bytes")
 
 
-def read_binary_sexp_nested(inp):
-    return read_binary_sexp_tagged(inp, read_varint(inp))
+_readers = weakref.WeakKeyDictionary()
+
+
+def _reader(inp):
+    try:
+        return _readers[inp]
+    except KeyError:
+        reader = _readers[inp] = Reader(inp)
+        return reader
+    except TypeError:
+        return Reader(inp)
 
 
 def read_binary_sexp(inp):
-    tag = read_varint_or_none(inp)
-    if tag is None:
-        return Eof()
-    return read_binary_sexp_tagged(inp, tag)
+    return _reader(inp).read()
 
 
-def write_nested_binary_sexp(out, obj):
+def read_lazy_binary_sexp(inp):
+    return _reader(inp).read_lazy()
+
+
+def decode_lazy_binary_sexp(data):
+    """Decodes one sexp from a bytes-like object, leaving lists and
+    vectors to be decoded as they are accessed. data must not change
+    while they are in use."""
+    view = memoryview(data)
+    try:
+        view = view[:_skip(view, 0)]
+    except (_Short, IndexError):
+        raise EOFError("Unexpected EOF while reading bytes") from None
+    return _decode_lazy(view, 0)
+
+
+def decode_binary_sexp(data):
+    """Decodes one sexp from a bytes-like object."""
+    try:
+        obj, pos = _decode(memoryview(data), 0)
+    except (_Short, IndexError):
+        raise EOFError("Unexpected EOF while reading bytes") from None
+    return obj
+
+
+def _encode_varint(out, value):
+    while value > 0x7f:
+        out.append(0x80 | (value & 0x7f))
+        value >>= 7
+    out.append(value)
+
+
+def _encode_varbytes(out, buf):
+    n = len(buf)
+    if n < 0x80:
+        out.append(n)
+    else:
+        _encode_varint(out, n)
+    out += buf
+
+
+def _encode(out, obj):
     if obj is None:
-        write_varint(out, 0)
+        out.append(0)
     elif obj is False:
-        write_varint(out, 1)
+        out.append(1)
     elif obj is True:
-        write_varint(out, 2)
-    elif isinstance(obj, bytes):
-        write_varint(out, 3)
-        write_varbytes(out, obj)
-    elif isinstance(obj, int) and obj >= 0:
-        write_varint(out, 4)
-        write_varint(out, obj)
+        out.append(2)
+    elif isinstance(obj, str):
+        out.append(0xe)
+        _encode_varbytes(out, obj.encode("utf8"))
     elif isinstance(obj, int):
-        write_varint(out, 5)
-        write_varint(out, abs(obj))
+        if not -2**63 <= obj < 2**63:
+            raise Error("Integer does not fit in 64 bits")
+        if obj >= 0:
+            out.append(4)
+            _encode_varint(out, obj)
+        else:
+            out.append(5)
+            _encode_varint(out, -obj)
     elif isinstance(obj, list):
         for elt in obj:
-            write_varint(out, 0xc)  # pair
-            write_nested_binary_sexp(out, elt)
-        write_varint(out, 0)  # null
-    elif isinstance(obj, str):
-        write_varint(out, 0xe)
-        write_varbytes(out, obj.encode("utf8"))
+            out.append(0xc)  # pair
+            _encode(out, elt)
+        out.append(0)  # null
+    elif isinstance(obj, (bytes, bytearray, memoryview)):
+        out.append(3)
+        _encode_varbytes(out, obj)
     elif isinstance(obj, Sym):
-        write_varint(out, 0xf)
-        write_varbytes(out, obj.name.encode("utf8"))
+        out.append(0xf)
+        _encode_varbytes(out, obj.name.encode("utf8"))
+    elif isinstance(obj, float):
+        out.append(6)
+        out += _float.pack(obj)
+    elif isinstance(obj, tuple):
+        out.append(0xd)
+        _encode_varint(out, len(obj))
+        for elt in obj:
+            _encode(out, elt)
     else:
         raise TypeError("Don't know how to write that kind of object")
 
 
+def encode_binary_sexp(obj):
+    out = bytearray()
+    _encode(out, obj)
+    return bytes(out)
+
+
+def write_nested_binary_sexp(out, obj):
+    buf = bytearray()
+    _encode(buf, obj)
+    out.write(buf)
+
+
 def write_binary_sexp(out, obj):
     write_nested_binary_sexp(out, obj)
     out.flush()
 
 
+def read_varint(inp):
+    value = 0
+    shift = 0
+    while True:
+        c = inp.read(1)
+        if c == b"":
+            raise EOFError("Unexpected EOF while reading bytes")
+        value |= (c[0] & 0x7f) << shift
+        if not (c[0] & 0x80):
+            return value
+        shift += 7
+
+
+def write_varint(out, value):
+    buf = bytearray()
+    _encode_varint(buf, value)
+    out.write(buf)
+
+
+def read_varbytes(inp):
+    n = read_varint(inp)
+    buf = inp.read(n)
+    if len(buf) != n:
+        raise EOFError("Not enough varbytes")
+    return buf
+
+
+def write_varbytes(out, buf):
+    write_varint(out, len(buf))
+    out.write(buf)
+
+
+_ok = _intern("ok")
+_row = _intern("row")
+_read_only_words = frozenset(("select", "values", "explain"))
+_write_words = frozenset(("insert", "update", "delete", "replace", "merge"))
+_begin_words = frozenset(("begin", "savepoint", "start"))
+_end_words = frozenset(("commit", "end", "rollback"))
+_analyze_words = frozenset(("analyze", "analyse"))
+
+
+def _sql_words(sql):
+    return re.findall(r"[a-z_][a-z_0-9$]*", sql.lower())
+
+
+class Driver:
+    """A driver subprocess, such as ./driver-sqlite, run one command at a
+    time. Commands are given as (name, arg...) with name a string.
+
+    The setup commands, typically a connect, are run each time the
+    process starts, so a restarted driver comes back the way it was.
+    """
+
+    def __init__(self, args, setup=()):
+        self.args = args
+        self.setup = [tuple(form) for form in setup]
+        self.proc = None
+        self.start()
+
+    def start(self):
+        self.proc = subprocess.Popen(self.args, stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE)
+        for form in self.setup:
+            response = self.command(form)
+            if response[0] is not _ok:
+                self.close()
+                raise Error("Driver setup failed: %r" % (response,))
+
+    def restart(self):
+        self.close()
+        self.start()
+
+    def send(self, form):
+        write_binary_sexp(self.proc.stdin,
+                          [_intern(form[0])] + list(form[1:]))
+
+    def receive(self):
+        response = read_binary_sexp(self.proc.stdout)
+        if isinstance(response, Eof):
+            raise EOFError("Driver exited")
+        return response
+
+    def command(self, form):
+        self.send(form)
+        return self.receive()
+
+    def buffered(self):
+        return _reader(self.proc.stdout).buffered()
+
+    def fileno(self):
+        return self.proc.stdout.fileno()
+
+    def close(self):
+        if not self.proc:
+            return
+        proc, self.proc = self.proc, None
+        try:
+            write_binary_sexp(proc.stdin, [_intern("disconnect")])
+            proc.stdin.close()
+            proc.wait(5)
+        except (OSError, subprocess.TimeoutExpired):
+            proc.kill()
+            proc.wait()
+        proc.stdout.close()
+
+
+class Job:
+    """A command submitted to a DriverPool."""
+
+    def __init__(self, pool, form, read_only, transaction):
+        self.pool = pool
+        self.form = form
+        self.read_only = read_only
+        self.transaction = transaction
+        self.tries = 0
+        self.rows = []
+        self.response = None
+        self.error = None
+        self.done = False
+
+    def result(self):
+        """Waits for the job. Returns the rows of an execute, and the
+        response to any other command. Raises Error if it failed."""
+        while not self.done:
+            self.pool._poll()
+        if self.error:
+            raise self.error
+        if self.form[0] == "execute":
+            return self.rows
+        return self.response
+
+
+class DriverPool:
+    """Runs commands on a pool of driver processes started up front.
+
+    Read-only queries (select, values, explain unless it analyzes, and
+    with unless it has an insert, update or delete) go to any idle
+    driver, so several run at once on different cores. Other commands,
+    and all of those from begin to commit or rollback, or from a savepoint
+    outside a transaction to its release, go in order to the first
+    driver. A query never starts before a write submitted ahead of it
+    has finished. Each execute is run to its last row with read-row.
+
+    A driver that dies is restarted and its setup commands run again.
+    A read-only job on it is retried once; a write, or anything in a
+    transaction, fails with Error since it may or may not have happened.
+    """
+
+    def __init__(self, args, size, setup=()):
+        self.drivers = [Driver(args, setup) for _ in range(size)]
+        self._idle = list(self.drivers)
+        self._running = {}
+        self._queue = deque()
+        self._transaction = None
+        self._transactions = 0
+        self._savepoints = []  # names, innermost last
+        self._begun_by_savepoint = False
+        self._aborted = set()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def submit(self, command, *args):
+        """Queues a command and returns its Job without waiting."""
+        words = [None]
+        if command == "execute" and args and isinstance(args[0], str):
+            words = _sql_words(args[0]) or words
+        verb = words[0]
+        if self._transaction is None and verb in _begin_words:
+            self._transactions += 1
+            self._transaction = self._transactions
+            self._savepoints = []
+            self._begun_by_savepoint = verb == "savepoint"
+        transaction = self._transaction
+        # explain analyze runs the statement it explains.
+        read_only = transaction is None and (
+            (verb in _read_only_words and _analyze_words.isdisjoint(words))
+            or (verb == "with" and _write_words.isdisjoint(words)))
+        if transaction is not None:
+            self._follow_transaction(verb, words)
+        job = Job(self, (command,) + args, read_only, transaction)
+        if transaction in self._aborted:
+            self._finish(job, error=Error("Transaction lost with driver"))
+        else:
+            self._queue.append(job)
+            self._dispatch()
+        return job
+
+    def execute(self, sql, *params):
+        return self.submit("execute", sql, *params).result()
+
+    def _follow_transaction(self, verb, words):
+        # Ends the transaction after the statement that ends it. One begun
+        # by a savepoint ends when that savepoint is released.
+        name = words[-1]
+        if verb == "savepoint":
+            self._savepoints.append(name)
+        elif verb == "release" or (verb == "rollback" and
+                                   "to" in words[:3]):
+            names = self._savepoints
+            if name in names:
+                # rollback to keeps the savepoint, release does not.
+                last = len(names) - names[::-1].index(name)
+                del names[last - (verb == "release"):]
+            if self._begun_by_savepoint and not self._savepoints:
+                self._transaction = None
+        elif verb in _end_words:
+            self._transaction = None
+
+    def close(self):
+        while self._running:
+            self._poll()
+        for driver in self.drivers:
+            driver.close()
+
+    def _dispatch(self):
+        writer = self.drivers[0]
+        while self._queue:
+            job = self._queue[0]
+            if job.read_only:
+                if any(not j.read_only for j in self._running.values()):
+                    break
+                if not self._idle:
+                    break
+                # Leave the first driver free for writes if possible.
+                driver = min(self._idle, key=lambda d: d is writer)
+            elif writer in self._idle:
+                driver = writer
+            else:
+                break
+            self._queue.popleft()
+            self._idle.remove(driver)
+            self._running[driver] = job
+            job.tries += 1
+            job.rows = []
+            try:
+                driver.send(job.form)
+            except OSError:
+                self._crashed(driver, False)
+
+    def _finish(self, job, response=None, error=None):
+        job.response = response
+        job.error = error
+        if response and response[0] is not _ok:
+            job.error = Error(response)
+        job.done = True
+
+    def _crashed(self, driver, sent=True):
+        job = self._running.pop(driver)
+        driver.restart()
+        self._idle.append(driver)
+        if job.transaction is not None:
+            self._aborted.add(job.transaction)
+            for other in [job] + list(self._queue):
+                if other.transaction == job.transaction:
+                    self._finish(other, error=Error("Transaction lost "
+                                                    "with driver"))
+            self._queue = deque(j for j in self._queue if not j.done)
+        elif not sent or (job.read_only and job.tries < 2):
+            self._queue.appendleft(job)
+        else:
+            self._finish(job, error=Error("Driver exited during %s" %
+                                          job.form[0]))
+        self._dispatch()
+
+    def _poll(self):
+        # Waits for at least one response and handles it.
+        if not self._running:
+            raise Error("No jobs running")
+        ready = [d for d in self._running if d.buffered()]
+        if not ready:
+            ready = select.select(list(self._running), [], [])[0]
+        for driver in ready:
+            job = self._running.get(driver)
+            if not job:
+                continue
+            try:
+                response = driver.receive()
+                if (job.form[0] == "execute" and response[0] is _ok and
+                        len(response) > 1 and response[1] is _row):
+                    job.rows.append(response[2:])
+                    driver.send(("read-row",))
+                    continue
+            except (OSError, EOFError):
+                self._crashed(driver)
+                continue
+            del self._running[driver]
+            self._idle.append(driver)
+            self._finish(job, response)
+        self._dispatch()
+
+
+def _bench(nrow=20000):
+    import time
+
+    global _binary_accel
+    row = [Sym("ok"), Sym("row"), 123456, "some text value here", 4.5,
+           b"\x00" * 40, None, -7, "x" * 100]
+    data = encode_binary_sexp(row) * nrow
+    accel = _binary_accel
+    for name, _binary_accel in (("python", None), ("accel", accel)):
+        if name == "accel" and not accel:
+            print("accel: _binary_accel is not built")
+            continue
+        reader = Reader(BytesIO(data))
+        start = time.perf_counter()
+        for _ in range(nrow):
+            reader.read()
+        secs = time.perf_counter() - start
+        print("%s: %.0f rows/s, %.1f MB/s" %
+              (name, nrow / secs, len(data) / secs / 1e6))
+    _binary_accel = accel
+
+
 if __name__ == "__main__":
     if sys.argv[1] == "r":
-        # print(hex(read_varint(sys.stdin.buffer)))
-        # print(read_varbytes(sys.stdin.buffer))
         print(read_binary_sexp(sys.stdin.buffer))
     elif sys.argv[1] == "w":
-        # write_varint(sys.stdout.buffer, 0x12_34_56_78)
-        # write_varbytes(sys.stdout.buffer, b"Hello world")
         print(write_binary_sexp(sys.stdout.buffer, "Hello world"))
     elif sys.argv[1] == "rw":
         write_binary_sexp(sys.stdout.buffer, read_binary_sexp(sys.stdin.buffer))
+    elif sys.argv[1] == "bench":
+        _bench()
@@ -1,86 +1,294 @@
-(define (read-varint-or-false in)
-  (let loop ((value #f) (shift 0))
-    (let ((byte (read-u8 in)))
-      (if (eof-object? byte)
-          value
-          (let ((value (bitwise-ior (or value 0)
-                                    (arithmetic-shift
-                                     (bitwise-and #x7f byte) shift))))
-            (if (= 0 (bitwise-and #x80 byte))
-                value
-                (loop value (+ shift 7))))))))
-
-(define (read-varint in)
-  (or (read-varint-or-false in)
-      (error #f "eof when trying to read varint")))
-
-(define (write-varint out value)
+;; Sexps are decoded from a bytevector buffer that is filled from the
+;; port as the message needs it, and encoded into a reusable bytevector
+;; that goes out with one write-bytevector per message.
+
+(define block-size 4096)
+
+;; Returns a bytevector of at least one and at most max bytes, or an eof
+;; object. This blocks until all max bytes are there, so callers only
+;; ask for bytes that the message being read is known to hold. R6RS has
+;; get-bytevector-some, which returns whatever is there instead.
+(define (read-some in max)
+  (read-bytevector max in))
+
+;; A reader is #(port buffer start end), where the bytes from start to
+;; end have been read from the port but not yet decoded.
+
+(define (reader-port rd) (vector-ref rd 0))
+(define (reader-buffer rd) (vector-ref rd 1))
+(define (reader-start rd) (vector-ref rd 2))
+(define (reader-end rd) (vector-ref rd 3))
+
+;; Readers that still hold bytes read ahead from their port. On R6RS,
+;; get-bytevector-some can take in the start of the next message, so
+;; those bytes have to wait here for the next read-binary-sexp on the
+;; same port. Once a reader is drained it is dropped and its buffer is
+;; kept for the next one.
+(define readers '())
+(define spare-buffer #f)
+
+(define (port-reader in)
+  (let ((entry (assq in readers)))
+    (cond (entry (cdr entry))
+          (else
+           (let ((buffer (or spare-buffer (make-bytevector block-size))))
+             (set! spare-buffer #f)
+             (vector in buffer 0 0))))))
+
+(define (save-reader! rd)
+  (let ((in (reader-port rd)))
+    (set! readers (let loop ((entries readers))
+                    (cond ((null? entries) '())
+                          ((eq? in (caar entries)) (cdr entries))
+                          (else (cons (car entries)
+                                      (loop (cdr entries)))))))
+    (cond ((< (reader-start rd) (reader-end rd))
+           (set! readers (cons (cons in rd) readers)))
+          ((= block-size (bytevector-length (reader-buffer rd)))
+           (set! spare-buffer (reader-buffer rd))))))
+
+;; Makes room for n more bytes after the end of the buffered bytes.
+(define (reader-make-room! rd n)
+  (let* ((buffer (reader-buffer rd))
+         (start (reader-start rd))
+         (have (- (reader-end rd) start)))
+    (when (> (+ (reader-end rd) n) (bytevector-length buffer))
+      (let ((new (if (> (+ have n) (bytevector-length buffer))
+                     (make-bytevector
+                      (max (+ have n) (* 2 (bytevector-length buffer))))
+                     buffer)))
+        (bytevector-copy! new 0 buffer start (+ start have))
+        (vector-set! rd 1 new)
+        (vector-set! rd 2 0)
+        (vector-set! rd 3 have)))))
+
+;; Reads until at least n bytes are buffered. Returns #f at end of file.
+(define (reader-fill! rd n)
+  (let loop ()
+    (or (>= (- (reader-end rd) (reader-start rd)) n)
+        (let ((b (read-some (reader-port rd)
+                            (- n (- (reader-end rd) (reader-start rd))))))
+          (and (not (eof-object? b))
+               (let ((len (bytevector-length b)))
+                 (reader-make-room! rd len)
+                 (bytevector-copy! (reader-buffer rd) (reader-end rd)
+                                   b 0 len)
+                 (vector-set! rd 3 (+ (reader-end rd) len))
+                 (loop)))))))
+
+;; Takes n bytes off the buffer and returns the offset where they start.
+(define (reader-take! rd n)
+  (unless (reader-fill! rd n)
+    (error #f "Short read"))
+  (let ((start (reader-start rd)))
+    (vector-set! rd 2 (+ start n))
+    start))
+
+(define (read-varint rd)
+  (let loop ((value 0) (shift 0))
+    (let* ((start (reader-take! rd 1))
+           (byte (bytevector-u8-ref (reader-buffer rd) start)))
+      (let ((value (bitwise-ior value
+                                (arithmetic-shift (bitwise-and #x7f byte)
+                                                  shift))))
+        (if (= 0 (bitwise-and #x80 byte))
+            value
+            (loop value (+ shift 7)))))))
+
+(define (read-varbytes rd)
+  (let* ((n (read-varint rd))
+         (start (reader-start rd))
+         (have (- (reader-end rd) start)))
+    (if (<= n have)
+        (let ((start (reader-take! rd n)))
+          (bytevector-copy (reader-buffer rd) start (+ start n)))
+        ;; The length is known, so the rest of the payload is read in one
+        ;; go straight into the result instead of through the buffer.
+        (let ((b (make-bytevector n)))
+          (bytevector-copy! b 0 (reader-buffer rd) start (+ start have))
+          (vector-set! rd 2 (reader-end rd))
+          (let ((got (read-bytevector! b (reader-port rd) have n)))
+            (unless (and (not (eof-object? got)) (= got (- n have)))
+              (error #f "Short read")))
+          b))))
+
+;; The buffer that write-binary-sexp encodes into. It is reused from one
+;; message to the next, growing as needed.
+(define write-buffer (make-bytevector block-size))
+(define write-end 0)
+
+(define (write-room! n)
+  (let ((len (bytevector-length write-buffer)))
+    (when (> (+ write-end n) len)
+      (let ((new (make-bytevector (max (+ write-end n) (* 2 len)))))
+        (bytevector-copy! new 0 write-buffer 0 write-end)
+        (set! write-buffer new)))))
+
+(define (put-byte byte)
+  (write-room! 1)
+  (bytevector-u8-set! write-buffer write-end byte)
+  (set! write-end (+ write-end 1)))
+
+(define (write-varint value)
   (cond ((< value #x80)
-         (write-u8 value out))
+         (put-byte value))
         (else
-         (write-u8 (bitwise-ior #x80 (bitwise-and value #x7f)) out)
-         (write-varint out (arithmetic-shift value -7)))))
+         (put-byte (bitwise-ior #x80 (bitwise-and value #x7f)))
+         (write-varint (arithmetic-shift value -7)))))
+
+(define (write-varbytes b)
+  (let ((n (bytevector-length b)))
+    (write-varint n)
+    (write-room! n)
+    (bytevector-copy! write-buffer write-end b 0 n)
+    (set! write-end (+ write-end n))))
+
+;; Floats travel as the 8 bytes of an IEEE 754 double, least significant
+;; byte first. They are taken apart with exact arithmetic so that this
+;; works without any implementation-specific bytevector procedures.
+
+(define (bits->float64 bits)
+  (let ((sign (if (= 0 (arithmetic-shift bits -63)) 1 -1))
+        (e (bitwise-and (arithmetic-shift bits -52) #x7ff))
+        (m (bitwise-and bits #xfffffffffffff)))
+    (cond ((= e #x7ff)
+           (if (= m 0) (* sign +inf.0) +nan.0))
+          ((= e 0)
+           (* sign (inexact (* m (expt 2 -1074)))))
+          (else
+           (* sign (inexact (* (+ m #x10000000000000)
+                               (expt 2 (- e 1075)))))))))
+
+;; Returns how many bits the exact positive integer n takes. The float
+;; exponent is found from these rather than with log, which R7RS keeps in
+;; (scheme inexact).
+(define (bit-length n)
+  (let loop ((n n) (len 0))
+    (cond ((>= n #x10000) (loop (arithmetic-shift n -16) (+ len 16)))
+          ((> n 0) (loop (arithmetic-shift n -1) (+ len 1)))
+          (else len))))
+
+(define (float64->bits x)
+  (let ((sign (if (or (< x 0) (eqv? x -0.0)) #x8000000000000000 0)))
+    (cond ((not (= x x))
+           #x7ff8000000000000)
+          ((= (abs x) +inf.0)
+           (+ sign #x7ff0000000000000))
+          ((= x 0)
+           sign)
+          (else
+           (let* ((r (exact (abs x)))
+                  (e (let loop ((e (- (bit-length (numerator r))
+                                      (bit-length (denominator r)))))
+                       (cond ((< r (expt 2 e)) (loop (- e 1)))
+                             ((>= r (expt 2 (+ e 1))) (loop (+ e 1)))
+                             (else e)))))
+             (if (< e -1022)
+                 (+ sign (* r (expt 2 1074)))
+                 (+ sign
+                    (* (+ e 1023) #x10000000000000)
+                    (- (* r (expt 2 (- 52 e))) #x10000000000000))))))))
 
-(define (read-varbytes in)
-  (let ((n (read-varint in)))
-    (let ((b (read-bytevector n in)))
-      (unless (= n (bytevector-length b))
-        (error #f "Short read"))
-      b)))
+(define (read-float64 rd)
+  (let* ((start (reader-take! rd 8))
+         (b (reader-buffer rd)))
+    (let loop ((i 7) (bits 0))
+      (if (< i 0)
+          (bits->float64 bits)
+          (loop (- i 1)
+                (+ (* bits 256) (bytevector-u8-ref b (+ start i))))))))
 
-(define (write-varbytes out b)
-  (write-varint out (bytevector-length b))
-  (write-bytevector b out))
+(define (write-float64 x)
+  (let loop ((i 0) (bits (float64->bits x)))
+    (when (< i 8)
+      (put-byte (bitwise-and bits #xff))
+      (loop (+ i 1) (arithmetic-shift bits -8)))))
+
+;; A pair is at least one byte for its head and one for the tag of its
+;; tail, so both are asked for in one read.
+(define (read-pair-head rd)
+  (reader-fill! rd 2)
+  (read-sexp rd))
+
+(define (read-tagged rd tag)
+  (case tag
+    ((#x0) '())
+    ((#x1) #f)
+    ((#x2) #t)
+    ((#x3) (read-varbytes rd))
+    ((#x4) (read-varint rd))
+    ((#x5) (- (read-varint rd)))
+    ((#x6) (read-float64 rd))
+    ((#xc) (let loop ((heads (list (read-pair-head rd))))
+             (let ((tag (read-varint rd)))
+               (if (= tag #xc)
+                   (loop (cons (read-pair-head rd) heads))
+                   (let rev ((heads heads) (tail (read-tagged rd tag)))
+                     (if (null? heads)
+                         tail
+                         (rev (cdr heads) (cons (car heads) tail))))))))
+    ((#xd) (let* ((n (read-varint rd))
+                  (v (make-vector n)))
+             ;; Each element is at least one byte.
+             (reader-fill! rd (min n block-size))
+             (let loop ((i 0))
+               (cond ((= i n) v)
+                     (else (vector-set! v i (read-sexp rd))
+                           (loop (+ i 1)))))))
+    ((#xe) (utf8->string (read-varbytes rd)))
+    ((#xf) (string->symbol (utf8->string (read-varbytes rd))))
+    (else (error #f (string-append "Read unknown type tag: #x"
+                                   (number->string tag 16))))))
+
+(define (read-sexp rd)
+  (read-tagged rd (read-varint rd)))
 
 (define (read-binary-sexp in)
-  (let ((tag (read-varint-or-false in)))
-    (case tag
-      ((#f)  (eof-object))
-      ((#x0) '())
-      ((#x1) #f)
-      ((#x2) #t)
-      ((#x3) (read-varbytes in))
-      ((#x4) (read-varint in))
-      ((#x5) (- (read-varint in)))
-      ((#xc) (let* ((a (read-binary-sexp in))
-                    (d (read-binary-sexp in)))
-               (cons a d)))
-      ((#xd) (let* ((n (read-varint in))
-                    (v (make-vector n)))
-               (let loop ((i 0))
-                 (cond ((= i n) v)
-                       (else (vector-set! v i (read-binary-sexp in))
-                             (loop (+ i 1)))))))
-      ((#xe) (utf8->string (read-varbytes in)))
-      ((#xf) (string->symbol (utf8->string (read-varbytes in))))
-      (else (error #f (string-append "Read unknown type tag: #x"
-                                     (number->string tag)))))))
+  (let ((rd (port-reader in)))
+    (if (not (reader-fill! rd 1))
+        (eof-object)
+        (let ((x (read-sexp rd)))
+          (save-reader! rd)
+          x))))
 
-(define (write-binary-sexp out x)
+(define (write-sexp x)
   (cond ((null? x)
-         (write-varint out 0))
+         (write-varint 0))
         ((eqv? #f x)
-         (write-varint out 1))
+         (write-varint 1))
         ((eqv? #t x)
-         (write-varint out 2))
+         (write-varint 2))
         ((bytevector? x)
-         (write-varint out 3)
-         (write-varbytes out x))
-        ((integer? x)
-         (write-varint out (if (>= x 0) #x4 #x5))
-         (write-varint out (abs x)))
+         (write-varint 3)
+         (write-varbytes x))
+        ((and (integer? x) (exact? x))
+         (write-varint (if (>= x 0) #x4 #x5))
+         (write-varint (abs x)))
+        ((real? x)
+         (write-varint #x6)
+         (write-float64 x))
         ((pair? x)
-         (write-varint out #xc)
-         (write-binary-sexp out (car x))
-         (write-binary-sexp out (cdr x)))
+         (write-varint #xc)
+         (write-sexp (car x))
+         (write-sexp (cdr x)))
         ((vector? x)
-         (write-varint out #xd)
-         (vector-for-each (lambda (elt) (write-binary-sexp out elt)) x))
+         (write-varint #xd)
+         (write-varint (vector-length x))
+         (vector-for-each write-sexp x))
         ((string? x)
-         (write-varint out #xe)
-         (write-varbytes out (string->utf8 x)))
+         (write-varint #xe)
+         (write-varbytes (string->utf8 x)))
         ((symbol? x)
-         (write-varint out #xf)
-         (write-varbytes out (string->utf8 (symbol->string x))))
+         (write-varint #xf)
+         (write-varbytes (string->utf8 (symbol->string x))))
         (else
          (error #f "Don't know how to write that kind of object"))))
+
+(define (write-binary-sexp out x)
+  (set! write-end 0)
+  (write-sexp x)
+  (write-bytevector write-buffer out 0 write-end)
+  (set! write-end 0)
+  ;; Do not hold on to a buffer that one big message blew up.
+  (when (> (bytevector-length write-buffer) (* 256 block-size))
+    (set! write-buffer (make-bytevector block-size))))
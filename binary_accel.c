@@ -0,0 +1,475 @@
+// SPDX-FileCopyrightText: 2019 Lassi Kortela
+// SPDX-License-Identifier: ISC
+
+// Optional accelerator for binary.py. Decodes the same wire format as
+// sexp_binary_read.c, but straight into Python objects without building
+// a struct sexp tree first, and gives the same results as the pure
+// Python decoder.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sexp.h"
+#include "sexp_binary_read.h"
+
+#define MAX_DEPTH SEXP_BINARY_MAX_DEPTH
+
+// Why decoding stopped before the end of the buffer.
+#define SHORT 1  // the buffer ends in the middle of a sexp
+#define STUCK 2  // the pure decoder has to decode or reject this sexp
+
+struct decode {
+    const unsigned char *pos;
+    const unsigned char *end;
+    int depth;
+    int status;
+};
+
+static PyObject *symbol_factory;  // makes Python symbols from their names
+static PyObject *symbol_cache;  // Python symbols by name
+
+static int decode_varint(struct decode *d, uint64_t *out)
+{
+    uint64_t value;
+    unsigned int shift;
+    unsigned char byte;
+
+    value = 0;
+    for (shift = 0;; shift += 7) {
+        if (d->pos >= d->end) {
+            d->status = SHORT;
+            return 0;
+        }
+        byte = *d->pos++;
+        if ((shift > 63) || ((shift == 63) && ((byte & 0x7f) > 1))) {
+            d->status = STUCK;  // too big for 64 bits
+            return 0;
+        }
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    *out = value;
+    return 1;
+}
+
+static const char *decode_varbytes(struct decode *d, Py_ssize_t *out_nbyte)
+{
+    const char *bytes;
+    uint64_t nbyte;
+
+    if (!decode_varint(d, &nbyte)) {
+        return 0;
+    }
+    if (nbyte > (uint64_t)(d->end - d->pos)) {
+        d->status = SHORT;
+        return 0;
+    }
+    bytes = (const char *)d->pos;
+    d->pos += nbyte;
+    *out_nbyte = (Py_ssize_t)nbyte;
+    return bytes;
+}
+
+static PyObject *decode_symbol(struct decode *d)
+{
+    const char *bytes;
+    PyObject *name;
+    PyObject *sym;
+    Py_ssize_t nbyte;
+
+    if (!(bytes = decode_varbytes(d, &nbyte))) {
+        return 0;
+    }
+    if (!(name = PyUnicode_DecodeUTF8(bytes, nbyte, 0))) {
+        return 0;
+    }
+    if ((sym = PyDict_GetItemWithError(symbol_cache, name))) {
+        Py_INCREF(sym);
+    } else if (!PyErr_Occurred() &&
+               (sym = PyObject_CallOneArg(symbol_factory, name))) {
+        if (PyDict_SetItem(symbol_cache, name, sym)) {
+            Py_CLEAR(sym);
+        }
+    }
+    Py_DECREF(name);
+    return sym;
+}
+
+static PyObject *decode_sexp(struct decode *d);
+
+static PyObject *decode_list(struct decode *d)
+{
+    PyObject *list;
+    PyObject *elt;
+    uint64_t tag;
+
+    if (!(list = PyList_New(0))) {
+        return 0;
+    }
+    do {
+        if (!(elt = decode_sexp(d))) {
+            Py_DECREF(list);
+            return 0;
+        }
+        if (PyList_Append(list, elt)) {
+            Py_DECREF(elt);
+            Py_DECREF(list);
+            return 0;
+        }
+        Py_DECREF(elt);
+        if (!decode_varint(d, &tag)) {
+            Py_DECREF(list);
+            return 0;
+        }
+    } while (tag == 0xc);
+    if (tag) {
+        d->status = STUCK;  // improper list
+        Py_DECREF(list);
+        return 0;
+    }
+    return list;
+}
+
+static PyObject *decode_vector(struct decode *d)
+{
+    PyObject *elts;
+    PyObject *elt;
+    PyObject *tuple;
+    uint64_t i, n;
+
+    if (!decode_varint(d, &n)) {
+        return 0;
+    }
+    if (n > (uint64_t)(d->end - d->pos)) {
+        // Every element takes at least one byte, so this vector does
+        // not fit. Do not trust n with a big allocation; decode what is
+        // there to find out whether it is short or malformed.
+        if (!(elts = PyList_New(0))) {
+            return 0;
+        }
+        for (i = 0; i < n; i++) {
+            if (!(elt = decode_sexp(d)) || PyList_Append(elts, elt)) {
+                Py_XDECREF(elt);
+                Py_DECREF(elts);
+                return 0;
+            }
+            Py_DECREF(elt);
+        }
+        tuple = PyList_AsTuple(elts);
+        Py_DECREF(elts);
+        return tuple;
+    }
+    if (!(tuple = PyTuple_New((Py_ssize_t)n))) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (!(elt = decode_sexp(d))) {
+            Py_DECREF(tuple);
+            return 0;
+        }
+        PyTuple_SET_ITEM(tuple, (Py_ssize_t)i, elt);
+    }
+    return tuple;
+}
+
+static PyObject *decode_tagged(struct decode *d, uint64_t tag)
+{
+    const char *bytes;
+    Py_ssize_t nbyte;
+    uint64_t value;
+    double fvalue;
+    int i;
+
+    switch (tag) {
+    case 0:
+        Py_RETURN_NONE;
+    case 1:
+        Py_RETURN_FALSE;
+    case 2:
+        Py_RETURN_TRUE;
+    case 3:
+        if (!(bytes = decode_varbytes(d, &nbyte))) {
+            return 0;
+        }
+        return PyBytes_FromStringAndSize(bytes, nbyte);
+    case 4:
+        if (!decode_varint(d, &value)) {
+            return 0;
+        }
+        return PyLong_FromUnsignedLongLong(value);
+    case 5:
+        if (!decode_varint(d, &value)) {
+            return 0;
+        }
+        if (value > (uint64_t)INT64_MAX) {
+            d->status = STUCK;
+            return 0;
+        }
+        return PyLong_FromLongLong(-(int64_t)value);
+    case 6:
+        if (d->end - d->pos < 8) {
+            d->status = SHORT;
+            return 0;
+        }
+        for (value = 0, i = 8; i;) {
+            value = (value << 8) | d->pos[--i];  // little-endian
+        }
+        d->pos += 8;
+        memcpy(&fvalue, &value, sizeof(fvalue));
+        return PyFloat_FromDouble(fvalue);
+    case 0xc:
+        return decode_list(d);
+    case 0xd:
+        return decode_vector(d);
+    case 0xe:
+        if (!(bytes = decode_varbytes(d, &nbyte))) {
+            return 0;
+        }
+        return PyUnicode_DecodeUTF8(bytes, nbyte, 0);
+    case 0xf:
+        return decode_symbol(d);
+    }
+    d->status = STUCK;  // unknown type tag
+    return 0;
+}
+
+static PyObject *decode_sexp(struct decode *d)
+{
+    PyObject *obj;
+    uint64_t tag;
+
+    if (!decode_varint(d, &tag)) {
+        return 0;
+    }
+    if (++d->depth > MAX_DEPTH) {
+        d->status = STUCK;
+        return 0;
+    }
+    obj = decode_tagged(d, tag);
+    d->depth--;
+    return obj;
+}
+
+// decode(buffer, pos) decodes every complete sexp in buffer from pos on.
+// Returns (objects, pos, stuck), where pos is just past the last object.
+// stuck is false if decoding stopped because the buffer ended, and true
+// if the sexp at pos is something this module does not decode, such as
+// an integer too big for 64 bits or a malformed sexp. The pure Python
+// decoder then takes over to decode it or raise the right error.
+static PyObject *decode(PyObject *self, PyObject *args)
+{
+    const unsigned char *start;
+    struct decode d;
+    PyObject *objs;
+    PyObject *obj;
+    Py_buffer view;
+    Py_ssize_t pos;
+
+    (void)self;
+    if (!symbol_factory) {
+        PyErr_SetString(PyExc_RuntimeError, "no symbol factory");
+        return 0;
+    }
+    if (!PyArg_ParseTuple(args, "y*n", &view, &pos)) {
+        return 0;
+    }
+    if ((pos < 0) || (pos > view.len)) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "position out of range");
+        return 0;
+    }
+    if (!(objs = PyList_New(0))) {
+        PyBuffer_Release(&view);
+        return 0;
+    }
+    start = view.buf;
+    d.pos = start + pos;
+    d.end = start + view.len;
+    d.depth = 0;
+    d.status = 0;
+    while (d.pos < d.end) {
+        if (!(obj = decode_sexp(&d))) {
+            if (!d.status) {
+                d.status = STUCK;  // a Python error, such as bad UTF-8
+            }
+            PyErr_Clear();
+            break;
+        }
+        if (PyList_Append(objs, obj)) {
+            Py_DECREF(obj);
+            Py_DECREF(objs);
+            PyBuffer_Release(&view);
+            return 0;
+        }
+        Py_DECREF(obj);
+        pos = d.pos - start;
+    }
+    PyBuffer_Release(&view);
+    return Py_BuildValue("(NnO)", objs, pos,
+                         (d.status == STUCK) ? Py_True : Py_False);
+}
+
+// Moves past one item of a sexp, adding the items inside a list or vector
+// to *pending. If the buffer ends first, returns at least how many more
+// bytes the item needs.
+static uint64_t skip_item(struct decode *d, uint64_t *pending)
+{
+    uint64_t tag, n, left;
+
+    if (!decode_varint(d, &tag)) {
+        return 1;
+    }
+    left = (uint64_t)(d->end - d->pos);
+    switch (tag) {
+    case 0x0:
+    case 0x1:
+    case 0x2:
+        break;
+    case 0x3:
+    case 0xe:
+    case 0xf:
+        if (!decode_varint(d, &n)) {
+            return 1;
+        }
+        left = (uint64_t)(d->end - d->pos);
+        if (n > left) {
+            d->status = SHORT;
+            return n - left;
+        }
+        d->pos += n;
+        break;
+    case 0x4:
+    case 0x5:
+        // Integers of any size, which the pure decoder can read.
+        do {
+            if (d->pos >= d->end) {
+                d->status = SHORT;
+                return 1;
+            }
+        } while (*d->pos++ & 0x80);
+        break;
+    case 0x6:
+        if (left < 8) {
+            d->status = SHORT;
+            return 8 - left;
+        }
+        d->pos += 8;
+        break;
+    case 0xc:
+        *pending += 2;
+        break;
+    case 0xd:
+        if (!decode_varint(d, &n)) {
+            return 1;
+        }
+        left = (uint64_t)(d->end - d->pos);
+        if (n > left) {
+            d->status = SHORT;  // every element takes at least a byte
+            return n - left;
+        }
+        *pending += n;
+        break;
+    default:
+        d->status = STUCK;
+    }
+    return 0;
+}
+
+// Moves past *pending items without decoding them, counting the items
+// still to be skipped rather than recursing. If the buffer ends first,
+// d->pos and *pending are left at the item that did not fit, so that
+// skipping can resume there.
+static uint64_t skip_sexp(struct decode *d, uint64_t *pending)
+{
+    const unsigned char *mark;
+    uint64_t more;
+
+    while (*pending) {
+        mark = d->pos;
+        more = skip_item(d, pending);
+        if (d->status) {
+            d->pos = mark;
+            return more;
+        }
+        --*pending;
+    }
+    return 0;
+}
+
+// skip(buffer, pos, pending=1) returns the position just past the sexp
+// at pos and the pending - 1 after it. If the buffer ends first, returns
+// (pos, pending, need) to resume from once the buffer is at least need
+// bytes long. Returns None if the pure decoder has to look at it.
+static PyObject *skip(PyObject *self, PyObject *args)
+{
+    struct decode d;
+    Py_buffer view;
+    Py_ssize_t pos;
+    unsigned long long pending;
+    uint64_t npending, more;
+
+    (void)self;
+    pending = 1;
+    if (!PyArg_ParseTuple(args, "y*n|K", &view, &pos, &pending)) {
+        return 0;
+    }
+    if ((pos < 0) || (pos > view.len)) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "position out of range");
+        return 0;
+    }
+    d.pos = (const unsigned char *)view.buf + pos;
+    d.end = (const unsigned char *)view.buf + view.len;
+    d.depth = 0;
+    d.status = 0;
+    npending = pending;
+    more = skip_sexp(&d, &npending);
+    pos = d.pos - (const unsigned char *)view.buf;
+    PyBuffer_Release(&view);
+    if (d.status == STUCK) {
+        Py_RETURN_NONE;
+    }
+    if (d.status == SHORT) {
+        if (more > (uint64_t)(PY_SSIZE_T_MAX - view.len)) {
+            Py_RETURN_NONE;
+        }
+        return Py_BuildValue("(nKn)", pos, (unsigned long long)npending,
+                             view.len + (Py_ssize_t)more);
+    }
+    return PyLong_FromSsize_t(pos);
+}
+
+// set_symbol_factory(f) makes symbols by calling f with their name.
+static PyObject *set_symbol_factory(PyObject *self, PyObject *factory)
+{
+    (void)self;
+    PyDict_Clear(symbol_cache);
+    Py_INCREF(factory);
+    Py_XSETREF(symbol_factory, factory);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef methods[] = {
+    { "decode", decode, METH_VARARGS, "Decode complete sexps." },
+    { "skip", skip, METH_VARARGS, "Skip one sexp." },
+    { "set_symbol_factory", set_symbol_factory, METH_O,
+      "Set the function that makes symbols." },
+    { 0, 0, 0, 0 },
+};
+
+static struct PyModuleDef module = {
+    PyModuleDef_HEAD_INIT, "_binary_accel", 0, -1, methods, 0, 0, 0, 0,
+};
+
+PyMODINIT_FUNC PyInit__binary_accel(void)
+{
+    if (!symbol_cache && !(symbol_cache = PyDict_New())) {
+        return 0;
+    }
+    return PyModule_Create(&module);
+}
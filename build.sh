@@ -18,11 +18,46 @@ $CC $CFLAGS -I . -c sexp.c
 $CC $CFLAGS -I . -c sexp_binary_read.c
 $CC $CFLAGS -I . -c sexp_binary_write.c
 $CC $CFLAGS -I . -c sexp_binary_pipe.c
+# The lazy reader is for C clients; the drivers do not link it.
+$CC $CFLAGS -I . -c sexp_binary_lazy.c
 
 $CC $CFLAGS $CFLAGS_SQLITE3 -I . -c driver-sqlite.c
-$CC $LFLAGS $LFLAGS_SQLITE3 -o driver-sqlite \
+$CC $LFLAGS -o driver-sqlite \
     sexp.o \
     sexp_binary_read.o \
     sexp_binary_write.o \
     sexp_binary_pipe.o \
-    driver-sqlite.o
+    driver-sqlite.o \
+    $LFLAGS_SQLITE3
+
+$CC $CFLAGS $CFLAGS_PQ -I . -c driver-postgres.c
+$CC $LFLAGS -o driver-postgres \
+    sexp.o \
+    sexp_binary_read.o \
+    sexp_binary_write.o \
+    sexp_binary_pipe.o \
+    driver-postgres.o \
+    $LFLAGS_PQ
+
+$CC $CFLAGS -I . -c echo-binary.c
+$CC $LFLAGS -o echo-binary \
+    sexp.o \
+    sexp_binary_read.o \
+    sexp_binary_write.o \
+    sexp_binary_pipe.o \
+    echo-binary.o
+
+# libFuzzer target for the C reader. It needs clang: FUZZ=1 sh build.sh
+if [ -n "${FUZZ:-}" ]; then
+    $CC $CFLAGS -g -O1 -fsanitize=fuzzer,address,undefined -I . \
+        -o fuzz-binary-read fuzz-binary-read.c \
+        sexp.c sexp_binary_read.c sexp_binary_write.c sexp_binary_lazy.c
+fi
+
+# Optional accelerator for binary.py, built only where Python is.
+PYTHON_CONFIG=${PYTHON_CONFIG:-python3-config}
+if command -v "$PYTHON_CONFIG" >/dev/null 2>&1; then
+    $CC $CFLAGS -O2 -fPIC -shared $($PYTHON_CONFIG --includes) \
+        -o _binary_accel$($PYTHON_CONFIG --extension-suffix) \
+        binary_accel.c
+fi
@@ -1,6 +1,7 @@
 // SPDX-FileCopyrightText: 2019 Lassi Kortela
 // SPDX-License-Identifier: ISC
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,131 +12,2205 @@
 #include <sexp_binary_read.h>
 #include <sexp_binary_write.h>
 
+#include <libpq-fe.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <winsock2.h>
+#define poll WSAPoll
+#endif
+
+#define MAX_PIPELINE 256  // commands read ahead before answering any
+#define STREAM_CHUNK_ROWS 1000  // rows per result in chunked rows mode
+#define COPY_BUFFER_SIZE 65536  // COPY data sent or read in one go
+
+#define COPY_IN_RAW 1
+#define COPY_IN_ROWS 2
+#define COPY_OUT_RAW 3
+#define COPY_OUT_ROWS 4
+
+// Turns one non-null column value in binary wire format into a sexp.
+typedef struct sexp *(*decode_func_t)(const char *bytes, int nbyte);
+
+struct decoder {
+    Oid oid;
+    decode_func_t func;
+};
+
+// Appends one value, with its length in front, in binary wire format.
+// Returns false if the value does not fit the column type.
+typedef int (*encode_func_t)(struct sexp *value);
+
+struct encoder {
+    Oid oid;
+    encode_func_t func;
+};
+
+// Bytes from start to fill are in use.
+struct buffer {
+    char *bytes;
+    size_t start;
+    size_t fill;
+    size_t cap;
+};
+
+struct cmd;
+
+// A command that has been read, and if it is a query already sent to the
+// server, but not yet answered.
+struct job {
+    struct sexp *command;
+    const struct cmd *cmd;
+    struct sexp *args;
+    struct sexp *response;  // set if the command failed before it was sent
+};
+
 static PGconn *database;
+static int should_quit;
+static struct sexp_binary_read *rd;
+static struct sexp_binary_write *wr;
+
+// Rows of the last execute are streamed from the server a row or a chunk
+// at a time, so that only the result holding the rows not yet handed out
+// by read-row is in memory. query_open is set until every result of the
+// query, and the sync point behind it, has been taken off the connection.
+static PGresult *result;
+static int result_row;
+static int query_open;
+static decode_func_t *result_decoders;
+static int nresult_decoder;
+static int decoders_ready;
+
+// While a COPY runs, copy_state says which kind, and copy_buf holds data
+// on its way to or from the server. In row mode the columns are encoded
+// or decoded according to their types.
+static int copy_state;
+static struct buffer copy_buf;
+static encode_func_t *copy_encoders;
+static decode_func_t *copy_decoders;
+static int ncopy_decoder;
+static int ncopy_column;
+static int copy_header_done;
+static int copy_out_ended;
+
+static struct job jobs[MAX_PIPELINE];
+static size_t njob;
+
+static const char *valid_option_names[] = {
+    "client_encoding", "connect_timeout", "dbname", "host",
+    "options",         "password",        "port",   "user",
+    0,
+};
+
+static struct sexp_symbol_index cmd_index;
+static struct sexp_symbol_index option_index;
+
+static void die(const char *msg)
+{
+    if (msg) {
+        fprintf(stderr, "%s\n", msg);
+    }
+    exit(2);
+}
+
+static void diemem(void) { die("out of memory"); }
+
+static void symbol_index_add(struct sexp_symbol_index *index,
+                             const char *name, size_t value)
+{
+    if (!sexp_symbol_index_add(index, name, value)) {
+        diemem();
+    }
+}
+
+// Returns true if another command has already started arriving. Without
+// poll() we cannot tell, so we say no and answer commands one at a time.
+static int input_pending(void)
+{
+#ifndef _WIN32
+    struct pollfd pfd;
+    int n;
+
+    if (sexp_binary_read_nbuffered(rd)) {
+        return 1;
+    }
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    while (((n = poll(&pfd, 1, 0)) == -1) && (errno == EINTR))
+        ;
+    return n > 0;
+#else
+    return 0;
+#endif
+}
+
+// Sends whatever libpq has queued for the server and waits until the
+// server has sent something back. Returns false if the connection broke.
+static int wait_for_server(void)
+{
+    struct pollfd pfd;
+    int flush;
+
+    if ((flush = PQflush(database)) == -1) {
+        return 0;
+    }
+    pfd.fd = PQsocket(database);
+    pfd.events = POLLIN | (flush ? POLLOUT : 0);
+    pfd.revents = 0;
+    while (poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    return (pfd.revents & POLLOUT) || PQconsumeInput(database);
+}
+
+// Returns the next result of the pipeline, or null at the end of a query.
+static PGresult *next_result(void)
+{
+    while (PQisBusy(database)) {
+        if (!wait_for_server()) {
+            break;
+        }
+    }
+    return PQgetResult(database);
+}
+
+static struct sexp *new_ok(void)
+{
+    return sexp_new_pair(sexp_new_symbol("ok"), sexp_new_null());
+}
+
+static struct sexp *new_error(const char *code, const char *message)
+{
+    return sexp_new_pair(
+    sexp_new_symbol("error"),
+    sexp_new_pair(sexp_new_symbol(code),
+                  sexp_new_pair(sexp_new_string(message), sexp_new_null())));
+}
+
+// libpq's messages end in a newline, which would be noise in a response.
+static struct sexp *new_database_error(const char *message)
+{
+    size_t len;
+
+    len = strlen(message);
+    while (len && (message[len - 1] == '\n')) {
+        len--;
+    }
+    return sexp_new_pair(
+    sexp_new_symbol("error"),
+    sexp_new_pair(sexp_new_symbol("database"),
+                  sexp_new_pair(sexp_new_string_bytes(message, len),
+                                sexp_new_null())));
+}
+
+static struct sexp *new_result_error(PGresult *res)
+{
+    const char *message;
+
+    if (!(message = PQresultErrorField(res, PG_DIAG_MESSAGE_PRIMARY))) {
+        message = PQresultErrorMessage(res);
+    }
+    return new_database_error(message);
+}
+
+// Commands come either as a list (name arg ...), in which case args is
+// the tail, or as a vector #(name arg ...), in which case args is the
+// whole vector.
+static size_t args_len(struct sexp *args)
+{
+    if (sexp_is_vector(args)) {
+        return sexp_vector_len(args) - 1;
+    }
+    return sexp_list_len(args);
+}
+
+static struct sexp *args_ref(struct sexp *args, size_t i)
+{
+    if (sexp_is_vector(args)) {
+        return sexp_vector_ref(args, i + 1);
+    }
+    return sexp_list_ref(args, i);
+}
+
+static void clear_result(void)
+{
+    PQclear(result);
+    result = 0;
+    result_row = 0;
+}
+
+static uint64_t get_be(const char *bytes, int nbyte)
+{
+    uint64_t value;
+    int i;
+
+    value = 0;
+    for (i = 0; i < nbyte; i++) {
+        value = (value << 8) | (unsigned char)bytes[i];
+    }
+    return value;
+}
+
+// Types we have no decoder for come back as their raw wire bytes. Cast
+// them to text in the query to get the usual text representation.
+static struct sexp *decode_bytes(const char *bytes, int nbyte)
+{
+    return sexp_new_bytevector_bytes(bytes, nbyte);
+}
+
+static struct sexp *decode_text(const char *bytes, int nbyte)
+{
+    return sexp_new_string_bytes(bytes, nbyte);
+}
+
+static struct sexp *decode_bool(const char *bytes, int nbyte)
+{
+    if (nbyte != 1) {
+        return decode_bytes(bytes, nbyte);
+    }
+    return sexp_new_bool(bytes[0]);
+}
+
+static struct sexp *decode_int2(const char *bytes, int nbyte)
+{
+    if (nbyte != 2) {
+        return decode_bytes(bytes, nbyte);
+    }
+    return sexp_new_int64((int16_t)get_be(bytes, 2));
+}
+
+static struct sexp *decode_int4(const char *bytes, int nbyte)
+{
+    if (nbyte != 4) {
+        return decode_bytes(bytes, nbyte);
+    }
+    return sexp_new_int64((int32_t)get_be(bytes, 4));
+}
+
+static struct sexp *decode_int8(const char *bytes, int nbyte)
+{
+    if (nbyte != 8) {
+        return decode_bytes(bytes, nbyte);
+    }
+    return sexp_new_int64((int64_t)get_be(bytes, 8));
+}
+
+static struct sexp *decode_oid(const char *bytes, int nbyte)
+{
+    if (nbyte != 4) {
+        return decode_bytes(bytes, nbyte);
+    }
+    return sexp_new_int64((uint32_t)get_be(bytes, 4));
+}
+
+static struct sexp *decode_float4(const char *bytes, int nbyte)
+{
+    uint32_t bits;
+    float value;
+
+    if (nbyte != 4) {
+        return decode_bytes(bytes, nbyte);
+    }
+    bits = (uint32_t)get_be(bytes, 4);
+    memcpy(&value, &bits, sizeof(value));
+    return sexp_new_float64(value);
+}
+
+static struct sexp *decode_float8(const char *bytes, int nbyte)
+{
+    uint64_t bits;
+    double value;
+
+    if (nbyte != 8) {
+        return decode_bytes(bytes, nbyte);
+    }
+    bits = get_be(bytes, 8);
+    memcpy(&value, &bits, sizeof(value));
+    return sexp_new_float64(value);
+}
+
+// A numeric is a sign, a scale, and base-10000 digits of which the first
+// has the given weight. It is returned as a decimal string since it can
+// be more precise than any native number.
+static struct sexp *decode_numeric(const char *bytes, int nbyte)
+{
+    struct sexp *sexp;
+    char *str;
+    char *p;
+    int ndigit, weight, sign, dscale, d, i;
+
+    if (nbyte < 8) {
+        return decode_bytes(bytes, nbyte);
+    }
+    ndigit = (int16_t)get_be(bytes, 2);
+    weight = (int16_t)get_be(bytes + 2, 2);
+    sign = (int)get_be(bytes + 4, 2);
+    dscale = (int16_t)get_be(bytes + 6, 2);
+    if ((ndigit < 0) || (dscale < 0) || (nbyte != 8 + 2 * ndigit)) {
+        return decode_bytes(bytes, nbyte);
+    }
+    for (d = 0; d < ndigit; d++) {
+        if (get_be(bytes + 8 + 2 * d, 2) > 9999) {
+            return decode_bytes(bytes, nbyte);
+        }
+    }
+    if (sign == 0xc000) {
+        return sexp_new_string("NaN");
+    } else if (sign == 0xd000) {
+        return sexp_new_string("Infinity");
+    } else if (sign == 0xf000) {
+        return sexp_new_string("-Infinity");
+    }
+    if (!(str = malloc(4 * ((weight < 0) ? 1 : weight + 1) + dscale + 8))) {
+        diemem();
+    }
+    p = str;
+    if (sign == 0x4000) {
+        *p++ = '-';
+    }
+    if (weight < 0) {
+        *p++ = '0';
+    }
+    for (d = 0; d <= weight; d++) {
+        i = (d < ndigit) ? (int)get_be(bytes + 8 + 2 * d, 2) : 0;
+        p += d ? sprintf(p, "%04d", i) : sprintf(p, "%d", i);
+    }
+    if (dscale > 0) {
+        *p++ = '.';
+        for (d = weight + 1, i = 0; i < dscale; d++, i += 4) {
+            p += sprintf(p, "%04d",
+                         ((d >= 0) && (d < ndigit))
+                         ? (int)get_be(bytes + 8 + 2 * d, 2)
+                         : 0);
+        }
+        p -= i - dscale;  // drop digits past the scale
+    }
+    sexp = sexp_new_string_bytes(str, p - str);
+    free(str);
+    return sexp;
+}
+
+static struct sexp *decode_uuid(const char *bytes, int nbyte)
+{
+    char str[37];
+    char *p;
+    int i;
+
+    if (nbyte != 16) {
+        return decode_bytes(bytes, nbyte);
+    }
+    p = str;
+    for (i = 0; i < 16; i++) {
+        if ((i == 4) || (i == 6) || (i == 8) || (i == 10)) {
+            *p++ = '-';
+        }
+        p += sprintf(p, "%02x", (unsigned char)bytes[i]);
+    }
+    return sexp_new_string_bytes(str, 36);
+}
+
+// Binary jsonb is a version byte followed by the JSON text.
+static struct sexp *decode_jsonb(const char *bytes, int nbyte)
+{
+    if ((nbyte < 1) || (bytes[0] != 1)) {
+        return decode_bytes(bytes, nbyte);
+    }
+    return sexp_new_string_bytes(bytes + 1, nbyte - 1);
+}
+
+// Dates count days and timestamps microseconds from 2000-01-01, the
+// Postgres epoch. They come back in the ISO style of the server's text
+// output, with timestamptz in UTC.
+#define USECS_PER_DAY INT64_C(86400000000)
+#define USECS_PER_HOUR INT64_C(3600000000)
+#define USECS_PER_MINUTE INT64_C(60000000)
+#define USECS_PER_SECOND 1000000
+
+static int64_t floor_div(int64_t a, int64_t b)
+{
+    return (a / b) - ((a % b) && ((a < 0) != (b < 0)));
+}
+
+// Writes the date days after the Postgres epoch. Returns true if the
+// year is BC, which goes at the very end of a timestamp.
+static int put_date(char **pp, int64_t days)
+{
+    int64_t z, era, doe, yoe, doy, mp, y, m, d;
+
+    z = days + 10957 + 719468;  // days from 0000-03-01
+    era = floor_div(z, 146097);
+    doe = z - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = (mp < 10) ? mp + 3 : mp - 9;
+    y = yoe + era * 400 + (m <= 2);
+    *pp += sprintf(*pp, "%04lld-%02d-%02d",
+                   (long long)((y > 0) ? y : 1 - y), (int)m, (int)d);
+    return y <= 0;
+}
+
+// Writes fractional seconds without trailing zeros, if there are any.
+static void put_fraction(char **pp, int64_t usecs)
+{
+    char *p;
+
+    if (usecs) {
+        p = *pp + sprintf(*pp, ".%06d", (int)usecs);
+        while (p[-1] == '0') {
+            p--;
+        }
+        *pp = p;
+    }
+}
+
+static void put_time(char **pp, int64_t usecs)
+{
+    *pp += sprintf(*pp, "%02d:%02d:%02d", (int)(usecs / USECS_PER_HOUR),
+                   (int)(usecs / USECS_PER_MINUTE % 60),
+                   (int)(usecs / USECS_PER_SECOND % 60));
+    put_fraction(pp, usecs % USECS_PER_SECOND);
+}
+
+static struct sexp *decode_date(const char *bytes, int nbyte)
+{
+    char str[32];
+    char *p;
+    int32_t days;
+
+    if (nbyte != 4) {
+        return decode_bytes(bytes, nbyte);
+    }
+    days = (int32_t)get_be(bytes, 4);
+    if ((days == INT32_MAX) || (days == INT32_MIN)) {
+        return sexp_new_string((days > 0) ? "infinity" : "-infinity");
+    }
+    p = str;
+    if (put_date(&p, days)) {
+        p += sprintf(p, " BC");
+    }
+    return sexp_new_string_bytes(str, p - str);
+}
+
+static struct sexp *new_timestamp(int64_t usecs, const char *zone)
+{
+    char str[64];
+    char *p;
+    int64_t days;
+    int bc;
+
+    if ((usecs == INT64_MAX) || (usecs == INT64_MIN)) {
+        return sexp_new_string((usecs > 0) ? "infinity" : "-infinity");
+    }
+    days = floor_div(usecs, USECS_PER_DAY);
+    p = str;
+    bc = put_date(&p, days);
+    *p++ = ' ';
+    put_time(&p, usecs - days * USECS_PER_DAY);
+    p += sprintf(p, "%s%s", zone, bc ? " BC" : "");
+    return sexp_new_string_bytes(str, p - str);
+}
+
+static struct sexp *decode_timestamp(const char *bytes, int nbyte)
+{
+    if (nbyte != 8) {
+        return decode_bytes(bytes, nbyte);
+    }
+    return new_timestamp((int64_t)get_be(bytes, 8), "");
+}
+
+static struct sexp *decode_timestamptz(const char *bytes, int nbyte)
+{
+    if (nbyte != 8) {
+        return decode_bytes(bytes, nbyte);
+    }
+    return new_timestamp((int64_t)get_be(bytes, 8), "+00");
+}
+
+static struct sexp *decode_time(const char *bytes, int nbyte)
+{
+    char str[32];
+    char *p;
+
+    if (nbyte != 8) {
+        return decode_bytes(bytes, nbyte);
+    }
+    p = str;
+    put_time(&p, (int64_t)get_be(bytes, 8));
+    return sexp_new_string_bytes(str, p - str);
+}
+
+// timetz is followed by its zone, in seconds west of UTC.
+static struct sexp *decode_timetz(const char *bytes, int nbyte)
+{
+    char str[48];
+    char *p;
+    int32_t east;
+
+    if (nbyte != 12) {
+        return decode_bytes(bytes, nbyte);
+    }
+    p = str;
+    put_time(&p, (int64_t)get_be(bytes, 8));
+    east = -(int32_t)get_be(bytes + 8, 4);
+    *p++ = (east < 0) ? '-' : '+';
+    east = (east < 0) ? -east : east;
+    p += sprintf(p, "%02d", (int)(east / 3600));
+    if (east % 3600) {
+        p += sprintf(p, ":%02d", (int)(east / 60 % 60));
+    }
+    if (east % 60) {
+        p += sprintf(p, ":%02d", (int)(east % 60));
+    }
+    return sexp_new_string_bytes(str, p - str);
+}
+
+// Intervals come back as ISO 8601 durations such as P1Y2M3DT4H5M6.5S,
+// which Postgres also takes as input. Each part keeps its own sign.
+static struct sexp *decode_interval(const char *bytes, int nbyte)
+{
+    char str[128];
+    char *p;
+    int64_t usecs;
+    int32_t days, months;
+
+    if (nbyte != 16) {
+        return decode_bytes(bytes, nbyte);
+    }
+    usecs = (int64_t)get_be(bytes, 8);
+    days = (int32_t)get_be(bytes + 8, 4);
+    months = (int32_t)get_be(bytes + 12, 4);
+    if (!usecs && !days && !months) {
+        return sexp_new_string("PT0S");
+    }
+    p = str;
+    *p++ = 'P';
+    if (months / 12) {
+        p += sprintf(p, "%dY", (int)(months / 12));
+    }
+    if (months % 12) {
+        p += sprintf(p, "%dM", (int)(months % 12));
+    }
+    if (days) {
+        p += sprintf(p, "%dD", (int)days);
+    }
+    if (usecs) {
+        *p++ = 'T';
+        if (usecs / USECS_PER_HOUR) {
+            p += sprintf(p, "%lldH", (long long)(usecs / USECS_PER_HOUR));
+        }
+        if (usecs / USECS_PER_MINUTE % 60) {
+            p += sprintf(p, "%dM", (int)(usecs / USECS_PER_MINUTE % 60));
+        }
+        if ((usecs %= USECS_PER_MINUTE)) {
+            p += sprintf(p, "%s%d", (usecs < 0) ? "-" : "",
+                         abs((int)(usecs / USECS_PER_SECOND)));
+            put_fraction(&p, llabs(usecs % USECS_PER_SECOND));
+            *p++ = 'S';
+        }
+    }
+    return sexp_new_string_bytes(str, p - str);
+}
+
+// Built-in type OIDs from the server's pg_type.dat, which are stable.
+static const struct decoder decoders[] = {
+    { 16, decode_bool },          // bool
+    { 17, decode_bytes },         // bytea
+    { 18, decode_text },          // char
+    { 19, decode_text },          // name
+    { 20, decode_int8 },          // int8
+    { 21, decode_int2 },          // int2
+    { 23, decode_int4 },          // int4
+    { 25, decode_text },          // text
+    { 26, decode_oid },           // oid
+    { 114, decode_text },         // json
+    { 142, decode_text },         // xml
+    { 700, decode_float4 },       // float4
+    { 701, decode_float8 },       // float8
+    { 705, decode_text },         // unknown
+    { 1042, decode_text },        // bpchar
+    { 1043, decode_text },        // varchar
+    { 1082, decode_date },        // date
+    { 1083, decode_time },        // time
+    { 1114, decode_timestamp },   // timestamp
+    { 1184, decode_timestamptz }, // timestamptz
+    { 1186, decode_interval },    // interval
+    { 1266, decode_timetz },      // timetz
+    { 1700, decode_numeric },     // numeric
+    { 2950, decode_uuid },        // uuid
+    { 3802, decode_jsonb },       // jsonb
+    { 0, 0 },
+};
+
+// Enum types get their OIDs when they are created, so they are looked up
+// when connecting. The binary form of an enum value is its label. Enums
+// created later come back as the label's bytes.
+static Oid *enum_oids;
+static int nenum_oid;
+
+static void load_enum_oids(void)
+{
+    PGresult *res;
+    int i;
+
+    res = PQexec(database,
+                 "select oid from pg_catalog.pg_type where typtype = 'e'");
+    if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+        nenum_oid = PQntuples(res);
+        if (!(enum_oids = calloc(nenum_oid + 1, sizeof(*enum_oids)))) {
+            diemem();
+        }
+        for (i = 0; i < nenum_oid; i++) {
+            enum_oids[i] = (Oid)strtoul(PQgetvalue(res, i, 0), 0, 10);
+        }
+    }
+    PQclear(res);
+}
+
+static decode_func_t decoder_by_oid(Oid oid)
+{
+    size_t i;
+    int j;
+
+    for (i = 0; decoders[i].func; i++) {
+        if (decoders[i].oid == oid) {
+            return decoders[i].func;
+        }
+    }
+    for (j = 0; j < nenum_oid; j++) {
+        if (enum_oids[j] == oid) {
+            return decode_text;
+        }
+    }
+    return decode_bytes;
+}
+
+// Looks up the decoder of each column of res into *funcs, which has room
+// for *nfunc decoders and grows as needed.
+static void set_decoders(decode_func_t **funcs, int *nfunc, PGresult *res)
+{
+    decode_func_t *new_funcs;
+    int i, n;
+
+    n = PQnfields(res);
+    if (n > *nfunc) {
+        if (!(new_funcs = realloc(*funcs, n * sizeof(*new_funcs)))) {
+            diemem();
+        }
+        *funcs = new_funcs;
+        *nfunc = n;
+    }
+    for (i = 0; i < n; i++) {
+        (*funcs)[i] = decoder_by_oid(PQftype(res, i));
+    }
+}
+
+// Looks up the decoders once per query instead of once per value. Every
+// result of a query has the same columns.
+static void set_result(PGresult *res)
+{
+    result = res;
+    result_row = 0;
+    if (!decoders_ready) {
+        set_decoders(&result_decoders, &nresult_decoder, res);
+        decoders_ready = 1;
+    }
+}
+
+static char *option_value(struct sexp *value)
+{
+    char buf[32];
+    char *str;
+
+    if (sexp_is_string(value)) {
+        return sexp_strdup(value);
+    }
+    if (sexp_is_float64(value)) {
+        snprintf(buf, sizeof(buf), "%.17g", sexp_float64_value(value));
+    } else if (sexp_is_int64(value)) {
+        snprintf(buf, sizeof(buf), "%lld",
+                 (long long)sexp_int64_value(value));
+    } else {
+        return 0;
+    }
+    if ((str = malloc(strlen(buf) + 1))) {
+        strcpy(str, buf);
+    }
+    return str;
+}
+
+static struct sexp *cmd_connect(struct sexp *args)
+{
+    struct sexp *response;
+    const char **keys;
+    char **vals;
+    size_t i, len;
+
+    if (database) {
+        return new_error("state", "already connected to database");
+    }
+    len = args_len(args);
+    if (len % 2 != 0) {
+        return new_error("args", "odd number of args");
+    }
+    keys = calloc(len / 2 + 1, sizeof(*keys));
+    vals = calloc(len / 2 + 1, sizeof(*vals));
+    if (!keys || !vals) {
+        diemem();
+    }
+    response = 0;
+    for (i = 0; i < len; i += 2) {
+        size_t option =
+        sexp_symbol_index_ref(&option_index, args_ref(args, i));
+        struct sexp *val = args_ref(args, i + 1);
+
+        if (!option) {
+            response = new_error("args", "no such database option for "
+                                         "postgres");
+            break;
+        }
+        keys[i / 2] = valid_option_names[option - 1];
+        if (!(vals[i / 2] = option_value(val))) {
+            response = new_error("args", "option value is not a string or "
+                                         "an integer");
+            break;
+        }
+    }
+    if (!response) {
+        database = PQconnectdbParams(keys, (const char *const *)vals, 0);
+        if (PQstatus(database) != CONNECTION_OK) {
+            response = new_database_error(PQerrorMessage(database));
+        } else {
+            load_enum_oids();
+            if (!PQenterPipelineMode(database) ||
+                PQsetnonblocking(database, 1)) {
+                response = new_database_error(PQerrorMessage(database));
+            }
+        }
+        if (response) {
+            PQfinish(database);
+            database = 0;
+        }
+    }
+    for (i = 0; vals[i]; i++) {
+        free(vals[i]);
+    }
+    free(vals);
+    free(keys);
+    return response ? response : new_ok();
+}
+
+static struct sexp *cmd_disconnect(struct sexp *args)
+{
+    if (args_len(args)) {
+        return new_error("args", "wrong number of args");
+    }
+    should_quit = 1;
+    return new_ok();
+}
+
+// Queues the query and a sync point behind it, so that each execute is
+// its own implicit transaction and an error cannot abort the ones after
+// it. Parameters are bound as $1, $2, ...: strings and numbers as text,
+// bytevectors as binary, #t and #f as booleans and () as null. Results
+// come back in binary format.
+static struct sexp *send_execute(struct sexp *args)
+{
+    struct sexp *response;
+    struct sexp *param;
+    char **strings;
+    const char **values;
+    int *lengths;
+    int *formats;
+    char *sql;
+    size_t i, nparam;
+
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    if (copy_state) {
+        return new_error("state", "COPY in progress");
+    }
+    if (args_len(args) < 1) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!sexp_is_string(args_ref(args, 0))) {
+        return new_error("args", "SQL query is not a string");
+    }
+    nparam = args_len(args) - 1;
+    strings = calloc(nparam + 1, sizeof(*strings));
+    values = calloc(nparam + 1, sizeof(*values));
+    lengths = calloc(nparam + 1, sizeof(*lengths));
+    formats = calloc(nparam + 1, sizeof(*formats));
+    if (!strings || !values || !lengths || !formats) {
+        diemem();
+    }
+    response = 0;
+    for (i = 0; !response && (i < nparam); i++) {
+        param = args_ref(args, i + 1);
+        if (sexp_is_null(param)) {
+            continue;
+        } else if (sexp_is_true(param) || sexp_is_false(param)) {
+            values[i] = sexp_is_true(param) ? "t" : "f";
+        } else if (sexp_is_bytevector(param)) {
+            values[i] = sexp_bytes(param);
+            lengths[i] = (int)sexp_nbyte(param);
+            formats[i] = 1;
+        } else if (!(values[i] = strings[i] = option_value(param))) {
+            response = new_error("args", "cannot bind parameter");
+        }
+    }
+    if (!response && !(sql = sexp_strdup(args_ref(args, 0)))) {
+        response = new_error("args", "cannot turn SQL query into C string");
+    }
+    if (!response) {
+        if (!PQsendQueryParams(database, sql, (int)nparam, 0, values,
+                               lengths, formats, 1) ||
+            !PQpipelineSync(database)) {
+            response = new_database_error(PQerrorMessage(database));
+        }
+        free(sql);
+    }
+    for (i = 0; i < nparam; i++) {
+        free(strings[i]);
+    }
+    free(strings);
+    free(values);
+    free(lengths);
+    free(formats);
+    return response;
+}
+
+// Takes the sync point that send_execute() queued behind the query.
+static void read_sync(void)
+{
+    PGresult *res;
+
+    query_open = 0;
+    if ((res = next_result())) {
+        if (PQresultStatus(res) != PGRES_PIPELINE_SYNC) {
+            die("pipeline out of sync");
+        }
+        PQclear(res);
+    }
+}
+
+// Drops whatever is left of the current query. The rows still have to
+// come over the connection, but only one chunk at a time is kept.
+static void drop_query(void)
+{
+    PGresult *res;
+
+    clear_result();
+    if (query_open) {
+        while ((res = next_result())) {
+            PQclear(res);
+        }
+        read_sync();
+    }
+}
+
+// Makes the next result of the query current. Returns null if it has
+// rows, and otherwise the response that ends the query.
+static struct sexp *take_result(void)
+{
+    struct sexp *response;
+    PGresult *res;
+
+    if (!(res = next_result())) {
+        read_sync();
+        return new_ok();
+    }
+    switch (PQresultStatus(res)) {
+    case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    case PGRES_TUPLES_CHUNK:
+#endif
+    case PGRES_TUPLES_OK:
+        set_result(res);  // the final TUPLES_OK has no rows when streaming
+        return 0;
+    case PGRES_COMMAND_OK:
+        PQclear(res);
+        return 0;
+    default:
+        response = new_result_error(res);
+        PQclear(res);
+        drop_query();
+        return response;
+    }
+}
+
+// Sets *out to the values of the next row and returns true, or if there
+// are no more rows sets *out to the response that ends the query.
+static int next_row_values(struct sexp **out)
+{
+    struct sexp *values;
+    struct sexp *tail;
+    struct sexp *colsexp;
+    int i, n;
+
+    while (!result || (result_row >= PQntuples(result))) {
+        clear_result();
+        if ((*out = take_result())) {
+            return 0;
+        }
+    }
+    values = tail = sexp_new_null();
+    n = PQnfields(result);
+    for (i = 0; i < n; i++) {
+        colsexp = sexp_new_null();
+        if (!PQgetisnull(result, result_row, i)) {
+            colsexp =
+            result_decoders[i](PQgetvalue(result, result_row, i),
+                               PQgetlength(result, result_row, i));
+        }
+        colsexp = sexp_new_pair(colsexp, sexp_new_null());
+        if (tail) {
+            tail = sexp_set_tail(tail, colsexp);
+        } else {
+            values = tail = colsexp;
+        }
+    }
+    result_row++;
+    *out = values;
+    return 1;
+}
+
+static struct sexp *next_row(void)
+{
+    struct sexp *sexp;
+
+    if (!next_row_values(&sexp)) {
+        return sexp;
+    }
+    return sexp_new_pair(sexp_new_symbol("ok"),
+                         sexp_new_pair(sexp_new_symbol("row"), sexp));
+}
+
+// Collects the first row of the query that send_execute() queued. Unread
+// rows of the previous query are dropped. If libpq will not stream the
+// rows, the execute fails rather than hold the whole result in memory;
+// the statement has still run on the server.
+static struct sexp *cmd_execute(struct sexp *args)
+{
+    int streaming;
+
+    (void)args;
+    drop_query();
+    query_open = 1;
+    decoders_ready = 0;
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    streaming = PQsetChunkedRowsMode(database, STREAM_CHUNK_ROWS);
+#else
+    streaming = PQsetSingleRowMode(database);
+#endif
+    if (!streaming) {
+        drop_query();
+        return new_database_error("cannot stream the rows of the query");
+    }
+    return next_row();
+}
+
+static struct sexp *cmd_read_row(struct sexp *args)
+{
+    if (args_len(args)) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    if (!query_open) {
+        return new_error("state", "not executing a statement");
+    }
+    return next_row();
+}
+
+// Returns up to n rows as (ok rows (value ...) ...). Fewer than n rows
+// means that the query has finished.
+static struct sexp *cmd_read_rows(struct sexp *args)
+{
+    struct sexp *head;
+    struct sexp *tail;
+    struct sexp *values;
+    struct sexp *limit;
+    int64_t i, n;
+
+    if (args_len(args) != 1) {
+        return new_error("args", "wrong number of args");
+    }
+    limit = args_ref(args, 0);
+    if (!sexp_is_int64(limit) || (sexp_int64_value(limit) < 0)) {
+        return new_error("args", "row count is not a non-negative integer");
+    }
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    if (!query_open) {
+        return new_error("state", "not executing a statement");
+    }
+    n = sexp_int64_value(limit);
+    head = tail = sexp_new_pair(sexp_new_symbol("rows"), sexp_new_null());
+    for (i = 0; i < n; i++) {
+        if (!next_row_values(&values)) {
+            if (sexp_is_symbol_name(sexp_head(values), "error")) {
+                sexp_free(head);
+                return values;
+            }
+            sexp_free(values);
+            break;
+        }
+        tail = sexp_set_tail(tail, sexp_new_pair(values, sexp_new_null()));
+    }
+    return sexp_new_pair(sexp_new_symbol("ok"), head);
+}
+
+static void buffer_reserve(struct buffer *buf, size_t nbyte)
+{
+    char *bytes;
+    size_t cap;
+
+    if (buf->start && (buf->start == buf->fill)) {
+        buf->start = buf->fill = 0;
+    }
+    if (nbyte <= buf->cap - buf->fill) {
+        return;
+    }
+    if (buf->start) {
+        memmove(buf->bytes, buf->bytes + buf->start, buf->fill - buf->start);
+        buf->fill -= buf->start;
+        buf->start = 0;
+        if (nbyte <= buf->cap - buf->fill) {
+            return;
+        }
+    }
+    for (cap = buf->cap ? buf->cap : COPY_BUFFER_SIZE;
+         nbyte > cap - buf->fill; cap *= 2)
+        ;
+    if (!(bytes = realloc(buf->bytes, cap))) {
+        diemem();
+    }
+    buf->bytes = bytes;
+    buf->cap = cap;
+}
+
+static void buffer_put(struct buffer *buf, const void *bytes, size_t nbyte)
+{
+    buffer_reserve(buf, nbyte);
+    if (nbyte) {
+        memcpy(buf->bytes + buf->fill, bytes, nbyte);
+    }
+    buf->fill += nbyte;
+}
+
+static void buffer_put_string(struct buffer *buf, const char *str)
+{
+    buffer_put(buf, str, strlen(str));
+}
+
+static void buffer_put_be(struct buffer *buf, uint64_t value, int nbyte)
+{
+    char bytes[8];
+    int i;
+
+    for (i = nbyte; i;) {
+        bytes[--i] = value & 0xff;
+        value >>= 8;
+    }
+    buffer_put(buf, bytes, nbyte);
+}
+
+static void buffer_free(struct buffer *buf)
+{
+    free(buf->bytes);
+    memset(buf, 0, sizeof(*buf));
+}
+
+static int encode_bytes(const void *bytes, size_t nbyte)
+{
+    if (nbyte > INT32_MAX) {
+        return 0;
+    }
+    buffer_put_be(&copy_buf, nbyte, 4);
+    buffer_put(&copy_buf, bytes, nbyte);
+    return 1;
+}
+
+static int encode_bool(struct sexp *value)
+{
+    if (!sexp_is_true(value) && !sexp_is_false(value)) {
+        return 0;
+    }
+    return encode_bytes(sexp_is_true(value) ? "\1" : "\0", 1);
+}
+
+static int encode_int(struct sexp *value, int nbyte, int64_t min,
+                      int64_t max)
+{
+    int64_t i;
+
+    if (!sexp_is_int64(value)) {
+        return 0;
+    }
+    i = sexp_int64_value(value);
+    if ((i < min) || (i > max)) {
+        return 0;
+    }
+    buffer_put_be(&copy_buf, nbyte, 4);
+    buffer_put_be(&copy_buf, (uint64_t)i, nbyte);
+    return 1;
+}
+
+static int encode_int2(struct sexp *value)
+{
+    return encode_int(value, 2, INT16_MIN, INT16_MAX);
+}
+
+static int encode_int4(struct sexp *value)
+{
+    return encode_int(value, 4, INT32_MIN, INT32_MAX);
+}
+
+static int encode_int8(struct sexp *value)
+{
+    return encode_int(value, 8, INT64_MIN, INT64_MAX);
+}
+
+static int encode_oid(struct sexp *value)
+{
+    return encode_int(value, 4, 0, UINT32_MAX);
+}
+
+static int number_value(struct sexp *value, double *out)
+{
+    if (sexp_is_float64(value)) {
+        *out = sexp_float64_value(value);
+    } else if (sexp_is_int64(value)) {
+        *out = (double)sexp_int64_value(value);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static int encode_float4(struct sexp *value)
+{
+    uint32_t bits;
+    double d;
+    float f;
+
+    if (!number_value(value, &d)) {
+        return 0;
+    }
+    f = (float)d;
+    memcpy(&bits, &f, sizeof(bits));
+    buffer_put_be(&copy_buf, 4, 4);
+    buffer_put_be(&copy_buf, bits, 4);
+    return 1;
+}
+
+static int encode_float8(struct sexp *value)
+{
+    uint64_t bits;
+    double d;
+
+    if (!number_value(value, &d)) {
+        return 0;
+    }
+    memcpy(&bits, &d, sizeof(bits));
+    buffer_put_be(&copy_buf, 8, 4);
+    buffer_put_be(&copy_buf, bits, 8);
+    return 1;
+}
+
+static int encode_bytea(struct sexp *value)
+{
+    if (!sexp_is_bytevector(value) && !sexp_is_string(value)) {
+        return 0;
+    }
+    return encode_bytes(sexp_bytes(value), sexp_nbyte(value));
+}
+
+static int encode_text(struct sexp *value)
+{
+    if (!sexp_is_string(value)) {
+        return 0;
+    }
+    return encode_bytes(sexp_bytes(value), sexp_nbyte(value));
+}
+
+static int encode_jsonb(struct sexp *value)
+{
+    if (!sexp_is_string(value) || (sexp_nbyte(value) >= INT32_MAX)) {
+        return 0;
+    }
+    buffer_put_be(&copy_buf, sexp_nbyte(value) + 1, 4);
+    buffer_put(&copy_buf, "\1", 1);
+    buffer_put(&copy_buf, sexp_bytes(value), sexp_nbyte(value));
+    return 1;
+}
+
+static int hex_digit(int c)
+{
+    if ((c >= '0') && (c <= '9')) {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f')) {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F')) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
 
-static const char **valid_option_names[] = {
-    "client_encoding", "connect_timeout", "dbname", "host",
-    "options",         "password",        "port",   "user",
+static int encode_uuid(struct sexp *value)
+{
+    unsigned char bytes[16];
+    const char *str;
+    size_t i, n, len;
+    int hi, lo;
+
+    if (!sexp_is_string(value)) {
+        return 0;
+    }
+    str = sexp_bytes(value);
+    len = sexp_nbyte(value);
+    for (i = n = 0; i < len; i++) {
+        if (str[i] == '-') {
+            continue;
+        }
+        if ((n == sizeof(bytes)) || (i + 1 == len) ||
+            ((hi = hex_digit(str[i])) < 0) ||
+            ((lo = hex_digit(str[++i])) < 0)) {
+            return 0;
+        }
+        bytes[n++] = (hi << 4) | lo;
+    }
+    return (n == sizeof(bytes)) && encode_bytes(bytes, n);
+}
+
+// Takes an integer or a decimal string like "-123.4500" and turns it into
+// base-10000 digits, keeping the number of decimals as the scale.
+static int encode_numeric(struct sexp *value)
+{
+    char buf[32];
+    const char *str;
+    const char *point;
+    const char *end;
+    uint16_t digits[4096];
+    size_t len, nint, nfrac, ndigit, first, i;
+    int weight, sign, digit;
+
+    if (sexp_is_int64(value)) {
+        snprintf(buf, sizeof(buf), "%lld",
+                 (long long)sexp_int64_value(value));
+        str = buf;
+        len = strlen(buf);
+    } else if (sexp_is_string(value)) {
+        str = sexp_bytes(value);
+        len = sexp_nbyte(value);
+    } else {
+        return 0;
+    }
+    end = str + len;
+    if ((len == 3) && !memcmp(str, "NaN", 3)) {
+        buffer_put_be(&copy_buf, 8, 4);
+        buffer_put_be(&copy_buf, 0, 2);  // ndigit
+        buffer_put_be(&copy_buf, 0, 2);  // weight
+        buffer_put_be(&copy_buf, 0xc000, 2);
+        buffer_put_be(&copy_buf, 0, 2);  // dscale
+        return 1;
+    }
+    sign = 0;
+    if ((str < end) && ((*str == '-') || (*str == '+'))) {
+        sign = (*str++ == '-') ? 0x4000 : 0;
+    }
+    if (!(point = memchr(str, '.', end - str))) {
+        point = end;
+    }
+    nint = point - str;
+    nfrac = (point < end) ? end - point - 1 : 0;
+    if (!nint && !nfrac) {
+        return 0;
+    }
+    if ((nint + 3) / 4 + (nfrac + 3) / 4 > sizeof(digits) / 2) {
+        return 0;
+    }
+    // Integer digits are grouped from the decimal point leftward, and
+    // fraction digits from the point rightward.
+    ndigit = 0;
+    for (i = 0; i < nint + (4 - nint % 4) % 4; i++) {
+        size_t pos = i - (4 - nint % 4) % 4;  // wraps for leading zeros
+        if (!(i % 4)) {
+            digits[ndigit++] = 0;
+        }
+        digit = (pos < nint) ? str[pos] - '0' : 0;
+        if ((digit < 0) || (digit > 9)) {
+            return 0;
+        }
+        digits[ndigit - 1] = digits[ndigit - 1] * 10 + digit;
+    }
+    weight = (int)ndigit - 1;
+    for (i = 0; i < nfrac + (4 - nfrac % 4) % 4; i++) {
+        if (!(i % 4)) {
+            digits[ndigit++] = 0;
+        }
+        digit = (i < nfrac) ? point[1 + i] - '0' : 0;
+        if ((digit < 0) || (digit > 9)) {
+            return 0;
+        }
+        digits[ndigit - 1] = digits[ndigit - 1] * 10 + digit;
+    }
+    for (first = 0; (first < ndigit) && !digits[first]; first++) {
+        weight--;
+    }
+    while ((ndigit > first) && !digits[ndigit - 1]) {
+        ndigit--;
+    }
+    if (first == ndigit) {
+        weight = sign = 0;
+    }
+    buffer_put_be(&copy_buf, 8 + 2 * (ndigit - first), 4);
+    buffer_put_be(&copy_buf, ndigit - first, 2);
+    buffer_put_be(&copy_buf, (uint16_t)weight, 2);
+    buffer_put_be(&copy_buf, sign, 2);
+    buffer_put_be(&copy_buf, nfrac, 2);
+    for (i = first; i < ndigit; i++) {
+        buffer_put_be(&copy_buf, digits[i], 2);
+    }
+    return 1;
+}
+
+static const struct encoder encoders[] = {
+    { 16, encode_bool },      // bool
+    { 17, encode_bytea },     // bytea
+    { 18, encode_text },      // char
+    { 19, encode_text },      // name
+    { 20, encode_int8 },      // int8
+    { 21, encode_int2 },      // int2
+    { 23, encode_int4 },      // int4
+    { 25, encode_text },      // text
+    { 26, encode_oid },       // oid
+    { 114, encode_text },     // json
+    { 142, encode_text },     // xml
+    { 700, encode_float4 },   // float4
+    { 701, encode_float8 },   // float8
+    { 1042, encode_text },    // bpchar
+    { 1043, encode_text },    // varchar
+    { 1700, encode_numeric }, // numeric
+    { 2950, encode_uuid },    // uuid
+    { 3802, encode_jsonb },   // jsonb
+    { 0, 0 },
 };
 
-static void die(const char *msg)
+static encode_func_t encoder_by_oid(Oid oid)
 {
-    fprintf(stderr, "%s\n", msg);
-    exit(2);
+    size_t i;
+
+    for (i = 0; encoders[i].func; i++) {
+        if (encoders[i].oid == oid) {
+            return encoders[i].func;
+        }
+    }
+    return 0;
 }
 
-static void diemem(void) { die("out of memory"); }
+// COPY cannot run in pipeline mode, so the connection leaves it while a
+// COPY runs. It also blocks then, so that PQputCopyData() never has to be
+// retried.
+static int begin_copy(void)
+{
+    drop_query();
+    if (!PQexitPipelineMode(database) || PQsetnonblocking(database, 0)) {
+        return 0;
+    }
+    return 1;
+}
+
+static struct sexp *end_copy(struct sexp *response)
+{
+    copy_state = 0;
+    copy_header_done = 0;
+    copy_out_ended = 0;
+    ncopy_column = 0;
+    free(copy_encoders);
+    copy_encoders = 0;
+    buffer_free(&copy_buf);
+    if (PQsetnonblocking(database, 1) || !PQenterPipelineMode(database)) {
+        die(PQerrorMessage(database));
+    }
+    return response;
+}
 
-static int is_valid_option_symbol(struct sexp *symbol)
+// Takes the results that end a COPY, turning the final one into
+// (ok rows n) or an error.
+static struct sexp *finish_copy(void)
 {
-    char **names;
-    char *name;
+    struct sexp *response;
+    PGresult *res;
 
-    if (sexp_is_symbol(symbol)) {
-        for (names = valid_option_names; (name = *names); names++) {
-            if (sexp_is_symbol_name(symbol, name)) {
-                return 1;
+    response = 0;
+    while ((res = PQgetResult(database))) {
+        if (!response) {
+            if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+                response = sexp_new_pair(
+                sexp_new_symbol("ok"),
+                sexp_new_pair(
+                sexp_new_symbol("rows"),
+                sexp_new_pair(sexp_new_int64(atoll(PQcmdTuples(res))),
+                              sexp_new_null())));
+            } else {
+                response = new_result_error(res);
             }
         }
+        PQclear(res);
+    }
+    if (!response) {
+        response = new_database_error(PQerrorMessage(database));
+    }
+    return end_copy(response);
+}
+
+// Runs a COPY statement outside the pipeline and checks that the server
+// is ready to copy in the given direction.
+static struct sexp *start_copy(const char *sql, ExecStatusType status)
+{
+    struct sexp *response;
+    PGresult *res;
+
+    res = PQexec(database, sql);
+    if (PQresultStatus(res) == status) {
+        PQclear(res);
+        return 0;
+    }
+    if (PQresultStatus(res) == PGRES_COPY_IN) {
+        PQputCopyEnd(database, "wrong direction");
+    }
+    if (PQresultStatus(res) == PGRES_COPY_OUT) {
+        char *bytes;
+        while (PQgetCopyData(database, &bytes, 0) > 0) {
+            PQfreemem(bytes);
+        }
+    }
+    switch (PQresultStatus(res)) {
+    case PGRES_COPY_IN:
+    case PGRES_COPY_OUT:
+    case PGRES_COMMAND_OK:
+    case PGRES_TUPLES_OK:
+        response = new_error("args", (status == PGRES_COPY_IN)
+                                     ? "statement is not COPY FROM STDIN"
+                                     : "statement is not COPY TO STDOUT");
+        break;
+    default:
+        response = new_result_error(res);
+        break;
+    }
+    PQclear(res);
+    while ((res = PQgetResult(database))) {
+        PQclear(res);
+    }
+    return end_copy(response);
+}
+
+static struct sexp *check_copy_state(int state)
+{
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    if (copy_state != state) {
+        return new_error("state", state ? "not in that kind of COPY"
+                                        : "COPY in progress");
     }
     return 0;
 }
 
-static void cmd_connect(struct sexp *args)
+// (copy-in sql) runs a COPY ... FROM STDIN statement of any format. The
+// data then goes to the server as is with copy-data.
+static struct sexp *cmd_copy_in(struct sexp *args)
 {
-    char **keys;
-    char **vals;
-    PGresult result;
-    size_t len;
+    struct sexp *response;
+    char *sql;
 
-    len = sexp_list_length(args);
-    if (len % 2 != 0) {
-        die("odd number of options");
+    if (args_len(args) != 1) {
+        return new_error("args", "wrong number of args");
     }
-    if (!(keys = calloc(len + 1, sizeof(*keys)))) {
-        diemem();
+    if ((response = check_copy_state(0))) {
+        return response;
+    }
+    if (!(sql = sexp_strdup(args_ref(args, 0)))) {
+        return new_error("args", "SQL query is not a string");
+    }
+    if (!begin_copy()) {
+        response = end_copy(new_database_error(PQerrorMessage(database)));
+    } else if (!(response = start_copy(sql, PGRES_COPY_IN))) {
+        copy_state = COPY_IN_RAW;
+        response = new_ok();
+    }
+    free(sql);
+    return response;
+}
+
+// Appends the quoted name of the identifier, or returns false.
+static int put_identifier(struct buffer *buf, struct sexp *name)
+{
+    char *quoted;
+
+    if (!sexp_is_string(name) ||
+        !(quoted = PQescapeIdentifier(database, sexp_bytes(name),
+                                      sexp_nbyte(name)))) {
+        return 0;
+    }
+    buffer_put_string(buf, quoted);
+    PQfreemem(quoted);
+    return 1;
+}
+
+// Appends the quoted name of a table given as "table" or ("schema"
+// "table"), or returns false.
+static int put_table_name(struct buffer *buf, struct sexp *name)
+{
+    if (!sexp_is_pair(name)) {
+        return put_identifier(buf, name);
+    }
+    if (sexp_list_len_bounded(name, 3) != 2) {
+        return 0;
+    }
+    if (!put_identifier(buf, sexp_list_ref(name, 0))) {
+        return 0;
+    }
+    buffer_put(buf, ".", 1);
+    return put_identifier(buf, sexp_list_ref(name, 1));
+}
+
+// Looks up the column types by selecting no rows from the table.
+static struct sexp *get_copy_encoders(const char *table, const char *cols)
+{
+    struct sexp *response;
+    struct buffer sql;
+    PGresult *res;
+    int i;
+
+    memset(&sql, 0, sizeof(sql));
+    buffer_put_string(&sql, "SELECT ");
+    buffer_put_string(&sql, *cols ? cols : "*");
+    buffer_put_string(&sql, " FROM ");
+    buffer_put_string(&sql, table);
+    buffer_put_string(&sql, " LIMIT 0");
+    buffer_put(&sql, "", 1);
+    res = PQexec(database, sql.bytes);
+    buffer_free(&sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        response = new_result_error(res);
+        PQclear(res);
+        return response;
     }
-    if (!(vals = calloc(len + 1, sizeof(*vals)))) {
+    response = 0;
+    ncopy_column = PQnfields(res);
+    if (!(copy_encoders = calloc(ncopy_column + 1, sizeof(*copy_encoders)))) {
         diemem();
     }
-    for (; sexp_is_null(args); args = sexp_nthtail(args, 2)) {
-        struct sexp *key = sexp_nth(args, 0);
-        struct sexp *val = sexp_nth(args, 1);
+    for (i = 0; i < ncopy_column; i++) {
+        if (!(copy_encoders[i] = encoder_by_oid(PQftype(res, i)))) {
+            response = new_error("args", "cannot copy a column of that "
+                                         "type from sexps; use copy-in");
+            break;
+        }
+    }
+    PQclear(res);
+    return response;
+}
+
+// (copy-in-table table column ...) starts a binary COPY into the given
+// columns, or all of them if none are given. The table is a string, or a
+// list (schema table) of two strings. Rows then come as sexps with
+// copy-rows, and are encoded according to the column types.
+static struct sexp *cmd_copy_in_table(struct sexp *args)
+{
+    struct sexp *response;
+    struct buffer table;
+    struct buffer cols;
+    struct buffer sql;
+    size_t i, n;
+
+    if ((n = args_len(args)) < 1) {
+        return new_error("args", "wrong number of args");
+    }
+    if ((response = check_copy_state(0))) {
+        return response;
+    }
+    memset(&table, 0, sizeof(table));
+    memset(&cols, 0, sizeof(cols));
+    memset(&sql, 0, sizeof(sql));
+    if (!put_table_name(&table, args_ref(args, 0))) {
+        response = new_error("args", "table name is not a string or a "
+                                     "(schema table) list");
+    }
+    for (i = 1; !response && (i < n); i++) {
+        if (i > 1) {
+            buffer_put(&cols, ", ", 2);
+        }
+        if (!put_identifier(&cols, args_ref(args, i))) {
+            response = new_error("args", "column name is not a string");
+        }
+    }
+    buffer_put(&table, "", 1);
+    buffer_put(&cols, "", 1);
+    if (!response && !begin_copy()) {
+        response = end_copy(new_database_error(PQerrorMessage(database)));
+    } else if (!response) {
+        if ((response = get_copy_encoders(table.bytes, cols.bytes))) {
+            response = end_copy(response);
+        } else {
+            buffer_put_string(&sql, "COPY ");
+            buffer_put_string(&sql, table.bytes);
+            if (*cols.bytes) {
+                buffer_put_string(&sql, " (");
+                buffer_put_string(&sql, cols.bytes);
+                buffer_put_string(&sql, ")");
+            }
+            buffer_put_string(&sql, " FROM STDIN (FORMAT binary)");
+            buffer_put(&sql, "", 1);
+            if (!(response = start_copy(sql.bytes, PGRES_COPY_IN))) {
+                copy_state = COPY_IN_ROWS;
+                buffer_put(&copy_buf, "PGCOPY\n\377\r\n\0", 11);
+                buffer_put_be(&copy_buf, 0, 4);  // flags
+                buffer_put_be(&copy_buf, 0, 4);  // header extension
+                response = new_ok();
+            }
+        }
+    }
+    buffer_free(&table);
+    buffer_free(&cols);
+    buffer_free(&sql);
+    return response;
+}
+
+// Sends what has been buffered once there is enough of it, or always if
+// forced.
+static struct sexp *flush_copy_in(int force)
+{
+    if (!force && (copy_buf.fill < COPY_BUFFER_SIZE)) {
+        return 0;
+    }
+    if (copy_buf.fill &&
+        (PQputCopyData(database, copy_buf.bytes, (int)copy_buf.fill) != 1)) {
+        return new_database_error(PQerrorMessage(database));
+    }
+    copy_buf.fill = 0;
+    return 0;
+}
+
+// (copy-data bytevector) sends raw COPY data.
+static struct sexp *cmd_copy_data(struct sexp *args)
+{
+    struct sexp *response;
+    struct sexp *data;
+
+    if (args_len(args) != 1) {
+        return new_error("args", "wrong number of args");
+    }
+    if ((response = check_copy_state(COPY_IN_RAW))) {
+        return response;
+    }
+    data = args_ref(args, 0);
+    if (!sexp_is_bytevector(data) && !sexp_is_string(data)) {
+        return new_error("args", "COPY data is not a bytevector");
+    }
+    buffer_put(&copy_buf, sexp_bytes(data), sexp_nbyte(data));
+    if ((response = flush_copy_in(0))) {
+        return response;
+    }
+    return new_ok();
+}
+
+static int encode_row(struct sexp *row)
+{
+    struct sexp *value;
+    size_t i, n;
+
+    if (!sexp_is_list(row) && !sexp_is_vector(row)) {
+        return 0;
+    }
+    n = sexp_is_vector(row) ? sexp_vector_len(row) : sexp_list_len(row);
+    if (n != (size_t)ncopy_column) {
+        return 0;
+    }
+    buffer_put_be(&copy_buf, n, 2);
+    for (i = 0; i < n; i++) {
+        value = sexp_is_vector(row) ? sexp_vector_ref(row, i)
+                                    : sexp_list_ref(row, i);
+        if (sexp_is_null(value)) {
+            buffer_put_be(&copy_buf, (uint32_t)-1, 4);
+        } else if (!copy_encoders[i](value)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// (copy-rows row ...) encodes each row, a list or vector with a value for
+// each column, into binary COPY format. If any row does not fit the
+// columns, none of the rows in the command are sent.
+static struct sexp *cmd_copy_rows(struct sexp *args)
+{
+    struct sexp *response;
+    size_t i, n, fill;
+
+    if ((response = check_copy_state(COPY_IN_ROWS))) {
+        return response;
+    }
+    fill = copy_buf.fill;
+    n = args_len(args);
+    for (i = 0; i < n; i++) {
+        if (!encode_row(args_ref(args, i))) {
+            copy_buf.fill = fill;
+            return new_error("args", "row does not fit the columns");
+        }
+    }
+    if ((response = flush_copy_in(0))) {
+        return response;
+    }
+    return new_ok();
+}
+
+// (copy-end) finishes a COPY FROM STDIN and returns (ok rows n).
+// (copy-end message) aborts it instead, with message as the reason.
+static struct sexp *cmd_copy_end(struct sexp *args)
+{
+    struct sexp *response;
+    char *reason;
+
+    if (args_len(args) > 1) {
+        return new_error("args", "wrong number of args");
+    }
+    if ((copy_state != COPY_IN_RAW) && (copy_state != COPY_IN_ROWS)) {
+        return new_error("state", "not in COPY FROM STDIN");
+    }
+    reason = 0;
+    if (args_len(args) && !(reason = sexp_strdup(args_ref(args, 0)))) {
+        return new_error("args", "reason is not a string");
+    }
+    if (!reason && (copy_state == COPY_IN_ROWS)) {
+        buffer_put_be(&copy_buf, (uint16_t)-1, 2);  // trailer
+    }
+    if (reason) {
+        copy_buf.fill = 0;
+    }
+    if ((response = flush_copy_in(1))) {
+        free(reason);
+        PQputCopyEnd(database, "could not send data");
+        sexp_free(finish_copy());
+        return response;
+    }
+    if (PQputCopyEnd(database, reason) != 1) {
+        response = new_database_error(PQerrorMessage(database));
+    }
+    free(reason);
+    if (response) {
+        sexp_free(finish_copy());
+        return response;
+    }
+    return finish_copy();
+}
+
+// (copy-out sql) runs a COPY ... TO STDOUT statement of any format, whose
+// data copy-read then returns as is.
+static struct sexp *cmd_copy_out(struct sexp *args)
+{
+    struct sexp *response;
+    char *sql;
+
+    if (args_len(args) != 1) {
+        return new_error("args", "wrong number of args");
+    }
+    if ((response = check_copy_state(0))) {
+        return response;
+    }
+    if (!(sql = sexp_strdup(args_ref(args, 0)))) {
+        return new_error("args", "SQL query is not a string");
+    }
+    if (!begin_copy()) {
+        response = end_copy(new_database_error(PQerrorMessage(database)));
+    } else if (!(response = start_copy(sql, PGRES_COPY_OUT))) {
+        copy_state = COPY_OUT_RAW;
+        response = new_ok();
+    }
+    free(sql);
+    return response;
+}
+
+// Looks up the column types by preparing the query without running it.
+static struct sexp *get_copy_decoders(const char *query)
+{
+    struct sexp *response;
+    PGresult *res;
+
+    res = PQprepare(database, "", query, 0, 0);
+    if (PQresultStatus(res) == PGRES_COMMAND_OK) {
+        PQclear(res);
+        res = PQdescribePrepared(database, "");
+    }
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        response = new_result_error(res);
+        PQclear(res);
+        return response;
+    }
+    set_decoders(&copy_decoders, &ncopy_decoder, res);
+    ncopy_column = PQnfields(res);
+    PQclear(res);
+    return 0;
+}
+
+// (copy-out-query query) runs COPY (query) TO STDOUT in binary format,
+// and copy-read then decodes the rows according to the column types.
+static struct sexp *cmd_copy_out_query(struct sexp *args)
+{
+    struct sexp *response;
+    struct buffer sql;
+    char *query;
+
+    if (args_len(args) != 1) {
+        return new_error("args", "wrong number of args");
+    }
+    if ((response = check_copy_state(0))) {
+        return response;
+    }
+    if (!(query = sexp_strdup(args_ref(args, 0)))) {
+        return new_error("args", "SQL query is not a string");
+    }
+    memset(&sql, 0, sizeof(sql));
+    buffer_put_string(&sql, "COPY (");
+    buffer_put_string(&sql, query);
+    buffer_put_string(&sql, ") TO STDOUT (FORMAT binary)");
+    buffer_put(&sql, "", 1);
+    if (!begin_copy()) {
+        response = end_copy(new_database_error(PQerrorMessage(database)));
+    } else if ((response = get_copy_decoders(query))) {
+        response = end_copy(response);
+    } else if (!(response = start_copy(sql.bytes, PGRES_COPY_OUT))) {
+        copy_state = COPY_OUT_ROWS;
+        response = new_ok();
+    }
+    buffer_free(&sql);
+    free(query);
+    return response;
+}
+
+// Reads COPY data from the server until at least nbyte are buffered.
+// Returns 1 if they are, 0 if the data ended first and -1 on error.
+static int fill_copy_out(size_t nbyte)
+{
+    char *bytes;
+    int n;
+
+    while (copy_buf.fill - copy_buf.start < nbyte) {
+        if (copy_out_ended) {
+            return 0;
+        }
+        if ((n = PQgetCopyData(database, &bytes, 0)) < 0) {
+            copy_out_ended = (n == -1);
+            return copy_out_ended ? 0 : -1;
+        }
+        buffer_put(&copy_buf, bytes, n);
+        PQfreemem(bytes);
+    }
+    return 1;
+}
+
+static uint64_t take_be(int nbyte)
+{
+    uint64_t value;
+
+    value = get_be(copy_buf.bytes + copy_buf.start, nbyte);
+    copy_buf.start += nbyte;
+    return value;
+}
+
+// Decodes the next row of binary COPY data. Returns 1 and sets *out to
+// the values, 0 at the end of the data or -1 if it is malformed.
+static int next_copy_row(struct sexp **out)
+{
+    struct sexp *values;
+    struct sexp *tail;
+    struct sexp *colsexp;
+    int64_t len;
+    int i, n, ok;
+
+    *out = 0;
+    if (!copy_header_done) {
+        if ((fill_copy_out(19) != 1) ||
+            memcmp(copy_buf.bytes + copy_buf.start, "PGCOPY\n\377\r\n\0",
+                   11)) {
+            return -1;
+        }
+        copy_buf.start += 15;
+        len = (uint32_t)take_be(4);
+        if (fill_copy_out(len) != 1) {
+            return -1;
+        }
+        copy_buf.start += len;
+        copy_header_done = 1;
+    }
+    if ((ok = fill_copy_out(2)) != 1) {
+        return ok;
+    }
+    if ((n = (int16_t)take_be(2)) == -1) {
+        return 0;
+    }
+    if (n != ncopy_column) {
+        return -1;
+    }
+    values = tail = sexp_new_null();
+    for (i = 0; i < n; i++) {
+        if (fill_copy_out(4) != 1) {
+            sexp_free(values);
+            return -1;
+        }
+        colsexp = sexp_new_null();
+        if ((len = (int32_t)take_be(4)) >= 0) {
+            if (fill_copy_out(len) != 1) {
+                sexp_free(values);
+                return -1;
+            }
+            colsexp =
+            copy_decoders[i](copy_buf.bytes + copy_buf.start, (int)len);
+            copy_buf.start += len;
+        }
+        colsexp = sexp_new_pair(colsexp, sexp_new_null());
+        if (tail) {
+            tail = sexp_set_tail(tail, colsexp);
+        } else {
+            values = tail = colsexp;
+        }
+    }
+    *out = values;
+    return 1;
+}
+
+// Reads the rest of the COPY data, which is dropped.
+static struct sexp *drain_copy_out(struct sexp *response)
+{
+    char *bytes;
+
+    while (PQgetCopyData(database, &bytes, 0) > 0) {
+        PQfreemem(bytes);
+    }
+    sexp_free(finish_copy());
+    return response;
+}
+
+static struct sexp *read_copy_rows(int64_t n)
+{
+    struct sexp *head;
+    struct sexp *tail;
+    struct sexp *values;
+    int64_t i;
+    int ok;
 
-        if (!is_valid_option_symbol(key)) {
-            die("no such connect option");
+    head = tail = sexp_new_pair(sexp_new_symbol("rows"), sexp_new_null());
+    for (i = 0; i < n; i++) {
+        if ((ok = next_copy_row(&values)) == -1) {
+            sexp_free(head);
+            return drain_copy_out(new_error("database", "bad COPY data"));
+        }
+        if (!ok) {
+            if (fill_copy_out(1) != 0) {
+                sexp_free(head);
+                return drain_copy_out(
+                new_error("database", "data after the end of COPY"));
+            }
+            if (sexp_is_symbol_name(sexp_head(values = finish_copy()),
+                                    "error")) {
+                sexp_free(head);
+                return values;
+            }
+            sexp_free(values);
+            break;
         }
+        tail = sexp_set_tail(tail, sexp_new_pair(values, sexp_new_null()));
     }
-    database = PQconnectdbParams(keys, vals, 0);
+    return sexp_new_pair(sexp_new_symbol("ok"), head);
 }
 
-static void cmd_execute(struct sexp *args)
+static struct sexp *read_copy_data(int64_t nbyte)
 {
-    PGresult result;
+    struct sexp *response;
+    int ok;
 
-    result =
-    PQexecParams(database, sql_string, int nParams, const Oid *paramTypes,
-                 const char *const *paramValues, const int *paramLengths,
-                 const int *paramFormats, int resultFormat);
+    copy_buf.start = copy_buf.fill = 0;
+    while (copy_buf.fill < (uint64_t)nbyte) {
+        if ((ok = fill_copy_out(copy_buf.fill + 1)) == -1) {
+            return drain_copy_out(
+            new_database_error(PQerrorMessage(database)));
+        }
+        if (!ok) {
+            break;
+        }
+    }
+    if (!copy_buf.fill) {
+        return finish_copy();
+    }
+    response = sexp_new_pair(
+    sexp_new_symbol("ok"),
+    sexp_new_pair(
+    sexp_new_symbol("data"),
+    sexp_new_pair(sexp_new_bytevector_bytes(copy_buf.bytes, copy_buf.fill),
+                  sexp_new_null())));
+    copy_buf.fill = 0;
+    return response;
 }
 
-static void cmd_read_result_rows(struct sexp *args) {}
+// (copy-read n) returns the next (ok data bytevector) of about n bytes
+// after copy-out, or (ok rows (value ...) ...) of up to n rows after
+// copy-out-query. When the data has ended it returns (ok rows n) and
+// (ok rows ...) with fewer than n rows, respectively.
+static struct sexp *cmd_copy_read(struct sexp *args)
+{
+    struct sexp *limit;
+
+    if (args_len(args) != 1) {
+        return new_error("args", "wrong number of args");
+    }
+    limit = args_ref(args, 0);
+    if (!sexp_is_int64(limit) || (sexp_int64_value(limit) < 1)) {
+        return new_error("args", "count is not a positive integer");
+    }
+    if (copy_state == COPY_OUT_RAW) {
+        return read_copy_data(sexp_int64_value(limit));
+    }
+    if (copy_state == COPY_OUT_ROWS) {
+        return read_copy_rows(sexp_int64_value(limit));
+    }
+    return new_error("state", "not in COPY TO STDOUT");
+}
 
-typedef void (*cmd_func_t)(struct sexp *args);
+typedef struct sexp *(*cmd_func_t)(struct sexp *args);
 
+// send, if any, runs as soon as the command is read so that queries
+// behind it can go to the server in the same round trip. func answers the
+// command once the commands before it have been answered. Commands that
+// are not pipelined are answered before anything after them is read.
 struct cmd {
     const char *name;
+    cmd_func_t send;
     cmd_func_t func;
+    int pipelined;
 };
 
 static const struct cmd cmds[] = {
-    { "connect", cmd_connect },
-    { "execute", cmd_execute },
+    { "connect", 0, cmd_connect, 0 },
+    { "disconnect", 0, cmd_disconnect, 0 },
+    { "execute", send_execute, cmd_execute, 1 },
+    { "read-row", 0, cmd_read_row, 1 },
+    { "read-rows", 0, cmd_read_rows, 1 },
+    { "copy-in", 0, cmd_copy_in, 0 },
+    { "copy-in-table", 0, cmd_copy_in_table, 0 },
+    { "copy-data", 0, cmd_copy_data, 1 },
+    { "copy-rows", 0, cmd_copy_rows, 1 },
+    { "copy-end", 0, cmd_copy_end, 0 },
+    { "copy-out", 0, cmd_copy_out, 0 },
+    { "copy-out-query", 0, cmd_copy_out_query, 0 },
+    { "copy-read", 0, cmd_copy_read, 0 },
     { 0 },
 };
 
-static struct cmd *cmd_by_symbol(struct sexp *symbol)
+static void init_symbol_indexes(void)
 {
-    struct cmd *cmd;
+    size_t i;
 
-    if (sexp_is_symbol(symbol)) {
-        for (cmd = cmds; cmd->name; cmd++) {
-            if (sexp_is_symbol_name(symbol, cmd->name)) {
-                return cmd;
-            }
-        }
+    for (i = 0; cmds[i].name; i++) {
+        symbol_index_add(&cmd_index, cmds[i].name, i + 1);
+    }
+    for (i = 0; valid_option_names[i]; i++) {
+        symbol_index_add(&option_index, valid_option_names[i], i + 1);
     }
-    return 0;
 }
 
-int main(void)
+static const struct cmd *cmd_by_symbol(struct sexp *symbol)
+{
+    size_t i;
+
+    i = sexp_symbol_index_ref(&cmd_index, symbol);
+    return i ? &cmds[i - 1] : 0;
+}
+
+// Reads one command, and then every further command that has already
+// arrived, sending queries on as they come.
+static void read_jobs(void)
 {
-    struct sexp_binary_read *rd;
-    struct sexp_binary_write *wr;
     struct sexp *command;
-    struct sexp *response;
-    struct cmd *cmd;
+    struct job *job;
 
-    if ((errstr = sexp_binary_pipe(&rd, &wr))) {
-        die(errstr);
-    }
-    for (;;) {
-        if (!sexp_binary_read(rd, &command))) {
-      die(sexp_binary_read_error(rd));
-    }
-        if (!sexp_is_list(command)) {
-            die("command is not a list");
+    do {
+        if (!sexp_binary_read(rd, &command)) {
+            die(sexp_binary_read_error(rd));
         }
-        if (!(cmd = cmd_by_symbol(sexp_head(command)))) {
-            die("no such command");
+        job = &jobs[njob++];
+        memset(job, 0, sizeof(*job));
+        job->command = command;
+        if (sexp_is_list(command)) {
+            job->cmd = cmd_by_symbol(sexp_head(command));
+            job->args = sexp_tail(command);
+        } else if (sexp_is_vector(command) && sexp_vector_len(command)) {
+            job->cmd = cmd_by_symbol(sexp_vector_ref(command, 0));
+            job->args = command;
         }
-        response = cmd->func(sexp_tail(command));
-        if (!sexp_binary_write(rw, response)) {
+        if (!sexp_is_list(command) && !job->args) {
+            job->response =
+            new_error("args", "command is not a list or vector");
+        } else if (!job->cmd) {
+            job->response = new_error("args", "no such command");
+        } else if (job->cmd->send) {
+            job->response = job->cmd->send(job->args);
+        }
+        if (!job->cmd || !job->cmd->pipelined) {
+            break;
+        }
+    } while ((njob < MAX_PIPELINE) && input_pending());
+}
+
+static void answer_jobs(void)
+{
+    struct sexp *response;
+    struct job *job;
+    size_t i;
+
+    for (i = 0; i < njob; i++) {
+        job = &jobs[i];
+        response = job->response ? job->response : job->cmd->func(job->args);
+        if (!sexp_binary_write(wr, response)) {
             die(sexp_binary_write_error(wr));
         }
         sexp_free(response);
-        sexp_free(command);
+        sexp_free(job->command);
+    }
+    njob = 0;
+}
+
+int main(void)
+{
+    const char *errstr;
+
+    if ((errstr = sexp_binary_pipe(&rd, &wr))) {
+        die(errstr);
+    }
+    init_symbol_indexes();
+    while (!should_quit) {
+        read_jobs();
+        answer_jobs();
     }
+    clear_result();
+    free(result_decoders);
+    free(copy_decoders);
+    free(copy_encoders);
+    buffer_free(&copy_buf);
     PQfinish(database);
     return 0;
 }
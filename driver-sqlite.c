@@ -1,6 +1,8 @@
 // SPDX-FileCopyrightText: 2019 Lassi Kortela
 // SPDX-License-Identifier: ISC
 
+#include <errno.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,190 +15,2787 @@
 
 #include <sqlite3.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define HISTOGRAM_NBUCKET 40
+#define MAX_CMDS 64
+#define PROFILE_RING_SIZE 256
+#define PROGRESS_INTERVAL 1000  // VM instructions between deadline checks
+#define BACKUP_BUSY_RETRY_MS 10
+#define CACHE_NBUCKET 1024
+#define EXPORT_BUFFER_SIZE (1 << 20)
+#define IMPORT_NUMBER_MAX 64  // longest real field we parse, with the nul
+
+// The 64-bit change counters are new in SQLite 3.37.
+#if SQLITE_VERSION_NUMBER < 3037000
+#define sqlite3_changes64 sqlite3_changes
+#define sqlite3_total_changes64 sqlite3_total_changes
+#endif
+
+// Bucket i counts durations of 2^(i-1) to 2^i - 1 nanoseconds.
+struct histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t buckets[HISTOGRAM_NBUCKET];
+};
+
+struct stmt_counters {
+    uint64_t statements;
+    uint64_t fullscan_steps;
+    uint64_t sorts;
+    uint64_t autoindexes;
+    uint64_t vm_steps;
+};
+
+struct profile_record {
+    char *sql;  // from sqlite3_expanded_sql()
+    char *plan;  // EXPLAIN QUERY PLAN output, one detail per line
+    int64_t ns;
+    struct stmt_counters counters;  // for this run of the statement alone
+    int need_plan;
+};
+
+// The encoded responses to one execute and the read-rows that follow it,
+// back to back.
+struct cache_entry {
+    struct cache_entry *bucket_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+    size_t hash;
+    char *sql;
+    size_t sql_nbyte;
+    unsigned char *bytes;
+    size_t nbyte;
+    size_t cap;
+    size_t *ends;  // end offset of each response in bytes
+    size_t nresponse;
+    int stale;  // invalidated while being replayed
+};
+
+// Encoded responses waiting to be sent, back to back.
+struct response_queue {
+    unsigned char *bytes;
+    size_t nbyte;
+    size_t cap;
+    size_t *ends;  // end offset of each response in bytes
+    size_t len;
+    size_t next;  // next response to send
+    struct sexp_binary_write *wr;  // encodes into bytes
+};
+
 static sqlite3 *database;
 static sqlite3_stmt *stmt;
 static int should_quit;
 
-static void warn(const char *msg) { fprintf(stderr, "%s\n", msg); }
+// Open incremental blob handles. A handle is 1 + index into this array.
+// Handles that rows hand out are closed when the next statement starts.
+struct blob_slot {
+    sqlite3_blob *blob;
+    int from_row;
+};
+
+static struct blob_slot *blobs;
+static size_t nblob;
+static size_t nrow_blob;  // open handles with from_row set
+
+// Blob columns bigger than this are returned as (blob handle size)
+// instead of a bytevector. Zero means never. Once MAX_ROW_BLOBS handles
+// from rows are open, further blobs are copied instead, so that a big
+// query does not hold a read cursor open for every row.
+static int64_t blob_threshold;
+
+#define MAX_ROW_BLOBS 256
+
+// For each column of stmt: index of the column holding the rowid of the
+// same table, -1 if there is none, -2 if not yet looked up.
+static int *rowid_columns;
+
+// Rows are (ok row #(col ...)) instead of (ok row col ...).
+static int vector_rows;
+
+static struct histogram cmd_histograms[MAX_CMDS];
+static struct histogram decode_histogram;
+static struct histogram execute_histogram;
+static struct histogram step_histogram;
+static struct histogram encode_histogram;
+static struct stmt_counters stmt_counters;
+static uint64_t max_command_alloc_nbyte;
+static uint64_t step_ns;  // time spent in sqlite3_step() by this command
+static struct sexp_binary_read *rd;
+static struct sexp_binary_write *wr;
+
+// Result cache, enabled by the result-cache connect option. Entries are
+// kept in LRU order, most recently used first, until cache_used would
+// exceed cache_limit.
+static struct cache_entry *cache_buckets[CACHE_NBUCKET];
+static struct cache_entry *cache_lru_head;
+static struct cache_entry *cache_lru_tail;
+static size_t cache_limit;
+static size_t cache_used;
+static struct cache_entry *cache_recording;  // filled in by step()
+static struct cache_entry *cache_replaying;  // served by read-row
+static size_t cache_replay_next;
+static struct cache_entry *cache_garbage;  // free after the next write
+static struct sexp_binary_write *cache_wr;
+static sqlite3_stmt *data_version_stmt;
+static int64_t cache_data_version;
+static int stmt_volatile;  // set while preparing, if results may change
+
+// Statements calling these can give different results from the same
+// data, so they are never cached. The date and time functions are here
+// since any of them may be given 'now'.
+static const char *const volatile_functions[] = {
+    "random",        "randomblob",        "changes",
+    "total_changes", "last_insert_rowid", "date",
+    "time",          "datetime",          "julianday",
+    "unixepoch",     "strftime",          "timediff",
+    "current_date",  "current_time",      "current_timestamp",
+    0,
+};
+
+// When set, the response to the current command is these pre-encoded
+// bytes instead of the sexp returned by the command.
+static const void *raw_response;
+static size_t raw_response_nbyte;
+
+// Rows of the current statement stepped ahead while waiting for commands.
+static struct response_queue prefetch_queue;
+static size_t prefetch_limit;  // most responses queued, zero if disabled
+
+// Group commit: autocommit writes share one transaction until the window
+// or the write count runs out, and their responses wait for the commit.
+// Without a window the group waits for the full count of writes, or for
+// some other command.
+static int64_t group_commit_ms;
+static int64_t group_commit_count;  // zero means no limit
+static int group_open;
+static uint64_t group_deadline_ns;  // zero if there is no window
+static struct response_queue group_queue;
+static int response_held;  // the main loop must not send a response
+
+// Online backup that runs in page batches whenever no command is waiting.
+static sqlite3_backup *backup;
+static sqlite3 *backup_database;
+static int backup_pages_per_step;
+static int backup_busy;
+static int backup_pagecount;
+static int backup_remaining;
+static char *backup_error;  // non-null if the last backup failed
+static char backup_out_of_memory[] = "out of memory";  // never freed
+
+// Each sqlite3_step() call is interrupted if it runs past its deadline,
+// or if the client sends SIGUSR1 to the driver. Both are checked from the
+// progress handler rather than with sqlite3_interrupt(), whose flag would
+// outlive a signal that arrives between commands and interrupt the next
+// read-row. The deadline is cleared once the timed work returns, so that
+// statements the driver runs on its own are never cut short by it.
+static int64_t step_timeout_ms;
+static uint64_t step_deadline_ns;
+static volatile sig_atomic_t cancel_requested;
+
+// Profiled statements, oldest first starting at profile_start. When the
+// ring is full the oldest record is dropped.
+static struct profile_record profile_ring[PROFILE_RING_SIZE];
+static size_t profile_start;
+static size_t profile_len;
+static uint64_t profile_dropped;
+static int64_t profile_min_ns;
+static int profile_explain;
+static int explaining;  // don't profile our own EXPLAIN QUERY PLAN
+
+static struct sexp_symbol_index cmd_index;
+static struct sexp_symbol_index option_index;
+static struct sexp_symbol_index format_index;
+static struct sexp_symbol_index import_type_index;  // enum import_type + 1
+
+#define OPTION_DBNAME 1
+#define OPTION_BLOB_THRESHOLD 2
+#define OPTION_RESULT_CACHE 3
+#define OPTION_PREFETCH 4
+#define OPTION_GROUP_COMMIT_MS 5
+#define OPTION_GROUP_COMMIT_COUNT 6
+#define OPTION_ROW_FORMAT 7
+
+#define FORMAT_LIST 1
+#define FORMAT_VECTOR 2
+#define FORMAT_BINARY 3
+#define FORMAT_CSV 4
+
+static void warn(const char *msg) { fprintf(stderr, "%s\n", msg); }
+
+static void die(const char *msg)
+{
+    if (msg) {
+        warn(msg);
+    }
+    exit(2);
+}
+
+static void symbol_index_add(struct sexp_symbol_index *index,
+                             const char *name, size_t value)
+{
+    if (!sexp_symbol_index_add(index, name, value)) {
+        die("out of memory");
+    }
+}
+
+#ifndef _WIN32
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#ifdef _WIN32
+static uint64_t now_ns(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+    return (uint64_t)count.QuadPart / freq.QuadPart * 1000000000 +
+           (uint64_t)count.QuadPart % freq.QuadPart * 1000000000 /
+           freq.QuadPart;
+}
+#endif
+
+// Returns true if a command has started arriving within timeout_ms
+// milliseconds. A negative timeout waits indefinitely. Without poll() we
+// cannot tell, so we claim input is pending and let the read block.
+static int input_pending(int timeout_ms)
+{
+#ifndef _WIN32
+    struct pollfd pfd;
+    int n;
+
+    if (sexp_binary_read_nbuffered(rd)) {
+        return 1;
+    }
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    while (((n = poll(&pfd, 1, timeout_ms)) == -1) && (errno == EINTR))
+        ;
+    return n != 0;
+#else
+    (void)timeout_ms;
+    return 1;
+#endif
+}
+
+// Blocks until a command starts arriving, so that the decode phase does
+// not count the time spent waiting for the client.
+static void wait_for_input(void) { input_pending(-1); }
+
+static void histogram_add(struct histogram *h, uint64_t ns)
+{
+    size_t i;
+
+    for (i = 0; (i < HISTOGRAM_NBUCKET - 1) && (ns >> i); i++)
+        ;
+    h->count++;
+    h->total_ns += ns;
+    h->buckets[i]++;
+}
+
+static int deadline_passed(void)
+{
+    return step_deadline_ns && (now_ns() > step_deadline_ns);
+}
+
+static int progress(void *context)
+{
+    (void)context;
+    return cancel_requested || deadline_passed();
+}
+
+#ifndef _WIN32
+static void handle_cancel_signal(int signo)
+{
+    (void)signo;
+    cancel_requested = 1;
+}
+
+static void install_cancel_signal(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_cancel_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, 0);
+}
+#endif
+
+#ifdef _WIN32
+static void install_cancel_signal(void) {}
+#endif
+
+static struct sexp *new_ok(void)
+{
+    return sexp_new_pair(sexp_new_symbol("ok"), sexp_new_null());
+}
+
+static struct sexp *new_error(const char *code, const char *message)
+{
+    return sexp_new_pair(
+    sexp_new_symbol("error"),
+    sexp_new_pair(sexp_new_symbol(code),
+                  sexp_new_pair(sexp_new_string(message), sexp_new_null())));
+}
+
+// Commands come either as a list (name arg ...), in which case args is
+// the tail, or as a vector #(name arg ...), in which case args is the
+// whole vector.
+static size_t args_len(struct sexp *args)
+{
+    if (sexp_is_vector(args)) {
+        return sexp_vector_len(args) - 1;
+    }
+    return sexp_list_len(args);
+}
+
+static struct sexp *args_ref(struct sexp *args, size_t i)
+{
+    if (sexp_is_vector(args)) {
+        return sexp_vector_ref(args, i + 1);
+    }
+    return sexp_list_ref(args, i);
+}
+
+static void free_cache_entry(struct cache_entry *entry)
+{
+    if (entry) {
+        free(entry->sql);
+        free(entry->bytes);
+        free(entry->ends);
+        free(entry);
+    }
+}
+
+static size_t cache_entry_size(struct cache_entry *entry)
+{
+    return sizeof(*entry) + entry->sql_nbyte + entry->cap +
+           entry->nresponse * sizeof(*entry->ends);
+}
+
+static void unlink_cache_entry(struct cache_entry *entry)
+{
+    struct cache_entry **link;
+
+    link = &cache_buckets[entry->hash % CACHE_NBUCKET];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache_lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache_lru_tail = entry->lru_prev;
+    }
+    entry->bucket_next = entry->lru_prev = entry->lru_next = 0;
+    cache_used -= cache_entry_size(entry);
+}
+
+static void link_cache_entry(struct cache_entry *entry)
+{
+    struct cache_entry **bucket;
+
+    bucket = &cache_buckets[entry->hash % CACHE_NBUCKET];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    entry->lru_prev = 0;
+    if ((entry->lru_next = cache_lru_head)) {
+        cache_lru_head->lru_prev = entry;
+    } else {
+        cache_lru_tail = entry;
+    }
+    cache_lru_head = entry;
+    cache_used += cache_entry_size(entry);
+}
+
+static void stop_recording(void);
+
+static void invalidate_cache(void)
+{
+    struct cache_entry *entry;
+
+    if (cache_recording) {
+        stop_recording();
+    }
+    while ((entry = cache_lru_head)) {
+        unlink_cache_entry(entry);
+        if (entry == cache_replaying) {
+            entry->stale = 1;
+        } else {
+            free_cache_entry(entry);
+        }
+    }
+}
+
+static void invalidate_cache_on_update(void *context, int op,
+                                       const char *dbname, const char *table,
+                                       sqlite3_int64 rowid)
+{
+    (void)context;
+    (void)op;
+    (void)dbname;
+    (void)table;
+    (void)rowid;
+    invalidate_cache();
+}
+
+static int authorize_for_cache(void *context, int action, const char *arg1,
+                               const char *arg2, const char *dbname,
+                               const char *trigger)
+{
+    size_t i;
+
+    (void)context;
+    (void)arg1;
+    (void)dbname;
+    (void)trigger;
+    if (action == SQLITE_FUNCTION) {
+        for (i = 0; volatile_functions[i]; i++) {
+            if (!sqlite3_stricmp(arg2, volatile_functions[i])) {
+                stmt_volatile = 1;
+                break;
+            }
+        }
+    }
+    return SQLITE_OK;
+}
+
+// PRAGMA data_version changes when another connection commits. Changes
+// made through our own connection are caught by the update hook and by
+// invalidating on every statement that is not read-only.
+static void check_data_version(void)
+{
+    int64_t version;
+
+    if (!data_version_stmt &&
+        sqlite3_prepare_v2(database, "pragma data_version", -1,
+                           &data_version_stmt, 0)) {
+        invalidate_cache();
+        return;
+    }
+    version = -1;
+    if (sqlite3_step(data_version_stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int64(data_version_stmt, 0);
+    }
+    sqlite3_reset(data_version_stmt);
+    if ((version == -1) || (version != cache_data_version)) {
+        invalidate_cache();
+        cache_data_version = version;
+    }
+}
+
+static void *write_to_cache_entry(void *port, void *bytes, size_t nbyte)
+{
+    struct cache_entry *entry = cache_recording;
+    unsigned char *new_bytes;
+    size_t cap;
+
+    (void)port;
+    if (nbyte > entry->cap - entry->nbyte) {
+        for (cap = entry->cap ? entry->cap : 256; cap - entry->nbyte < nbyte;
+             cap *= 2)
+            ;
+        if (!(new_bytes = realloc(entry->bytes, cap))) {
+            return "out of memory";
+        }
+        entry->bytes = new_bytes;
+        entry->cap = cap;
+    }
+    memcpy(entry->bytes + entry->nbyte, bytes, nbyte);
+    entry->nbyte += nbyte;
+    return 0;
+}
+
+static void *flush_cache_entry(void *port)
+{
+    (void)port;
+    return 0;
+}
+
+static void start_recording(const char *sql)
+{
+    struct cache_entry *entry;
+
+    if (!cache_wr && !(cache_wr = sexp_binary_write_new(
+                       write_to_cache_entry, flush_cache_entry, 0))) {
+        return;
+    }
+    if (!(entry = calloc(1, sizeof(*entry)))) {
+        return;
+    }
+    entry->sql_nbyte = strlen(sql);
+    if (!(entry->sql = malloc(entry->sql_nbyte + 1))) {
+        free(entry);
+        return;
+    }
+    memcpy(entry->sql, sql, entry->sql_nbyte + 1);
+    entry->hash = sexp_hash_bytes(sql, entry->sql_nbyte);
+    cache_recording = entry;
+}
+
+static void stop_recording(void)
+{
+    free_cache_entry(cache_garbage);
+    cache_garbage = cache_recording;
+    cache_recording = 0;
+}
+
+// Encodes a response to the statement being recorded into its cache
+// entry and makes that encoding the raw response. When done is set the
+// entry is complete and goes into the cache.
+static struct sexp *record_response(struct sexp *response, int done)
+{
+    struct cache_entry *entry = cache_recording;
+    size_t *ends;
+    size_t start;
+
+    if (!entry) {
+        return response;
+    }
+    if (!(ends = realloc(entry->ends,
+                         (entry->nresponse + 1) * sizeof(*ends)))) {
+        stop_recording();
+        return response;
+    }
+    entry->ends = ends;
+    if (!sexp_binary_write(cache_wr, response)) {
+        stop_recording();
+        return response;
+    }
+    start = entry->nresponse ? ends[entry->nresponse - 1] : 0;
+    ends[entry->nresponse++] = entry->nbyte;
+    raw_response = entry->bytes + start;
+    raw_response_nbyte = entry->nbyte - start;
+    sexp_free(response);
+    if (cache_entry_size(entry) > cache_limit) {
+        stop_recording();
+    } else if (done) {
+        while (cache_lru_tail &&
+               (cache_used + cache_entry_size(entry) > cache_limit)) {
+            struct cache_entry *lru = cache_lru_tail;
+
+            unlink_cache_entry(lru);
+            free_cache_entry(lru);
+        }
+        link_cache_entry(entry);
+        cache_recording = 0;
+    }
+    return 0;
+}
+
+static struct sexp *replay_response(void)
+{
+    struct cache_entry *entry = cache_replaying;
+    size_t start;
+
+    start = cache_replay_next ? entry->ends[cache_replay_next - 1] : 0;
+    raw_response = entry->bytes + start;
+    raw_response_nbyte = entry->ends[cache_replay_next] - start;
+    if (++cache_replay_next == entry->nresponse) {
+        cache_replaying = 0;
+        if (entry->stale) {
+            free_cache_entry(cache_garbage);
+            cache_garbage = entry;
+        }
+    }
+    return 0;
+}
+
+static struct cache_entry *lookup_cache(const char *sql, size_t sql_nbyte)
+{
+    struct cache_entry *entry;
+    size_t hash;
+
+    hash = sexp_hash_bytes(sql, sql_nbyte);
+    for (entry = cache_buckets[hash % CACHE_NBUCKET]; entry;
+         entry = entry->bucket_next) {
+        if ((entry->hash == hash) && (entry->sql_nbyte == sql_nbyte) &&
+            !memcmp(entry->sql, sql, sql_nbyte)) {
+            unlink_cache_entry(entry);
+            link_cache_entry(entry);
+            return entry;
+        }
+    }
+    return 0;
+}
+
+static struct sexp *cmd_connect(struct sexp *args)
+{
+    const char *dbname;
+    size_t i, len;
+    int error;
+
+    dbname = 0;
+    len = args_len(args);
+    if (len % 2 != 0) {
+        return new_error("args", "odd number of args");
+    }
+    for (i = 0; i < len; i += 2) {
+        struct sexp *name = args_ref(args, i);
+        struct sexp *value = args_ref(args, i + 1);
+
+        if (!sexp_is_symbol(name)) {
+            return new_error("args", "option name is not a symbol");
+        }
+        switch (sexp_symbol_index_ref(&option_index, name)) {
+        case OPTION_DBNAME:
+            if (!sexp_is_string(value)) {
+                return new_error("args", "option value is not a string");
+            }
+            if (!(dbname = sexp_strdup(value))) {
+                return new_error("args", "cannot turn dbname into C string");
+            }
+            break;
+        case OPTION_BLOB_THRESHOLD:
+            if (!sexp_is_int64(value) || (sexp_int64_value(value) < 0)) {
+                return new_error("args", "blob threshold is not a size");
+            }
+            blob_threshold = sexp_int64_value(value);
+            break;
+        case OPTION_RESULT_CACHE:
+            if (!sexp_is_int64(value) || (sexp_int64_value(value) < 0)) {
+                return new_error("args", "result cache size is not a size");
+            }
+            cache_limit = (size_t)sexp_int64_value(value);
+            break;
+        case OPTION_PREFETCH:
+            if (!sexp_is_int64(value) || (sexp_int64_value(value) < 0)) {
+                return new_error("args", "prefetch is not a row count");
+            }
+            prefetch_limit = (size_t)sexp_int64_value(value);
+            break;
+        case OPTION_GROUP_COMMIT_MS:
+            if (!sexp_is_int64(value) || (sexp_int64_value(value) < 0) ||
+                (sexp_int64_value(value) > INT32_MAX)) {
+                return new_error("args",
+                                 "group commit window is not milliseconds");
+            }
+            group_commit_ms = sexp_int64_value(value);
+            break;
+        case OPTION_GROUP_COMMIT_COUNT:
+            if (!sexp_is_int64(value) || (sexp_int64_value(value) < 0)) {
+                return new_error("args", "group commit count is not a count");
+            }
+            group_commit_count = sexp_int64_value(value);
+            break;
+        case OPTION_ROW_FORMAT:
+            switch (sexp_symbol_index_ref(&format_index, value)) {
+            case FORMAT_LIST:
+                vector_rows = 0;
+                break;
+            case FORMAT_VECTOR:
+                vector_rows = 1;
+                break;
+            default:
+                return new_error("args", "row format is not list or vector");
+            }
+            break;
+        default:
+            return new_error("args", "no such database option for sqlite");
+        }
+    }
+    if (!dbname) {
+        return new_error("args", "dbname option not given");
+    }
+    if ((error = sqlite3_open(dbname, &database))) {
+        if (!database) {
+            return new_error("database", sqlite3_errstr(error));
+        }
+        warn(sqlite3_errmsg(database));
+        if ((error = sqlite3_close(database))) {
+            return new_error("database", sqlite3_errmsg(database));
+        }
+        die(0);
+    }
+    sqlite3_progress_handler(database, PROGRESS_INTERVAL, progress, 0);
+    if (cache_limit) {
+        sqlite3_update_hook(database, invalidate_cache_on_update, 0);
+        sqlite3_set_authorizer(database, authorize_for_cache, 0);
+    }
+    return new_ok();
+}
+
+static struct sexp *cmd_disconnect(struct sexp *args)
+{
+    if (args_len(args)) {
+        return new_error("args", "wrong number of args");
+    }
+    should_quit = 1;
+    return new_ok();
+}
+
+static int64_t new_blob_handle(sqlite3_blob *blob, int from_row)
+{
+    struct blob_slot *new_blobs;
+    size_t i;
+
+    for (i = 0; (i < nblob) && blobs[i].blob; i++)
+        ;
+    if (i == nblob) {
+        if (!(new_blobs =
+              realloc(blobs, (nblob + 1) * sizeof(*new_blobs)))) {
+            return 0;
+        }
+        blobs = new_blobs;
+        nblob++;
+    }
+    blobs[i].blob = blob;
+    blobs[i].from_row = from_row;
+    nrow_blob += !!from_row;
+    return i + 1;
+}
+
+static int close_blob_slot(struct blob_slot *slot)
+{
+    sqlite3_blob *blob;
+
+    blob = slot->blob;
+    nrow_blob -= !!slot->from_row;
+    slot->blob = 0;
+    slot->from_row = 0;
+    return sqlite3_blob_close(blob);
+}
+
+static void close_row_blobs(void)
+{
+    size_t i;
+
+    for (i = 0; nrow_blob && (i < nblob); i++) {
+        if (blobs[i].blob && blobs[i].from_row) {
+            close_blob_slot(&blobs[i]);
+        }
+    }
+}
+
+static sqlite3_blob *blob_by_handle(struct sexp *handle)
+{
+    int64_t i;
+
+    if (!sexp_is_int64(handle)) {
+        return 0;
+    }
+    i = sexp_int64_value(handle);
+    return ((i > 0) && ((uint64_t)i <= nblob)) ? blobs[i - 1].blob : 0;
+}
+
+static void close_all_blobs(void)
+{
+    size_t i;
+
+    for (i = 0; i < nblob; i++) {
+        sqlite3_blob_close(blobs[i].blob);
+    }
+    free(blobs);
+    blobs = 0;
+    nblob = nrow_blob = 0;
+}
+
+static struct sexp *new_blob_response(int64_t handle, sqlite3_blob *blob)
+{
+    return sexp_new_pair(
+    sexp_new_symbol("ok"),
+    sexp_new_pair(sexp_new_int64(handle),
+                  sexp_new_pair(sexp_new_int64(sqlite3_blob_bytes(blob)),
+                                sexp_new_null())));
+}
+
+static struct sexp *cmd_blob_open(struct sexp *args)
+{
+    struct sexp *rowid;
+    struct sexp *writable;
+    sqlite3_blob *blob;
+    char *table;
+    char *column;
+    int64_t handle;
+    size_t len;
+    int error;
+
+    len = args_len(args);
+    if ((len != 3) && (len != 4)) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    rowid = args_ref(args, 2);
+    writable = args_ref(args, 3);
+    if (!sexp_is_int64(rowid)) {
+        return new_error("args", "rowid is not an integer");
+    }
+    if (!(table = sexp_strdup(args_ref(args, 0)))) {
+        return new_error("args", "cannot turn table name into C string");
+    }
+    if (!(column = sexp_strdup(args_ref(args, 1)))) {
+        free(table);
+        return new_error("args", "cannot turn column name into C string");
+    }
+    error = sqlite3_blob_open(database, "main", table, column,
+                              sexp_int64_value(rowid),
+                              sexp_is_true(writable), &blob);
+    free(column);
+    free(table);
+    if (error) {
+        return new_error("database", sqlite3_errmsg(database));
+    }
+    if (!(handle = new_blob_handle(blob, 0))) {
+        sqlite3_blob_close(blob);
+        return new_error("memory", "out of memory");
+    }
+    return new_blob_response(handle, blob);
+}
+
+static struct sexp *cmd_blob_reopen(struct sexp *args)
+{
+    struct sexp *rowid;
+    sqlite3_blob *blob;
+
+    if (args_len(args) != 2) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!(blob = blob_by_handle(args_ref(args, 0)))) {
+        return new_error("args", "no such blob handle");
+    }
+    rowid = args_ref(args, 1);
+    if (!sexp_is_int64(rowid)) {
+        return new_error("args", "rowid is not an integer");
+    }
+    if (sqlite3_blob_reopen(blob, sexp_int64_value(rowid))) {
+        return new_error("database", sqlite3_errmsg(database));
+    }
+    return new_blob_response(sexp_int64_value(args_ref(args, 0)),
+                             blob);
+}
+
+static int get_blob_offset(sqlite3_blob *blob, struct sexp *offset_sexp,
+                           int *out)
+{
+    int64_t offset;
+
+    if (!sexp_is_int64(offset_sexp)) {
+        return 0;
+    }
+    offset = sexp_int64_value(offset_sexp);
+    if ((offset < 0) || (offset > sqlite3_blob_bytes(blob))) {
+        return 0;
+    }
+    *out = (int)offset;
+    return 1;
+}
+
+// Reads at most nbyte bytes starting at offset. A short or empty
+// bytevector means the end of the blob was reached.
+static struct sexp *cmd_blob_read(struct sexp *args)
+{
+    struct sexp *nbyte_sexp;
+    struct sexp *bv;
+    sqlite3_blob *blob;
+    int64_t nbyte;
+    int offset;
+
+    if (args_len(args) != 3) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!(blob = blob_by_handle(args_ref(args, 0)))) {
+        return new_error("args", "no such blob handle");
+    }
+    if (!get_blob_offset(blob, args_ref(args, 1), &offset)) {
+        return new_error("args", "blob offset out of range");
+    }
+    nbyte_sexp = args_ref(args, 2);
+    if (!sexp_is_int64(nbyte_sexp) || (sexp_int64_value(nbyte_sexp) < 0)) {
+        return new_error("args", "byte count is not a size");
+    }
+    nbyte = sexp_int64_value(nbyte_sexp);
+    if (nbyte > sqlite3_blob_bytes(blob) - offset) {
+        nbyte = sqlite3_blob_bytes(blob) - offset;
+    }
+    if (!(bv = sexp_new_bytevector_zeros((size_t)nbyte))) {
+        return new_error("memory", "out of memory");
+    }
+    if (sqlite3_blob_read(blob, sexp_bytes(bv), (int)nbyte, offset)) {
+        sexp_free(bv);
+        return new_error("database", sqlite3_errmsg(database));
+    }
+    return sexp_new_pair(sexp_new_symbol("ok"),
+                         sexp_new_pair(bv, sexp_new_null()));
+}
+
+static struct sexp *cmd_blob_write(struct sexp *args)
+{
+    struct sexp *bv;
+    sqlite3_blob *blob;
+    int offset;
+
+    if (args_len(args) != 3) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!(blob = blob_by_handle(args_ref(args, 0)))) {
+        return new_error("args", "no such blob handle");
+    }
+    if (!get_blob_offset(blob, args_ref(args, 1), &offset)) {
+        return new_error("args", "blob offset out of range");
+    }
+    bv = args_ref(args, 2);
+    if (!sexp_is_bytevector(bv)) {
+        return new_error("args", "blob data is not a bytevector");
+    }
+    if (sexp_nbyte(bv) > (size_t)(sqlite3_blob_bytes(blob) - offset)) {
+        return new_error("args", "cannot write past the end of the blob");
+    }
+    if (sqlite3_blob_write(blob, sexp_bytes(bv), (int)sexp_nbyte(bv),
+                           offset)) {
+        return new_error("database", sqlite3_errmsg(database));
+    }
+    invalidate_cache();
+    return new_ok();
+}
+
+static struct sexp *cmd_blob_close(struct sexp *args)
+{
+    int error;
+
+    if (args_len(args) != 1) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!blob_by_handle(args_ref(args, 0))) {
+        return new_error("args", "no such blob handle");
+    }
+    error = close_blob_slot(&blobs[sexp_int64_value(args_ref(args, 0)) - 1]);
+    if (error) {
+        return new_error("database", sqlite3_errstr(error));
+    }
+    return new_ok();
+}
+
+// A column is usable as the rowid of a table if SQLite reports it as
+// "rowid", or if it is the table's only primary key column and is
+// declared INTEGER, which makes it an alias for the rowid.
+static int is_rowid_column(int col, const char *dbname, const char *table)
+{
+    static const char count_pk_sql[] =
+    "select count(*) from pragma_table_info(?1, ?2) where pk > 0";
+    sqlite3_stmt *count_pk;
+    const char *origin;
+    const char *type;
+    int pk, npk;
+
+    if (!(origin = sqlite3_column_origin_name(stmt, col))) {
+        return 0;
+    }
+    if (!strcmp(origin, "rowid")) {
+        return 1;
+    }
+    if (sqlite3_table_column_metadata(database, dbname, table, origin,
+                                      &type, 0, 0, &pk, 0)) {
+        return 0;
+    }
+    if (!pk || !type || sqlite3_stricmp(type, "INTEGER")) {
+        return 0;
+    }
+    if (sqlite3_prepare_v2(database, count_pk_sql, -1, &count_pk, 0)) {
+        return 0;
+    }
+    sqlite3_bind_text(count_pk, 1, table, -1, SQLITE_STATIC);
+    sqlite3_bind_text(count_pk, 2, dbname, -1, SQLITE_STATIC);
+    npk = 0;
+    if (sqlite3_step(count_pk) == SQLITE_ROW) {
+        npk = sqlite3_column_int(count_pk, 0);
+    }
+    sqlite3_finalize(count_pk);
+    return npk == 1;
+}
+
+static int find_rowid_column(int col)
+{
+    const char *dbname;
+    const char *table;
+    int i, n;
+
+    if (rowid_columns[col] != -2) {
+        return rowid_columns[col];
+    }
+    rowid_columns[col] = -1;
+    dbname = sqlite3_column_database_name(stmt, col);
+    table = sqlite3_column_table_name(stmt, col);
+    if (!dbname || !table) {
+        return -1;
+    }
+    n = sqlite3_column_count(stmt);
+    for (i = 0; i < n; i++) {
+        if ((i == col) || !sqlite3_column_table_name(stmt, i)) {
+            continue;
+        }
+        if (strcmp(dbname, sqlite3_column_database_name(stmt, i)) ||
+            strcmp(table, sqlite3_column_table_name(stmt, i))) {
+            continue;
+        }
+        if (is_rowid_column(i, dbname, table)) {
+            rowid_columns[col] = i;
+            break;
+        }
+    }
+    return rowid_columns[col];
+}
+
+// Opens a read-only handle on a blob column of the current row. Returns
+// null if the query does not select the rowid of the blob's table, or if
+// too many handles from rows are open, in which case the caller falls
+// back to copying the bytes.
+static struct sexp *new_blob_ref(int col, int nbyte)
+{
+    sqlite3_blob *blob;
+    int64_t handle;
+    int rowid_col;
+
+    if (nrow_blob >= MAX_ROW_BLOBS) {
+        return 0;
+    }
+    if ((rowid_col = find_rowid_column(col)) < 0) {
+        return 0;
+    }
+    if (sqlite3_blob_open(database, sqlite3_column_database_name(stmt, col),
+                          sqlite3_column_table_name(stmt, col),
+                          sqlite3_column_origin_name(stmt, col),
+                          sqlite3_column_int64(stmt, rowid_col), 0, &blob)) {
+        return 0;
+    }
+    if (!(handle = new_blob_handle(blob, 1))) {
+        sqlite3_blob_close(blob);
+        return 0;
+    }
+    return sexp_new_pair(
+    sexp_new_symbol("blob"),
+    sexp_new_pair(sexp_new_int64(handle),
+                  sexp_new_pair(sexp_new_int64(nbyte), sexp_new_null())));
+}
+
+// sqlite3_prepare()
+// sqlite3_step()
+// sqlite3_column()
+// sqlite3_finalize()
+
+// Moves the counters of a statement into run and stmt_counters. Resetting
+// them means nothing is counted twice, and each profiled run of a reused
+// statement gets only its own counts.
+static void take_stmt_status(sqlite3_stmt *counted,
+                             struct stmt_counters *run)
+{
+    run->fullscan_steps =
+    sqlite3_stmt_status(counted, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    run->sorts = sqlite3_stmt_status(counted, SQLITE_STMTSTATUS_SORT, 1);
+    run->autoindexes =
+    sqlite3_stmt_status(counted, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+    run->vm_steps =
+    sqlite3_stmt_status(counted, SQLITE_STMTSTATUS_VM_STEP, 1);
+    stmt_counters.fullscan_steps += run->fullscan_steps;
+    stmt_counters.sorts += run->sorts;
+    stmt_counters.autoindexes += run->autoindexes;
+    stmt_counters.vm_steps += run->vm_steps;
+}
+
+static void count_stmt_status(sqlite3_stmt *counted)
+{
+    struct stmt_counters run;
+
+    stmt_counters.statements++;
+    take_stmt_status(counted, &run);
+}
+
+static int finalize_stmt(void)
+{
+    int error;
+
+    count_stmt_status(stmt);
+    error = sqlite3_finalize(stmt);
+    stmt = 0;
+    return error;
+}
+
+static struct sexp *new_value(sqlite3_value *value)
+{
+    switch (sqlite3_value_type(value)) {
+    case SQLITE_INTEGER:
+        return sexp_new_int64(sqlite3_value_int64(value));
+    case SQLITE_FLOAT:
+        // REAL columns come back as float64, no longer as the string
+        // sqlite3_value_text() would make of them.
+        return sexp_new_float64(sqlite3_value_double(value));
+    case SQLITE_TEXT:
+        return sexp_new_string_bytes(sqlite3_value_text(value),
+                                     sqlite3_value_bytes(value));
+    case SQLITE_BLOB:
+        return sexp_new_bytevector_bytes(sqlite3_value_blob(value),
+                                         sqlite3_value_bytes(value));
+    case SQLITE_NULL:
+        break;
+    default:
+        // TODO: error
+        break;
+    }
+    return sexp_new_null();
+}
+
+static struct sexp *step(void)
+{
+    struct sexp *head;
+    struct sexp *tail;
+    struct sexp *vec;
+    struct sexp *colsexp;
+    sqlite3_value *value;
+    uint64_t start;
+    int timed_out;
+    int error;
+    int i, n;
+
+    start = now_ns();
+    step_deadline_ns =
+    step_timeout_ms ? start + (uint64_t)step_timeout_ms * 1000000 : 0;
+    error = sqlite3_step(stmt);
+    timed_out = deadline_passed();
+    step_deadline_ns = 0;
+    step_ns += now_ns() - start;
+    if (error == SQLITE_DONE) {
+        if ((error = finalize_stmt())) {
+            if (cache_recording) {
+                stop_recording();
+            }
+            return new_error("database", sqlite3_errmsg(database));
+        }
+        return record_response(new_ok(), 1);
+    }
+    if (error != SQLITE_ROW) {
+        if (cache_recording) {
+            stop_recording();
+        }
+        if (error == SQLITE_INTERRUPT) {
+            head = new_error("interrupted", timed_out
+                                            ? "statement timed out"
+                                            : "statement was cancelled");
+        } else {
+            head = new_error("database", sqlite3_errmsg(database));
+        }
+        finalize_stmt();
+        return head;
+    }
+    head = tail = sexp_new_pair(sexp_new_symbol("row"), sexp_new_null());
+    n = sqlite3_column_count(stmt);
+    vec = 0;
+    if (vector_rows) {
+        vec = sexp_new_vector(n);
+        sexp_set_tail(head, sexp_new_pair(vec, sexp_new_null()));
+    }
+    for (i = 0; i < n; i++) {
+        value = sqlite3_column_value(stmt, i);
+        colsexp = 0;
+        if ((sqlite3_value_type(value) == SQLITE_BLOB) && blob_threshold &&
+            (sqlite3_value_bytes(value) > blob_threshold)) {
+            colsexp = new_blob_ref(i, sqlite3_value_bytes(value));
+            if (cache_recording) {
+                stop_recording();  // the handle is only good for this run
+            }
+        }
+        if (!colsexp) {
+            colsexp = new_value(value);
+        }
+        if (vec) {
+            sexp_vector_set(vec, i, colsexp);
+        } else {
+            tail = sexp_set_tail(tail,
+                                 sexp_new_pair(colsexp, sexp_new_null()));
+        }
+    }
+    return record_response(sexp_new_pair(sexp_new_symbol("ok"), head), 0);
+}
+
+static size_t prefetch_pending(void)
+{
+    return prefetch_queue.len - prefetch_queue.next;
+}
+
+static void *write_to_response_queue(void *port, void *bytes, size_t nbyte)
+{
+    struct response_queue *queue = port;
+    unsigned char *new_bytes;
+    size_t cap;
+
+    if (nbyte > queue->cap - queue->nbyte) {
+        for (cap = queue->cap ? queue->cap : 4096; cap - queue->nbyte < nbyte;
+             cap *= 2)
+            ;
+        if (!(new_bytes = realloc(queue->bytes, cap))) {
+            return "out of memory";
+        }
+        queue->bytes = new_bytes;
+        queue->cap = cap;
+    }
+    memcpy(queue->bytes + queue->nbyte, bytes, nbyte);
+    queue->nbyte += nbyte;
+    return 0;
+}
+
+static void *flush_response_queue(void *port)
+{
+    (void)port;
+    return 0;
+}
+
+// Appends a response to the queue. A null response means the command
+// left its encoding in raw_response.
+static void queue_response(struct response_queue *queue,
+                           struct sexp *response)
+{
+    size_t *ends;
+
+    if (!queue->wr && !(queue->wr = sexp_binary_write_new(
+                        write_to_response_queue, flush_response_queue,
+                        queue))) {
+        die("out of memory");
+    }
+    if (!(ends = realloc(queue->ends, (queue->len + 1) * sizeof(*ends)))) {
+        die("out of memory");
+    }
+    queue->ends = ends;
+    if (response) {
+        if (!sexp_binary_write(queue->wr, response)) {
+            die(sexp_binary_write_error(queue->wr));
+        }
+        sexp_free(response);
+    } else if (write_to_response_queue(queue, (void *)raw_response,
+                                       raw_response_nbyte)) {
+        die("out of memory");
+    }
+    raw_response = 0;
+    ends[queue->len++] = queue->nbyte;
+}
+
+static void prefetch_row(void)
+{
+    if (!prefetch_pending()) {
+        prefetch_queue.nbyte = prefetch_queue.len = prefetch_queue.next = 0;
+    }
+    queue_response(&prefetch_queue, step());
+}
+
+// Keeps stepping the current statement until a command arrives or the
+// queue is full, so that the database works while the client is busy with
+// the rows it already has.
+static void run_prefetch_while_idle(void)
+{
+    while (prefetch_limit && stmt && (prefetch_pending() < prefetch_limit)) {
+        if (input_pending(0)) {
+            break;
+        }
+        prefetch_row();
+    }
+}
+
+static struct sexp *next_prefetched_response(void)
+{
+    struct response_queue *queue = &prefetch_queue;
+    size_t start;
+
+    start = queue->next ? queue->ends[queue->next - 1] : 0;
+    raw_response = queue->bytes + start;
+    raw_response_nbyte = queue->ends[queue->next++] - start;
+    return 0;
+}
+
+// Commits the group transaction and sends the responses held for it. If
+// the commit fails, each held write is answered with that error instead.
+static void end_group(void)
+{
+    struct sexp *error;
+    size_t i;
+
+    if (sqlite3_exec(database, "commit", 0, 0, 0)) {
+        error = new_error("database", sqlite3_errmsg(database));
+        sqlite3_exec(database, "rollback", 0, 0, 0);
+        for (i = 0; i < group_queue.len; i++) {
+            if (!sexp_binary_write(wr, error)) {
+                die(sexp_binary_write_error(wr));
+            }
+        }
+        sexp_free(error);
+    } else if (!sexp_binary_write_raw(wr, group_queue.bytes,
+                                      group_queue.nbyte)) {
+        die(sexp_binary_write_error(wr));
+    }
+    group_queue.nbyte = group_queue.len = group_queue.next = 0;
+    group_open = 0;
+}
+
+// Commits once the window has passed without another command arriving.
+static void run_group_commit_while_idle(void)
+{
+    uint64_t now;
+
+    if (!group_open || !group_deadline_ns) {
+        return;
+    }
+    now = now_ns();
+    if ((now < group_deadline_ns) &&
+        input_pending((int)((group_deadline_ns - now + 999999) / 1000000))) {
+        return;
+    }
+    end_group();
+}
+
+// Runs a write inside the group transaction and holds back its response.
+static struct sexp *execute_in_group(void)
+{
+    if (!group_open) {
+        if (sqlite3_exec(database, "begin", 0, 0, 0)) {
+            finalize_stmt();
+            return new_error("database", sqlite3_errmsg(database));
+        }
+        group_open = 1;
+        group_deadline_ns =
+        group_commit_ms ? now_ns() + (uint64_t)group_commit_ms * 1000000 : 0;
+    }
+    queue_response(&group_queue, step());
+    response_held = 1;
+    if (group_commit_count &&
+        (group_queue.len >= (uint64_t)group_commit_count)) {
+        end_group();
+    }
+    return 0;
+}
+
+// Drops the unread rows of the current statement, whether they are still
+// to be stepped, prefetched or replayed from the cache, and closes the
+// blob handles that its rows handed out.
+static void drop_statement(void)
+{
+    struct cache_entry *entry;
+
+    if ((entry = cache_replaying)) {
+        cache_replaying = 0;
+        if (entry->stale) {
+            free_cache_entry(cache_garbage);
+            cache_garbage = entry;
+        }
+    }
+    prefetch_queue.nbyte = prefetch_queue.len = prefetch_queue.next = 0;
+    close_row_blobs();
+    if (stmt) {
+        if (cache_recording) {
+            stop_recording();
+        }
+        finalize_stmt();
+    }
+}
+
+// Starting a new execute, execute-script or import drops any unread rows
+// of the previous statement, as in driver-postgres, where the next query
+// may already have been sent. A command with bad arguments leaves them.
+static struct sexp *cmd_execute(struct sexp *args)
+{
+    struct sexp *sql_sexp;
+    static char *sql;
+    const char *tail;
+    int error;
+
+    free(sql);
+    sql = 0;
+    cancel_requested = 0;
+    if (args_len(args) != 1) {
+        return new_error("args", "wrong number of args");
+    }
+    sql_sexp = args_ref(args, 0);
+    if (!sexp_is_string(sql_sexp)) {
+        return new_error("args", "SQL query is not a string");
+    }
+    if (!(sql = sexp_strdup(sql_sexp))) {
+        return new_error("args", "cannot turn SQL query into C string");
+    }
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    drop_statement();
+    if (cache_limit && sqlite3_get_autocommit(database)) {
+        check_data_version();
+        if ((cache_replaying = lookup_cache(sql, strlen(sql)))) {
+            cache_replay_next = 0;
+            return replay_response();
+        }
+    }
+    stmt_volatile = 0;
+    if ((error = sqlite3_prepare_v2(database, sql, -1, &stmt, &tail))) {
+        return new_error("database", sqlite3_errmsg(database));
+    }
+    if (*tail) {
+        finalize_stmt();
+        return new_error(
+        "args", "cannot execute more than one SQL statement at once");
+    }
+    if (group_commit_ms || group_commit_count) {
+        if (!sqlite3_stmt_readonly(stmt) && !sqlite3_column_count(stmt) &&
+            (group_open || sqlite3_get_autocommit(database))) {
+            if (cache_limit) {
+                invalidate_cache();
+            }
+            return execute_in_group();
+        }
+        if (group_open) {
+            end_group();
+        }
+    }
+    if (cache_limit) {
+        if (!sqlite3_stmt_readonly(stmt)) {
+            invalidate_cache();
+        } else if (sqlite3_get_autocommit(database) && !stmt_volatile) {
+            start_recording(sql);
+        }
+    }
+    if (blob_threshold) {
+        int i, n;
+
+        n = sqlite3_column_count(stmt);
+        free(rowid_columns);
+        if (!(rowid_columns = calloc(n + 1, sizeof(*rowid_columns)))) {
+            return new_error("memory", "out of memory");
+        }
+        for (i = 0; i < n; i++) {
+            rowid_columns[i] = -2;
+        }
+    }
+    return step();
+}
+
+static struct sexp *cmd_read_row(struct sexp *args)
+{
+    if (args_len(args)) {
+        return new_error("args", "wrong number of args");
+    }
+    cancel_requested = 0;
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    if (cache_replaying) {
+        return replay_response();
+    }
+    if (prefetch_pending()) {
+        return next_prefetched_response();
+    }
+    if (!stmt) {
+        return new_error("state", "not executing a statement");
+    }
+    return step();
+}
+
+// Runs one statement of a script to completion, discarding any rows.
+static int run_script_stmt(sqlite3_stmt *script_stmt, int64_t *changes)
+{
+    int64_t total;
+    int error;
+
+    total = sqlite3_total_changes64(database);
+    while ((error = sqlite3_step(script_stmt)) == SQLITE_ROW)
+        ;
+    *changes = (sqlite3_total_changes64(database) != total)
+               ? sqlite3_changes64(database)
+               : 0;
+    count_stmt_status(script_stmt);
+    if (sqlite3_finalize(script_stmt) && (error == SQLITE_DONE)) {
+        error = sqlite3_errcode(database);
+    }
+    return (error == SQLITE_DONE) ? SQLITE_OK : error;
+}
+
+// (execute-script sql [transaction]) runs every statement in sql in turn
+// and returns (ok (changes ...)) with the rows changed by each one. The
+// first failing statement stops the script with (error code message
+// offset (changes ...)), where offset is the byte offset of the error in
+// sql. With transaction true, a failure undoes the whole script.
+static struct sexp *cmd_execute_script(struct sexp *args)
+{
+    struct sexp *changes_head;
+    struct sexp *changes_tail;
+    struct sexp *response;
+    sqlite3_stmt *script_stmt;
+    const char *next;
+    const char *tail;
+    char *sql;
+    int64_t changes;
+    int offset;
+    int transaction;
+    int error;
+    size_t len;
+
+    len = args_len(args);
+    if ((len != 1) && (len != 2)) {
+        return new_error("args", "wrong number of args");
+    }
+    cancel_requested = 0;
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    if (!sexp_is_string(args_ref(args, 0)) ||
+        !(sql = sexp_strdup(args_ref(args, 0)))) {
+        return new_error("args", "SQL script is not a string");
+    }
+    drop_statement();
+    transaction = sexp_is_true(args_ref(args, 1));
+    if (transaction && sqlite3_exec(database, "savepoint script", 0, 0, 0)) {
+        free(sql);
+        return new_error("database", sqlite3_errmsg(database));
+    }
+    step_deadline_ns =
+    step_timeout_ms ? now_ns() + (uint64_t)step_timeout_ms * 1000000 : 0;
+    changes_head = changes_tail = sexp_new_null();
+    error = SQLITE_OK;
+    for (next = sql; *next; next = tail) {
+        script_stmt = 0;
+        if ((error = sqlite3_prepare_v2(database, next, -1, &script_stmt,
+                                        &tail))) {
+            break;
+        }
+        if (!script_stmt) {
+            break;  // only whitespace and comments left
+        }
+        if (cache_limit && !sqlite3_stmt_readonly(script_stmt)) {
+            invalidate_cache();
+        }
+        if ((error = run_script_stmt(script_stmt, &changes))) {
+            break;
+        }
+        response = sexp_new_pair(sexp_new_int64(changes), sexp_new_null());
+        if (changes_tail) {
+            sexp_set_tail(changes_tail, response);
+        } else {
+            changes_head = response;
+        }
+        changes_tail = response;
+    }
+    step_deadline_ns = 0;
+    if (!error) {
+        if (!transaction ||
+            !sqlite3_exec(database, "release script", 0, 0, 0)) {
+            free(sql);
+            return sexp_new_pair(
+            sexp_new_symbol("ok"),
+            sexp_new_pair(changes_head, sexp_new_null()));
+        }
+        error = sqlite3_errcode(database);
+    }
+#if SQLITE_VERSION_NUMBER >= 3038000
+    offset = sqlite3_error_offset(database);
+#else
+    offset = -1;
+#endif
+    offset = (int)(next - sql) + ((offset < 0) ? 0 : offset);
+    response = new_error((error == SQLITE_INTERRUPT) ? "interrupted"
+                                                     : "database",
+                         sqlite3_errmsg(database));
+    sexp_set_tail(sexp_list_tail(response, 2),
+                  sexp_new_pair(sexp_new_int64(offset),
+                                sexp_new_pair(changes_head,
+                                              sexp_new_null())));
+    if (transaction) {
+        sqlite3_exec(database, "rollback to script", 0, 0, 0);
+        sqlite3_exec(database, "release script", 0, 0, 0);
+    }
+    free(sql);
+    return response;
+}
+
+static void free_profile_record(struct profile_record *rec)
+{
+    sqlite3_free(rec->sql);
+    free(rec->plan);
+    memset(rec, 0, sizeof(*rec));
+}
+
+static int trace_profile(unsigned int type, void *context, void *p, void *x)
+{
+    struct profile_record *rec;
+    struct stmt_counters run;
+    int64_t ns;
+
+    (void)context;
+    if ((type != SQLITE_TRACE_PROFILE) || explaining) {
+        return 0;
+    }
+    take_stmt_status(p, &run);
+    if ((ns = *(sqlite3_int64 *)x) < profile_min_ns) {
+        return 0;
+    }
+    if (profile_len == PROFILE_RING_SIZE) {
+        free_profile_record(&profile_ring[profile_start]);
+        profile_start = (profile_start + 1) % PROFILE_RING_SIZE;
+        profile_len--;
+        profile_dropped++;
+    }
+    rec = &profile_ring[(profile_start + profile_len++) % PROFILE_RING_SIZE];
+    rec->sql = sqlite3_expanded_sql(p);
+    rec->ns = ns;
+    rec->counters = run;
+    rec->need_plan = profile_explain;
+    return 0;
+}
+
+static char *explain_query_plan(const char *sql)
+{
+    sqlite3_stmt *eqp;
+    const char *detail;
+    char *eqp_sql;
+    char *plan;
+    char *new_plan;
+    size_t len, n;
+
+    if (!(eqp_sql = sqlite3_mprintf("explain query plan %s", sql))) {
+        return 0;
+    }
+    explaining = 1;
+    if (sqlite3_prepare_v2(database, eqp_sql, -1, &eqp, 0)) {
+        explaining = 0;
+        sqlite3_free(eqp_sql);
+        return 0;
+    }
+    plan = 0;
+    len = 0;
+    while (sqlite3_step(eqp) == SQLITE_ROW) {
+        if (!(detail = (const char *)sqlite3_column_text(eqp, 3))) {
+            continue;
+        }
+        n = strlen(detail);
+        if (!(new_plan = realloc(plan, len + n + 2))) {
+            break;
+        }
+        plan = new_plan;
+        if (len) {
+            plan[len++] = '\n';
+        }
+        memcpy(plan + len, detail, n + 1);
+        len += n;
+    }
+    sqlite3_finalize(eqp);
+    explaining = 0;
+    sqlite3_free(eqp_sql);
+    return plan;
+}
+
+// Plans are captured between commands instead of from inside the trace
+// callback, which runs in the middle of sqlite3_step() or
+// sqlite3_finalize().
+static void capture_plans(void)
+{
+    struct profile_record *rec;
+    size_t i;
+
+    for (i = 0; i < profile_len; i++) {
+        rec = &profile_ring[(profile_start + i) % PROFILE_RING_SIZE];
+        if (rec->need_plan) {
+            rec->need_plan = 0;
+            if (rec->sql) {
+                rec->plan = explain_query_plan(rec->sql);
+            }
+        }
+    }
+}
+
+static struct sexp *new_string_or_false(const char *str)
+{
+    return str ? sexp_new_string(str) : sexp_new_bool(0);
+}
+
+static struct sexp *cmd_profile_start(struct sexp *args)
+{
+    struct sexp *min_ns;
+    size_t len;
+
+    len = args_len(args);
+    if (len > 2) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    min_ns = args_ref(args, 0);
+    if ((len > 0) && !sexp_is_int64(min_ns)) {
+        return new_error("args", "minimum runtime is not an integer");
+    }
+    profile_min_ns = sexp_int64_value(min_ns);
+    profile_explain = sexp_is_true(args_ref(args, 1));
+    if (sqlite3_trace_v2(database, SQLITE_TRACE_PROFILE, trace_profile, 0)) {
+        return new_error("database", sqlite3_errmsg(database));
+    }
+    return new_ok();
+}
+
+static struct sexp *cmd_profile_stop(struct sexp *args)
+{
+    if (args_len(args)) {
+        return new_error("args", "wrong number of args");
+    }
+    if (database) {
+        sqlite3_trace_v2(database, 0, 0, 0);
+    }
+    return new_ok();
+}
+
+static struct sexp *new_stmt_counters(struct stmt_counters *counters);
+
+// (profile-drain) => (ok dropped ((sql ns plan counters) ...))
+static struct sexp *cmd_profile_drain(struct sexp *args)
+{
+    struct profile_record *rec;
+    struct sexp *records;
+    size_t i;
+
+    if (args_len(args)) {
+        return new_error("args", "wrong number of args");
+    }
+    records = sexp_new_null();
+    for (i = profile_len; i--;) {
+        rec = &profile_ring[(profile_start + i) % PROFILE_RING_SIZE];
+        records = sexp_new_pair(
+        sexp_new_pair(
+        new_string_or_false(rec->sql),
+        sexp_new_pair(sexp_new_int64(rec->ns),
+                      sexp_new_pair(
+                      new_string_or_false(rec->plan),
+                      sexp_new_pair(new_stmt_counters(&rec->counters),
+                                    sexp_new_null())))),
+        records);
+        free_profile_record(rec);
+    }
+    records = sexp_new_pair(
+    sexp_new_symbol("ok"),
+    sexp_new_pair(sexp_new_int64((int64_t)profile_dropped),
+                  sexp_new_pair(records, sexp_new_null())));
+    profile_start = profile_len = 0;
+    profile_dropped = 0;
+    return records;
+}
+
+static void clear_backup_error(void)
+{
+    if (backup_error != backup_out_of_memory) {
+        free(backup_error);
+    }
+    backup_error = 0;
+}
+
+// The error is copied before closing, since it may be a message owned by
+// backup_database.
+static void finish_backup(const char *error)
+{
+    clear_backup_error();
+    if (error) {
+        if ((backup_error = malloc(strlen(error) + 1))) {
+            strcpy(backup_error, error);
+        } else {
+            backup_error = backup_out_of_memory;
+        }
+    }
+    sqlite3_backup_finish(backup);
+    sqlite3_close(backup_database);
+    backup = 0;
+    backup_database = 0;
+}
+
+static void step_backup(void)
+{
+    int error;
+
+    error = sqlite3_backup_step(backup, backup_pages_per_step);
+    backup_pagecount = sqlite3_backup_pagecount(backup);
+    backup_remaining = sqlite3_backup_remaining(backup);
+    backup_busy = (error == SQLITE_BUSY) || (error == SQLITE_LOCKED);
+    if (error == SQLITE_DONE) {
+        finish_backup(0);
+    } else if (error && !backup_busy) {
+        finish_backup(sqlite3_errstr(error));
+    }
+}
+
+// Copies page batches until a command arrives or the backup is done.
+// The source stays usable between batches; changes made through this
+// connection are carried over into the backup, so the result is a
+// consistent snapshot.
+static void run_backup_while_idle(void)
+{
+    while (backup) {
+        if (input_pending(backup_busy ? BACKUP_BUSY_RETRY_MS : 0)) {
+            break;
+        }
+        step_backup();
+    }
+}
+
+// (backup dest-filename [pages-per-step])
+static struct sexp *cmd_backup(struct sexp *args)
+{
+    struct sexp *pages;
+    char *filename;
+    size_t len;
+
+    len = args_len(args);
+    if ((len != 1) && (len != 2)) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    if (backup) {
+        return new_error("state", "a backup is already running");
+    }
+    pages = args_ref(args, 1);
+    if ((len == 2) &&
+        (!sexp_is_int64(pages) || (sexp_int64_value(pages) <= 0) ||
+         (sexp_int64_value(pages) > INT32_MAX))) {
+        return new_error("args", "pages per step is not a positive count");
+    }
+    backup_pages_per_step = (len == 2) ? (int)sexp_int64_value(pages) : 64;
+    if (!(filename = sexp_strdup(args_ref(args, 0)))) {
+        return new_error("args", "cannot turn filename into C string");
+    }
+    if (sqlite3_open(filename, &backup_database)) {
+        free(filename);
+        finish_backup(sqlite3_errmsg(backup_database));
+        return new_error("database", backup_error);
+    }
+    free(filename);
+    if (!(backup = sqlite3_backup_init(backup_database, "main", database,
+                                       "main"))) {
+        finish_backup(sqlite3_errmsg(backup_database));
+        return new_error("database", backup_error);
+    }
+    clear_backup_error();
+    backup_pagecount = backup_remaining = -1;
+    backup_busy = 0;
+    return new_ok();
+}
+
+// (backup-status) => (ok running remaining pagecount) or (ok done) or
+// (error database message) if the last backup failed.
+static struct sexp *cmd_backup_status(struct sexp *args)
+{
+    if (args_len(args)) {
+        return new_error("args", "wrong number of args");
+    }
+    if (backup) {
+        return sexp_new_pair(
+        sexp_new_symbol("ok"),
+        sexp_new_pair(
+        sexp_new_symbol("running"),
+        sexp_new_pair(sexp_new_int64(backup_remaining),
+                      sexp_new_pair(sexp_new_int64(backup_pagecount),
+                                    sexp_new_null()))));
+    }
+    if (backup_error) {
+        return new_error("database", backup_error);
+    }
+    return sexp_new_pair(sexp_new_symbol("ok"),
+                         sexp_new_pair(sexp_new_symbol("done"),
+                                       sexp_new_null()));
+}
+
+static struct sexp *cmd_backup_cancel(struct sexp *args)
+{
+    if (args_len(args)) {
+        return new_error("args", "wrong number of args");
+    }
+    if (!backup) {
+        return new_error("state", "no backup is running");
+    }
+    finish_backup("backup was cancelled");
+    return new_ok();
+}
+
+// (set-timeout ms) applies to every later execute and read-row. Zero
+// means no timeout.
+static struct sexp *cmd_set_timeout(struct sexp *args)
+{
+    struct sexp *ms;
+
+    if (args_len(args) != 1) {
+        return new_error("args", "wrong number of args");
+    }
+    ms = args_ref(args, 0);
+    if (!sexp_is_int64(ms) || (sexp_int64_value(ms) < 0)) {
+        return new_error("args", "timeout is not a number of milliseconds");
+    }
+    step_timeout_ms = sexp_int64_value(ms);
+    return new_ok();
+}
+
+// (set-read-limits max-message max-object) bounds the memory used to
+// decode each later command; see sexp_binary_read_set_limits(). A command
+// over the limits is fatal, since the stream cannot be resynchronized.
+static struct sexp *cmd_set_read_limits(struct sexp *args)
+{
+    struct sexp *max_message;
+    struct sexp *max_object;
+
+    if (args_len(args) != 2) {
+        return new_error("args", "wrong number of args");
+    }
+    max_message = args_ref(args, 0);
+    max_object = args_ref(args, 1);
+    if (!sexp_is_int64(max_message) || (sexp_int64_value(max_message) < 0) ||
+        !sexp_is_int64(max_object) || (sexp_int64_value(max_object) < 0)) {
+        return new_error("args", "limits are not sizes");
+    }
+    sexp_binary_read_set_limits(rd, sexp_int64_value(max_message),
+                                sexp_int64_value(max_object));
+    return new_ok();
+}
+
+static struct sexp *new_uint64(uint64_t value)
+{
+    return sexp_new_int64((value > INT64_MAX) ? INT64_MAX : (int64_t)value);
+}
+
+static struct sexp *new_counter(const char *name, uint64_t value)
+{
+    return sexp_new_pair(sexp_new_symbol(name),
+                         sexp_new_pair(new_uint64(value), sexp_new_null()));
+}
+
+// ((fullscan-steps n) (sorts n) (autoindexes n) (vm-steps n))
+static struct sexp *new_stmt_counters(struct stmt_counters *counters)
+{
+    return sexp_new_pair(
+    new_counter("fullscan-steps", counters->fullscan_steps),
+    sexp_new_pair(
+    new_counter("sorts", counters->sorts),
+    sexp_new_pair(
+    new_counter("autoindexes", counters->autoindexes),
+    sexp_new_pair(new_counter("vm-steps", counters->vm_steps),
+                  sexp_new_null()))));
+}
+
+// (name count total-ns (bucket ...))
+static struct sexp *new_histogram(const char *name, struct histogram *h)
+{
+    struct sexp *buckets;
+    size_t i;
+
+    buckets = sexp_new_null();
+    for (i = HISTOGRAM_NBUCKET; i--;) {
+        buckets = sexp_new_pair(new_uint64(h->buckets[i]), buckets);
+    }
+    return sexp_new_pair(
+    sexp_new_symbol(name),
+    sexp_new_pair(new_uint64(h->count),
+                  sexp_new_pair(new_uint64(h->total_ns),
+                                sexp_new_pair(buckets, sexp_new_null()))));
+}
+
+static struct sexp *new_cmd_histograms(void);
+
+static struct sexp *cmd_stats(struct sexp *args)
+{
+    struct stmt_counters run;
+    struct sexp *response;
+    struct sexp *list;
+
+    if (args_len(args) > 1) {
+        return new_error("args", "wrong number of args");
+    }
+    if (stmt) {
+        take_stmt_status(stmt, &run);  // so far, for a statement still open
+    }
+    list = sexp_new_null();
+    list = sexp_new_pair(
+    new_counter("vm-steps", stmt_counters.vm_steps), list);
+    list = sexp_new_pair(
+    new_counter("autoindexes", stmt_counters.autoindexes), list);
+    list = sexp_new_pair(new_counter("sorts", stmt_counters.sorts), list);
+    list = sexp_new_pair(
+    new_counter("fullscan-steps", stmt_counters.fullscan_steps), list);
+    list = sexp_new_pair(
+    new_counter("statements", stmt_counters.statements), list);
+    list = sexp_new_pair(new_counter("allocations", sexp_alloc_count()),
+                         list);
+    list = sexp_new_pair(
+    new_counter("max-command-alloc", max_command_alloc_nbyte), list);
+    list = sexp_new_pair(
+    new_counter("bytes-out", sexp_binary_write_nbyte(wr)), list);
+    list = sexp_new_pair(new_counter("bytes-in", sexp_binary_read_nbyte(rd)),
+                         list);
+    list = sexp_new_pair(
+    sexp_new_pair(
+    sexp_new_symbol("phases"),
+    sexp_new_pair(
+    new_histogram("decode", &decode_histogram),
+    sexp_new_pair(
+    new_histogram("execute", &execute_histogram),
+    sexp_new_pair(new_histogram("step", &step_histogram),
+                  sexp_new_pair(new_histogram("encode", &encode_histogram),
+                                sexp_new_null()))))),
+    list);
+    list = sexp_new_pair(
+    sexp_new_pair(sexp_new_symbol("commands"), new_cmd_histograms()), list);
+    response = sexp_new_pair(sexp_new_symbol("ok"), list);
+    if (sexp_is_true(args_ref(args, 0))) {
+        memset(cmd_histograms, 0, sizeof(cmd_histograms));
+        memset(&decode_histogram, 0, sizeof(decode_histogram));
+        memset(&execute_histogram, 0, sizeof(execute_histogram));
+        memset(&step_histogram, 0, sizeof(step_histogram));
+        memset(&encode_histogram, 0, sizeof(encode_histogram));
+        memset(&stmt_counters, 0, sizeof(stmt_counters));
+        max_command_alloc_nbyte = 0;
+    }
+    return response;
+}
 
-static void die(const char *msg)
+// Bulk import
+
+enum import_type { IMPORT_TEXT, IMPORT_INTEGER, IMPORT_REAL, IMPORT_BLOB };
+
+// A delimited text file split into records and fields as in RFC 4180.
+// Fields point into the file unless they contain doubled quotes, in which
+// case they are unescaped into scratch.
+struct csv {
+    const char *pos;
+    const char *end;
+    char delim;
+    char *scratch;
+    size_t scratch_cap;
+};
+
+// Maps the whole file into memory read-only. Returns an error message.
+static const char *map_file(const char *filename, char **bytes,
+                            size_t *nbyte)
 {
-    if (msg) {
-        warn(msg);
+#ifndef _WIN32
+    struct stat st;
+    void *map;
+    int fd;
+
+    *bytes = 0;
+    *nbyte = 0;
+    if ((fd = open(filename, O_RDONLY)) == -1) {
+        return strerror(errno);
     }
-    exit(2);
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return strerror(errno);
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return strerror(errno);
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    *bytes = map;
+    *nbyte = (size_t)st.st_size;
+    return 0;
+#else
+    FILE *file;
+    char *buf;
+    size_t cap, n;
+
+    *bytes = 0;
+    *nbyte = 0;
+    if (!(file = fopen(filename, "rb"))) {
+        return strerror(errno);
+    }
+    cap = 0;
+    for (;;) {
+        if (*nbyte == cap) {
+            cap = cap ? cap * 2 : 65536;
+            if (!(buf = realloc(*bytes, cap))) {
+                fclose(file);
+                free(*bytes);
+                *bytes = 0;
+                return "out of memory";
+            }
+            *bytes = buf;
+        }
+        if (!(n = fread(*bytes + *nbyte, 1, cap - *nbyte, file))) {
+            break;
+        }
+        *nbyte += n;
+    }
+    if (ferror(file)) {
+        fclose(file);
+        free(*bytes);
+        *bytes = 0;
+        return "cannot read file";
+    }
+    fclose(file);
+    return 0;
+#endif
 }
 
-static struct sexp *new_ok(void)
+static void unmap_file(char *bytes, size_t nbyte)
 {
-    return sexp_new_pair(sexp_new_symbol("ok"), sexp_new_null());
+#ifndef _WIN32
+    if (bytes) {
+        munmap(bytes, nbyte);
+    }
+#else
+    (void)nbyte;
+    free(bytes);
+#endif
 }
 
-static struct sexp *new_error(const char *code, const char *message)
+// Reads the next field into *field and *nbyte. Sets *last if the field
+// ends its record. Returns false on a malformed quoted field.
+static int csv_field(struct csv *csv, const char **field, size_t *nbyte,
+                     int *quoted, int *last)
 {
-    return sexp_new_pair(
-    sexp_new_symbol("error"),
-    sexp_new_pair(sexp_new_symbol(code),
-                  sexp_new_pair(sexp_new_string(message), sexp_new_null())));
+    const char *p;
+    const char *q;
+    const char *start;
+    int escaped;
+
+    p = csv->pos;
+    *quoted = (p < csv->end) && (*p == '"');
+    if (*quoted) {
+        start = ++p;
+        escaped = 0;
+        for (;;) {
+            if (!(q = memchr(p, '"', csv->end - p))) {
+                return 0;
+            }
+            if ((q + 1 < csv->end) && (q[1] == '"')) {
+                escaped = 1;
+                p = q + 2;
+                continue;
+            }
+            break;
+        }
+        *nbyte = q - start;
+        *field = start;
+        p = q + 1;
+        if (escaped) {
+            char *out;
+
+            if (csv->scratch_cap < *nbyte) {
+                free(csv->scratch);
+                csv->scratch_cap = *nbyte;
+                if (!(csv->scratch = malloc(csv->scratch_cap))) {
+                    csv->scratch_cap = 0;
+                    return 0;
+                }
+            }
+            out = csv->scratch;
+            for (q = start; q < start + *nbyte; q++) {
+                *out++ = *q;
+                q += (*q == '"');
+            }
+            *field = csv->scratch;
+            *nbyte = out - csv->scratch;
+        }
+    } else {
+        start = p;
+        while ((p < csv->end) && (*p != csv->delim) && (*p != '\n')) {
+            p++;
+        }
+        *field = start;
+        *nbyte = p - start;
+        if ((p < csv->end) && (*p == '\n') && *nbyte &&
+            (start[*nbyte - 1] == '\r')) {
+            (*nbyte)--;
+        }
+    }
+    if ((p < csv->end) && (*p == '\r') && (p + 1 < csv->end) &&
+        (p[1] == '\n')) {
+        p++;
+    }
+    if (p == csv->end) {
+        *last = 1;
+    } else if (*p == '\n') {
+        *last = 1;
+        p++;
+    } else if (*p == csv->delim) {
+        *last = 0;
+        p++;
+    } else {
+        return 0;
+    }
+    csv->pos = p;
+    return 1;
 }
 
-static struct sexp *cmd_connect(struct sexp *args)
+// Skips blank lines. Returns false at end of file.
+static int csv_next_record(struct csv *csv)
 {
-    const char *dbname;
-    size_t len;
-    int error;
+    while (csv->pos < csv->end) {
+        if (*csv->pos == '\n') {
+            csv->pos++;
+        } else if ((*csv->pos == '\r') && (csv->pos + 1 < csv->end) &&
+                   (csv->pos[1] == '\n')) {
+            csv->pos += 2;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    dbname = 0;
-    len = sexp_list_len(args);
-    if (len % 2 != 0) {
-        return new_error("args", "odd number of args");
+static int parse_int64(const char *str, size_t len, int64_t *out)
+{
+    uint64_t limit, value;
+    size_t i;
+    int neg;
+
+    neg = (len > 0) && (str[0] == '-');
+    i = (len > 0) && ((str[0] == '-') || (str[0] == '+'));
+    if (i == len) {
+        return 0;
     }
-    for (; !sexp_is_null(args); args = sexp_list_tail(args, 2)) {
-        struct sexp *name = sexp_list_ref(args, 0);
-        struct sexp *value = sexp_list_ref(args, 1);
+    limit = neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    value = 0;
+    for (; i < len; i++) {
+        unsigned int digit = (unsigned char)str[i] - '0';
 
-        if (!sexp_is_symbol(name)) {
-            return new_error("args", "option name is not a symbol");
+        if ((digit > 9) || (value > (limit - digit) / 10)) {
+            return 0;
         }
-        if (!sexp_is_string(value)) {
-            return new_error("args", "option value is not a string");
+        value = value * 10 + digit;
+    }
+    *out = neg ? (int64_t)(0 - value) : (int64_t)value;
+    return 1;
+}
+
+static int parse_double(const char *str, size_t len, double *out)
+{
+    char buf[IMPORT_NUMBER_MAX];
+    char *end;
+
+    if (!len || (len >= sizeof(buf))) {
+        return 0;
+    }
+    memcpy(buf, str, len);
+    buf[len] = 0;
+    *out = strtod(buf, &end);
+    return end == buf + len;
+}
+
+// Binds one field. Numbers that do not parse are bound as text and left
+// to the column affinity, like the sqlite3 shell does. An empty unquoted
+// numeric field is null.
+static int bind_field(sqlite3_stmt *insert, int col, enum import_type type,
+                      const char *field, size_t nbyte, int quoted)
+{
+    sqlite3_destructor_type lifetime;
+    int64_t i;
+    double d;
+
+    lifetime = quoted ? SQLITE_TRANSIENT : SQLITE_STATIC;
+    switch (type) {
+    case IMPORT_INTEGER:
+        if (!nbyte && !quoted) {
+            return sqlite3_bind_null(insert, col);
         }
-        if (sexp_is_symbol_name(name, "dbname")) {
-            if (!(dbname = sexp_strdup(value))) {
-                return new_error("args", "cannot turn dbname into C string");
-            }
-        } else {
-            return new_error("args", "no such database option for sqlite");
+        if (parse_int64(field, nbyte, &i)) {
+            return sqlite3_bind_int64(insert, col, i);
+        }
+        break;
+    case IMPORT_REAL:
+        if (!nbyte && !quoted) {
+            return sqlite3_bind_null(insert, col);
         }
+        if (parse_double(field, nbyte, &d)) {
+            return sqlite3_bind_double(insert, col, d);
+        }
+        break;
+    case IMPORT_BLOB:
+        return sqlite3_bind_blob64(insert, col, field, nbyte, lifetime);
+    case IMPORT_TEXT:
+        break;
     }
-    if (!dbname) {
-        return new_error("args", "dbname option not given");
+    return sqlite3_bind_text64(insert, col, field, nbyte, lifetime,
+                               SQLITE_UTF8);
+}
+
+static int get_import_types(struct sexp *list, enum import_type **types,
+                            int *ntype)
+{
+    size_t max, type;
+    int i;
+
+    max = sqlite3_limit(database, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+    if (!sexp_is_list(list) || !sexp_list_len(list) ||
+        (sexp_list_len(list) > max)) {
+        return 0;
     }
-    if ((error = sqlite3_open(dbname, &database))) {
-        if (!database) {
-            return new_error("database", sqlite3_errstr(error));
+    *ntype = (int)sexp_list_len(list);
+    if (!(*types = calloc(*ntype, sizeof(**types)))) {
+        return 0;
+    }
+    for (i = 0; i < *ntype; i++, list = sexp_tail(list)) {
+        type = sexp_symbol_index_ref(&import_type_index, sexp_head(list));
+        if (!type) {
+            free(*types);
+            *types = 0;
+            return 0;
         }
-        warn(sqlite3_errmsg(database));
-        if ((error = sqlite3_close(database))) {
-            return new_error("database", sqlite3_errmsg(database));
+        (*types)[i] = (enum import_type)(type - 1);
+    }
+    return 1;
+}
+
+static char *new_insert_sql(const char *table, int ncol)
+{
+    char *sql;
+    char *params;
+    int i;
+
+    if (!(params = malloc(2 * ncol))) {
+        return 0;
+    }
+    for (i = 0; i < ncol; i++) {
+        params[2 * i] = '?';
+        params[2 * i + 1] = ',';
+    }
+    params[2 * ncol - 1] = 0;
+    sql = sqlite3_mprintf("insert into \"%w\" values (%s)", table, params);
+    free(params);
+    return sql;
+}
+
+// Inserts every record in the file with one prepared statement, inside one
+// savepoint so that a bad record leaves the table as it was.
+static const char *import_records(struct csv *csv, sqlite3_stmt *insert,
+                                  enum import_type *types, int ntype,
+                                  uint64_t *nrecord)
+{
+    static char message[128];
+    const char *field;
+    size_t nbyte;
+    int quoted, last;
+    int col;
+
+    while (csv_next_record(csv)) {
+        col = 0;
+        do {
+            if (!csv_field(csv, &field, &nbyte, &quoted, &last)) {
+                snprintf(message, sizeof(message),
+                         "record %llu is malformed",
+                         (unsigned long long)*nrecord + 1);
+                return message;
+            }
+            if (col == ntype) {
+                col++;
+                break;
+            }
+            if (bind_field(insert, col + 1, types[col], field, nbyte,
+                           quoted)) {
+                return sqlite3_errmsg(database);
+            }
+            col++;
+        } while (!last);
+        if (col != ntype) {
+            snprintf(message, sizeof(message),
+                     "record %llu does not have %d fields",
+                     (unsigned long long)*nrecord + 1, ntype);
+            return message;
         }
-        die(0);
+        if (sqlite3_step(insert) != SQLITE_DONE) {
+            return sqlite3_errmsg(database);
+        }
+        sqlite3_reset(insert);
+        (*nrecord)++;
     }
-    return new_ok();
+    return 0;
 }
 
-static struct sexp *cmd_disconnect(struct sexp *args)
+// (import filename table delimiter (type ...) [skip-header]) where each
+// type is one of text, integer, real or blob, reports
+// (ok (rows n) (elapsed-ns ns) (rows-per-second n)).
+static struct sexp *cmd_import(struct sexp *args)
 {
-    if (sexp_list_len(args)) {
+    struct sexp *delim;
+    struct sexp *list;
+    enum import_type *types;
+    sqlite3_stmt *insert;
+    struct csv csv;
+    const char *errmsg;
+    char *filename;
+    char *table;
+    char *sql;
+    char *bytes;
+    size_t nbyte;
+    uint64_t start, elapsed, nrecord;
+    int ntype;
+    size_t len;
+
+    len = args_len(args);
+    if ((len != 4) && (len != 5)) {
         return new_error("args", "wrong number of args");
     }
-    should_quit = 1;
-    return new_ok();
+    cancel_requested = 0;
+    if (!database) {
+        return new_error("state", "not connected to database");
+    }
+    delim = args_ref(args, 2);
+    if (!sexp_is_string(delim) || (sexp_nbyte(delim) != 1) ||
+        strchr("\"\r\n", *(char *)sexp_bytes(delim))) {
+        return new_error("args", "delimiter is not a one-byte string");
+    }
+    if (!get_import_types(args_ref(args, 3), &types, &ntype)) {
+        return new_error("args", "column types are not a list of types");
+    }
+    filename = sexp_strdup(args_ref(args, 0));
+    table = sexp_strdup(args_ref(args, 1));
+    sql = (filename && table) ? new_insert_sql(table, ntype) : 0;
+    free(table);
+    if (!sql) {
+        free(filename);
+        free(types);
+        return new_error("args", "cannot turn filename and table into C "
+                                 "strings");
+    }
+    drop_statement();
+    insert = 0;
+    if (sqlite3_prepare_v2(database, sql, -1, &insert, 0)) {
+        sqlite3_free(sql);
+        free(filename);
+        free(types);
+        return new_error("database", sqlite3_errmsg(database));
+    }
+    sqlite3_free(sql);
+    errmsg = map_file(filename, &bytes, &nbyte);
+    free(filename);
+    if (errmsg) {
+        sqlite3_finalize(insert);
+        free(types);
+        return new_error("file", errmsg);
+    }
+    memset(&csv, 0, sizeof(csv));
+    csv.pos = bytes;
+    csv.end = bytes + nbyte;
+    csv.delim = *(char *)sexp_bytes(delim);
+    list = sexp_new_null();
+    nrecord = 0;
+    start = now_ns();
+    if (sqlite3_exec(database, "savepoint import", 0, 0, 0)) {
+        errmsg = sqlite3_errmsg(database);
+    } else {
+        step_deadline_ns =
+        step_timeout_ms ? start + (uint64_t)step_timeout_ms * 1000000 : 0;
+        if (sexp_is_true(args_ref(args, 4)) && csv_next_record(&csv)) {
+            const char *field;
+            int quoted, last;
+
+            do {
+                last = 1;
+                if (!csv_field(&csv, &field, &nbyte, &quoted, &last)) {
+                    break;
+                }
+            } while (!last);
+        }
+        errmsg = import_records(&csv, insert, types, ntype, &nrecord);
+        step_deadline_ns = 0;
+        if (errmsg) {
+            switch (sqlite3_errcode(database)) {
+            case SQLITE_OK:
+                list = new_error("import", errmsg);
+                break;
+            case SQLITE_INTERRUPT:
+                list = new_error("interrupted", errmsg);
+                break;
+            default:
+                list = new_error("database", errmsg);
+                break;
+            }
+            sqlite3_exec(database, "rollback to import", 0, 0, 0);
+        }
+        if (sqlite3_exec(database, "release import", 0, 0, 0) && !errmsg) {
+            errmsg = sqlite3_errmsg(database);
+        }
+    }
+    elapsed = now_ns() - start;
+    if (errmsg && sexp_is_null(list)) {
+        list = new_error("database", errmsg);
+    }
+    count_stmt_status(insert);
+    sqlite3_finalize(insert);
+    unmap_file(bytes, csv.end - bytes);
+    free(csv.scratch);
+    free(types);
+    if (errmsg) {
+        return list;
+    }
+    list = sexp_new_pair(
+    new_counter("rows-per-second",
+                (uint64_t)(nrecord * 1e9 / (elapsed ? elapsed : 1))),
+    list);
+    list = sexp_new_pair(new_counter("elapsed-ns", elapsed), list);
+    list = sexp_new_pair(new_counter("rows", nrecord), list);
+    return sexp_new_pair(sexp_new_symbol("ok"), list);
 }
 
-// sqlite3_prepare()
-// sqlite3_step()
-// sqlite3_column()
-// sqlite3_finalize()
+// Export
 
-static struct sexp *step(void)
+static void *write_to_export(void *file_void, void *bytes, size_t nbyte)
 {
-    struct sexp *head;
-    struct sexp *tail;
-    struct sexp *colsexp;
-    sqlite3_value *value;
-    int error;
-    int i, n;
+    FILE *file = file_void;
 
-    error = sqlite3_step(stmt);
-    if (error == SQLITE_DONE) {
-        error = sqlite3_finalize(stmt);
-        stmt = 0;
-        if (error) {
-            return new_error("database", sqlite3_errmsg(database));
+    return (fwrite(bytes, 1, nbyte, file) == nbyte) ? 0 : "write error";
+}
+
+// The export file is flushed once at the end, not after every row.
+static void *flush_export(void *file)
+{
+    (void)file;
+    return 0;
+}
+
+// Quotes the field only if it contains a comma, a quote or a line break.
+static uint64_t write_csv_field(FILE *file, const char *bytes, size_t nbyte)
+{
+    const char *p;
+    const char *end;
+    const char *quote;
+    uint64_t n;
+
+    end = bytes + nbyte;
+    for (p = bytes; p < end; p++) {
+        if ((*p == ',') || (*p == '"') || (*p == '\r') || (*p == '\n')) {
+            break;
         }
-        return new_ok();
     }
-    if (error != SQLITE_ROW) {
-        return new_error("database", sqlite3_errmsg(database));
+    if (p == end) {
+        fwrite(bytes, 1, nbyte, file);
+        return nbyte;
     }
-    head = tail = sexp_new_pair(sexp_new_symbol("row"), sexp_new_null());
-    n = sqlite3_column_count(stmt);
-    for (i = 0; i < n; i++) {
-        value = sqlite3_column_value(stmt, i);
-        colsexp = sexp_new_null();
-        switch (sqlite3_value_type(value)) {
+    n = nbyte + 2;
+    putc('"', file);
+    for (p = bytes; (quote = memchr(p, '"', end - p)); p = quote + 1) {
+        fwrite(p, 1, quote + 1 - p, file);
+        putc('"', file);
+        n++;
+    }
+    fwrite(p, 1, end - p, file);
+    putc('"', file);
+    return n;
+}
+
+static uint64_t write_csv_row(FILE *file, sqlite3_stmt *query, int header)
+{
+    const char *name;
+    char buf[32];
+    uint64_t n;
+    int i, ncol;
+
+    n = 0;
+    ncol = sqlite3_column_count(query);
+    for (i = 0; i < ncol; i++) {
+        if (i) {
+            putc(',', file);
+            n++;
+        }
+        if (header) {
+            name = sqlite3_column_name(query, i);
+            n += write_csv_field(file, name, strlen(name));
+            continue;
+        }
+        switch (sqlite3_column_type(query, i)) {
         case SQLITE_INTEGER:
-            colsexp = sexp_new_int64(sqlite3_value_int64(value));
+            n += fprintf(file, "%lld",
+                         (long long)sqlite3_column_int64(query, i));
             break;
         case SQLITE_FLOAT:
-            // TODO: sqlite3_value_double()
-            // fallthrough
+            snprintf(buf, sizeof(buf), "%.17g",
+                     sqlite3_column_double(query, i));
+            n += write_csv_field(file, buf, strlen(buf));
+            break;
         case SQLITE_TEXT:
-            colsexp = sexp_new_string_bytes(sqlite3_value_text(value),
-                                            sqlite3_value_bytes(value));
+            n += write_csv_field(file,
+                                 (const char *)sqlite3_column_text(query, i),
+                                 sqlite3_column_bytes(query, i));
             break;
         case SQLITE_BLOB:
-            colsexp = sexp_new_bytevector_bytes(sqlite3_value_blob(value),
-                                                sqlite3_value_bytes(value));
-            break;
-        case SQLITE_NULL:
-            break;
-        default:
-            // TODO: error
+            n += write_csv_field(file, sqlite3_column_blob(query, i),
+                                 sqlite3_column_bytes(query, i));
             break;
         }
-        tail = sexp_set_tail(tail, sexp_new_pair(colsexp, sexp_new_null()));
     }
-    return sexp_new_pair(sexp_new_symbol("ok"), head);
+    putc('\n', file);
+    return n + 1;
 }
 
-static struct sexp *cmd_execute(struct sexp *args)
+static int write_binary_row(struct sexp_binary_write *export_wr,
+                            sqlite3_stmt *query)
 {
-    struct sexp *sql_sexp;
-    static char *sql;
-    const char *tail;
-    int error;
+    struct sexp *row;
+    struct sexp *tail;
+    int i, n, ok;
 
-    free(sql);
-    if (stmt) {
-        return new_error("state", "not finished executing another statement");
-    }
-    if (sexp_list_len(args) != 1) {
-        return new_error("args", "wrong number of args");
+    n = sqlite3_column_count(query);
+    if (vector_rows) {
+        row = sexp_new_vector(n);
+        for (i = 0; i < n; i++) {
+            sexp_vector_set(row, i,
+                            new_value(sqlite3_column_value(query, i)));
+        }
+        ok = sexp_binary_write(export_wr, row);
+        sexp_free(row);
+        return ok;
     }
-    sql_sexp = sexp_list_ref(args, 0);
-    if (!sexp_is_string(sql_sexp)) {
-        return new_error("args", "SQL query is not a string");
+    row = tail = sexp_new_pair(sexp_new_null(), sexp_new_null());
+    for (i = 0; i < n; i++) {
+        tail = sexp_set_tail(
+        tail, sexp_new_pair(new_value(sqlite3_column_value(query, i)),
+                            sexp_new_null()));
     }
-    if (!(sql = sexp_strdup(sql_sexp))) {
-        return new_error("args", "cannot turn SQL query into C string");
+    ok = sexp_binary_write(export_wr, sexp_tail(row));
+    sexp_free(row);
+    return ok;
+}
+
+// (export sql filename format) runs one query and writes its rows to a
+// file. Format binary writes each row as a list of column values in our
+// wire format, or as a vector with the vector row format; csv writes a
+// header of column names followed by the rows.
+// Reports (ok (rows n) (bytes n)).
+static struct sexp *cmd_export(struct sexp *args)
+{
+    struct sexp_binary_write *export_wr;
+    struct sexp *format;
+    struct sexp *response;
+    sqlite3_stmt *query;
+    const char *tail;
+    char *filename;
+    char *sql;
+    char *buf;
+    FILE *file;
+    uint64_t nrow, nbyte;
+    int csv, error;
+
+    if (args_len(args) != 3) {
+        return new_error("args", "wrong number of args");
     }
+    cancel_requested = 0;
     if (!database) {
         return new_error("state", "not connected to database");
     }
-    if ((error = sqlite3_prepare_v2(database, sql, -1, &stmt, &tail))) {
-        return new_error("database", sqlite3_errmsg(database));
+    format = args_ref(args, 2);
+    switch (sexp_symbol_index_ref(&format_index, format)) {
+    case FORMAT_BINARY:
+        csv = 0;
+        break;
+    case FORMAT_CSV:
+        csv = 1;
+        break;
+    default:
+        return new_error("args", "format is not binary or csv");
     }
-    if (*tail) {
+    if (!(sql = sexp_strdup(args_ref(args, 0)))) {
+        return new_error("args", "cannot turn SQL query into C string");
+    }
+    query = 0;
+    error = sqlite3_prepare_v2(database, sql, -1, &query, &tail);
+    if (!error && *tail) {
+        sqlite3_finalize(query);
+        free(sql);
         return new_error(
         "args", "cannot execute more than one SQL statement at once");
     }
-    return step();
-}
-
-static struct sexp *cmd_read_row(struct sexp *args)
-{
-    if (sexp_list_len(args)) {
-        return new_error("args", "wrong number of args");
+    free(sql);
+    if (error) {
+        return new_error("database", sqlite3_errmsg(database));
     }
-    if (!database) {
-        return new_error("state", "not connected to database");
+    if (!(filename = sexp_strdup(args_ref(args, 1)))) {
+        sqlite3_finalize(query);
+        return new_error("args", "cannot turn filename into C string");
     }
-    if (!stmt) {
-        return new_error("state", "not executing a statement");
+    if (!(file = fopen(filename, "wb"))) {
+        response = new_error("file", strerror(errno));
+        free(filename);
+        sqlite3_finalize(query);
+        return response;
     }
-    return step();
+    buf = malloc(EXPORT_BUFFER_SIZE);
+    if (buf) {
+        setvbuf(file, buf, _IOFBF, EXPORT_BUFFER_SIZE);
+    }
+    export_wr = 0;
+    nrow = nbyte = 0;
+    if (!csv &&
+        !(export_wr = sexp_binary_write_new(write_to_export, flush_export,
+                                            file))) {
+        response = new_error("memory", "out of memory");
+        goto done;
+    }
+    if (csv) {
+        nbyte += write_csv_row(file, query, 1);
+    }
+    step_deadline_ns =
+    step_timeout_ms ? now_ns() + (uint64_t)step_timeout_ms * 1000000 : 0;
+    response = 0;
+    while ((error = sqlite3_step(query)) == SQLITE_ROW) {
+        if (csv) {
+            nbyte += write_csv_row(file, query, 0);
+        } else if (!write_binary_row(export_wr, query)) {
+            response = new_error("file", "write error");
+            break;
+        }
+        nrow++;
+    }
+    step_deadline_ns = 0;
+    if (!response && (error != SQLITE_DONE)) {
+        response = new_error((error == SQLITE_INTERRUPT) ? "interrupted"
+                                                         : "database",
+                             sqlite3_errmsg(database));
+    }
+    if ((fflush(file) || ferror(file)) && !response) {
+        response = new_error("file", "write error");
+    }
+    if (export_wr) {
+        nbyte = sexp_binary_write_nbyte(export_wr);
+    }
+done:
+    if (fclose(file) && !response) {
+        response = new_error("file", "write error");
+    }
+    if (response) {
+        remove(filename);
+    } else {
+        response = sexp_new_pair(
+        sexp_new_symbol("ok"),
+        sexp_new_pair(new_counter("rows", nrow),
+                      sexp_new_pair(new_counter("bytes", nbyte),
+                                    sexp_new_null())));
+    }
+    if (export_wr) {
+        sexp_binary_write_free(export_wr);
+    }
+    free(buf);
+    free(filename);
+    count_stmt_status(query);
+    sqlite3_finalize(query);
+    return response;
 }
 
 typedef struct sexp *(*cmd_func_t)(struct sexp *args);
@@ -211,54 +2810,166 @@ static const struct cmd cmds[] = {
     { "disconnect", cmd_disconnect },
     { "execute", cmd_execute },
     { "read-row", cmd_read_row },
+    { "execute-script", cmd_execute_script },
+    { "blob-open", cmd_blob_open },
+    { "blob-reopen", cmd_blob_reopen },
+    { "blob-read", cmd_blob_read },
+    { "blob-write", cmd_blob_write },
+    { "blob-close", cmd_blob_close },
+    { "stats", cmd_stats },
+    { "profile-start", cmd_profile_start },
+    { "profile-stop", cmd_profile_stop },
+    { "profile-drain", cmd_profile_drain },
+    { "set-timeout", cmd_set_timeout },
+    { "set-read-limits", cmd_set_read_limits },
+    { "backup", cmd_backup },
+    { "backup-status", cmd_backup_status },
+    { "backup-cancel", cmd_backup_cancel },
+    { "import", cmd_import },
+    { "export", cmd_export },
     { 0 },
 };
 
-static const struct cmd *cmd_by_symbol(struct sexp *symbol)
+static struct sexp *new_cmd_histograms(void)
 {
-    const struct cmd *cmd;
+    struct sexp *list;
+    size_t i;
 
-    if (sexp_is_symbol(symbol)) {
-        for (cmd = cmds; cmd->name; cmd++) {
-            if (sexp_is_symbol_name(symbol, cmd->name)) {
-                return cmd;
-            }
+    list = sexp_new_null();
+    for (i = sizeof(cmds) / sizeof(cmds[0]) - 1; i--;) {
+        if (cmd_histograms[i].count) {
+            list = sexp_new_pair(
+            new_histogram(cmds[i].name, &cmd_histograms[i]), list);
         }
     }
-    return 0;
+    return list;
+}
+
+static void init_symbol_indexes(void)
+{
+    size_t i;
+
+    if (sizeof(cmds) / sizeof(cmds[0]) > MAX_CMDS) {
+        die("too many commands");
+    }
+    for (i = 0; cmds[i].name; i++) {
+        symbol_index_add(&cmd_index, cmds[i].name, i + 1);
+    }
+    symbol_index_add(&option_index, "dbname", OPTION_DBNAME);
+    symbol_index_add(&option_index, "blob-threshold", OPTION_BLOB_THRESHOLD);
+    symbol_index_add(&option_index, "result-cache", OPTION_RESULT_CACHE);
+    symbol_index_add(&option_index, "prefetch", OPTION_PREFETCH);
+    symbol_index_add(&option_index, "group-commit-ms",
+                     OPTION_GROUP_COMMIT_MS);
+    symbol_index_add(&option_index, "group-commit-count",
+                     OPTION_GROUP_COMMIT_COUNT);
+    symbol_index_add(&option_index, "row-format", OPTION_ROW_FORMAT);
+    symbol_index_add(&format_index, "list", FORMAT_LIST);
+    symbol_index_add(&format_index, "vector", FORMAT_VECTOR);
+    symbol_index_add(&format_index, "binary", FORMAT_BINARY);
+    symbol_index_add(&format_index, "csv", FORMAT_CSV);
+    symbol_index_add(&import_type_index, "text", IMPORT_TEXT + 1);
+    symbol_index_add(&import_type_index, "integer", IMPORT_INTEGER + 1);
+    symbol_index_add(&import_type_index, "real", IMPORT_REAL + 1);
+    symbol_index_add(&import_type_index, "blob", IMPORT_BLOB + 1);
+}
+
+static const struct cmd *cmd_by_symbol(struct sexp *symbol)
+{
+    size_t i;
+
+    i = sexp_symbol_index_ref(&cmd_index, symbol);
+    return i ? &cmds[i - 1] : 0;
 }
 
 int main(void)
 {
-    struct sexp_binary_read *rd;
-    struct sexp_binary_write *wr;
     struct sexp *command;
+    struct sexp *args;
     struct sexp *response;
     const struct cmd *cmd;
     const char *errstr;
+    uint64_t start, elapsed;
     int error;
 
     if ((errstr = sexp_binary_pipe(&rd, &wr))) {
         die(errstr);
     }
+    init_symbol_indexes();
+    install_cancel_signal();
     while (!should_quit) {
+        run_group_commit_while_idle();
+        run_prefetch_while_idle();
+        run_backup_while_idle();
+        wait_for_input();
+        start = now_ns();
         if (!sexp_binary_read(rd, &command)) {
             die(sexp_binary_read_error(rd));
         }
-        if (!sexp_is_list(command)) {
-            response = new_error("args", "command is not a list");
-        } else if (!(cmd = cmd_by_symbol(sexp_head(command)))) {
+        histogram_add(&decode_histogram, now_ns() - start);
+        if (sexp_binary_read_alloc_nbyte(rd) > max_command_alloc_nbyte) {
+            max_command_alloc_nbyte = sexp_binary_read_alloc_nbyte(rd);
+        }
+        cmd = 0;
+        args = 0;
+        if (sexp_is_list(command)) {
+            cmd = cmd_by_symbol(sexp_head(command));
+            args = sexp_tail(command);
+        } else if (sexp_is_vector(command) && sexp_vector_len(command)) {
+            cmd = cmd_by_symbol(sexp_vector_ref(command, 0));
+            args = command;
+        }
+        if (group_open && (!cmd || (cmd->func != cmd_execute))) {
+            end_group();
+        }
+        if (!sexp_is_list(command) && !args) {
+            response = new_error("args", "command is not a list or vector");
+        } else if (!cmd) {
             response = new_error("args", "no such command");
         } else {
-            response = cmd->func(sexp_tail(command));
+            step_ns = 0;
+            start = now_ns();
+            response = cmd->func(args);
+            elapsed = now_ns() - start;
+            histogram_add(&cmd_histograms[cmd - cmds], elapsed);
+            histogram_add(&execute_histogram, elapsed - step_ns);
+            if (step_ns) {
+                histogram_add(&step_histogram, step_ns);
+            }
+            capture_plans();
+        }
+        if (group_open && !response_held) {
+            end_group();
         }
-        if (!sexp_binary_write(wr, response)) {
+        start = now_ns();
+        if (response_held) {
+            response_held = 0;
+        } else if (raw_response) {
+            if (!sexp_binary_write_raw(wr, raw_response, raw_response_nbyte)) {
+                die(sexp_binary_write_error(wr));
+            }
+            raw_response = 0;
+        } else if (!sexp_binary_write(wr, response)) {
             die(sexp_binary_write_error(wr));
         }
+        free_cache_entry(cache_garbage);
+        cache_garbage = 0;
+        histogram_add(&encode_histogram, now_ns() - start);
         sexp_free(response);
         sexp_free(command);
     }
+    if (group_open) {
+        end_group();
+    }
+    if (backup) {
+        finish_backup(0);
+    }
     if (database) {
+        if (stmt) {
+            finalize_stmt();
+        }
+        close_all_blobs();
+        sqlite3_finalize(data_version_stmt);
         if ((error = sqlite3_close(database))) {
             die(sqlite3_errmsg(database));
         }
@@ -0,0 +1,52 @@
+// SPDX-FileCopyrightText: 2019 Lassi Kortela
+// SPDX-License-Identifier: ISC
+
+// Reads binary sexps from stdin and writes each one back to stdout, so
+// that test-conformance.py can check the C reader and writer against the
+// other implementations.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sexp.h>
+#include <sexp_binary_pipe.h>
+#include <sexp_binary_read.h>
+#include <sexp_binary_write.h>
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "echo-binary: %s\n", msg);
+    exit(2);
+}
+
+int main(void)
+{
+    struct sexp_binary_read *rd;
+    struct sexp_binary_write *wr;
+    struct sexp *sexp;
+    const char *errstr;
+    uint64_t start;
+
+    if ((errstr = sexp_binary_pipe(&rd, &wr))) {
+        die(errstr);
+    }
+    // Fuzzed input can claim any length, so keep memory bounded.
+    sexp_binary_read_set_limits(rd, (uint64_t)1 << 28, 0);
+    for (;;) {
+        start = sexp_binary_read_nbyte(rd) - sexp_binary_read_nbuffered(rd);
+        if (!sexp_binary_read(rd, &sexp)) {
+            if (sexp_binary_read_nbyte(rd) == start) {
+                break;  // EOF between sexps
+            }
+            die(sexp_binary_read_error(rd));
+        }
+        if (!sexp_binary_write(wr, sexp)) {
+            die(sexp_binary_write_error(wr));
+        }
+        sexp_free(sexp);
+    }
+    sexp_binary_write_free(wr);
+    sexp_binary_read_free(rd);
+    return 0;
+}
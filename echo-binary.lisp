@@ -0,0 +1,13 @@
+(load "binary.lisp")
+
+;; Reads binary sexps from standard input and writes each one back to
+;; standard output, for test-conformance.py. Run with sbcl --script.
+
+(let ((in (sb-sys:make-fd-stream 0 :input t :buffering :full
+                                   :element-type '(unsigned-byte 8)))
+      (out (sb-sys:make-fd-stream 1 :output t :buffering :full
+                                    :element-type '(unsigned-byte 8))))
+  (loop for x = (read-binary-sexp in)
+        until (eq x eof)
+        do (write-binary-sexp out x))
+  (finish-output out))
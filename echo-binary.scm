@@ -0,0 +1,14 @@
+(import (scheme base) (binary))
+
+;; Reads binary sexps from standard input and writes each one back to
+;; standard output, for test-conformance.py. The standard ports must
+;; accept binary I/O, as they do in Chibi-Scheme and Gauche.
+
+(let ((in (current-input-port))
+      (out (current-output-port)))
+  (let loop ()
+    (let ((x (read-binary-sexp in)))
+      (unless (eof-object? x)
+        (write-binary-sexp out x)
+        (loop))))
+  (flush-output-port out))
@@ -0,0 +1,163 @@
+// SPDX-FileCopyrightText: 2019 Lassi Kortela
+// SPDX-License-Identifier: ISC
+
+// libFuzzer target for sexp_binary_read(). Besides not crashing, whatever
+// the reader accepts must agree with the other C readers and survive a
+// round trip through the writer. Build with FUZZ=1 sh build.sh, then
+// seed it with test-conformance.py --corpus DIR and run it on DIR.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sexp.h"
+#include "sexp_binary_lazy.h"
+#include "sexp_binary_read.h"
+#include "sexp_binary_write.h"
+
+#define MAX_MESSAGE (1 << 20)
+
+struct input {
+    const unsigned char *bytes;
+    size_t nbyte;
+};
+
+struct output {
+    unsigned char *bytes;
+    size_t nbyte;
+    size_t size;
+};
+
+static void *read_input(void *port, void *bytes, size_t nbyte)
+{
+    struct input *in = port;
+
+    if (nbyte > in->nbyte) {
+        return "did not read enough data";
+    }
+    if (!nbyte) {
+        return 0;  // bytes may be null
+    }
+    memcpy(bytes, in->bytes, nbyte);
+    in->bytes += nbyte;
+    in->nbyte -= nbyte;
+    return 0;
+}
+
+static void *write_output(void *port, void *bytes, size_t nbyte)
+{
+    struct output *out = port;
+
+    if (!nbyte) {
+        return 0;
+    }
+    if (nbyte > out->size - out->nbyte) {
+        out->size = 2 * (out->nbyte + nbyte);
+        if (!(out->bytes = realloc(out->bytes, out->size))) {
+            return "out of memory";
+        }
+    }
+    memcpy(out->bytes + out->nbyte, bytes, nbyte);
+    out->nbyte += nbyte;
+    return 0;
+}
+
+static void *flush_output(void *port)
+{
+    (void)port;
+    return 0;
+}
+
+static void check(int ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "fuzz-binary-read: %s\n", what);
+        abort();
+    }
+}
+
+static struct sexp_binary_read *new_reader(struct input *in,
+                                           const void *bytes, size_t nbyte)
+{
+    struct sexp_binary_read *rd;
+
+    in->bytes = bytes;
+    in->nbyte = nbyte;
+    check(!!(rd = sexp_binary_read_new(read_input, in)), "out of memory");
+    sexp_binary_read_set_limits(rd, MAX_MESSAGE, 0);
+    return rd;
+}
+
+static void encode(struct sexp *sexp, struct output *out)
+{
+    struct sexp_binary_write *wr;
+
+    out->nbyte = 0;
+    wr = sexp_binary_write_new(write_output, flush_output, out);
+    check(wr && sexp_binary_write(wr, sexp), "cannot write what was read");
+    sexp_binary_write_free(wr);
+}
+
+// Reads bytes that must hold exactly one sexp and checks that it writes
+// out as want.
+static void reencode(const void *bytes, size_t nbyte,
+                     const struct output *want, struct output *out)
+{
+    struct sexp_binary_read *rd;
+    struct sexp *sexp;
+    struct input in;
+
+    rd = new_reader(&in, bytes, nbyte);
+    check(sexp_binary_read(rd, &sexp), "cannot read what was written");
+    check(!in.nbyte, "read back only part of what was written");
+    sexp_binary_read_free(rd);
+    encode(sexp, out);
+    sexp_free(sexp);
+    check((out->nbyte == want->nbyte) &&
+          !memcmp(out->bytes, want->bytes, want->nbyte),
+          "round trip changed the encoding");
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    struct sexp_binary_read *rd;
+    struct sexp *sexp;
+    struct sexp_lazy lz, next;
+    struct input in;
+    struct output first, second;
+    const void *raw;
+    size_t nraw;
+    uint64_t nbyte;
+
+    rd = new_reader(&in, data, size);
+    if (!sexp_binary_read(rd, &sexp)) {
+        sexp_binary_read_free(rd);
+        return 0;
+    }
+    nbyte = sexp_binary_read_nbyte(rd);
+    sexp_binary_read_free(rd);
+
+    // The lazy reader must find the same end.
+    sexp_lazy_init(&lz, data, size);
+    check(!sexp_lazy_skip(&lz, &next), "lazy skip failed");
+    check(next.start == data + nbyte, "lazy skip found another end");
+
+    memset(&first, 0, sizeof(first));
+    memset(&second, 0, sizeof(second));
+    encode(sexp, &first);
+    sexp_free(sexp);
+
+    // What the writer writes must read back and write the same again.
+    reencode(first.bytes, first.nbyte, &first, &second);
+
+    // Reading raw keeps the tags as they were (a negative zero stays
+    // negative), so its bytes need only decode to the same thing.
+    rd = new_reader(&in, data, size);
+    check(sexp_binary_read_raw(rd, &raw, &nraw), "raw read failed");
+    reencode(raw, nraw, &first, &second);
+    sexp_binary_read_free(rd);
+    free(first.bytes);
+    free(second.bytes);
+    return 0;
+}
@@ -3,26 +3,65 @@
 (cond-expand (chibi (import (chibi show) (chibi show pretty)))
              (else))
 
+;; Returns a form for end - start, simplified for the common cases of
+;; start being 0 and end being (+ start n).
+(define (difference end start)
+  (cond ((eqv? 0 start) end)
+        ((and (pair? end) (eqv? '+ (car end)) (= 3 (length end))
+              (equal? start (list-ref end 1)))
+         (list-ref end 2))
+        (else `(- ,end ,start))))
+
+;; Each substitution is either (name new-name reverse-args?) or
+;; (name procedure), where the procedure takes the arguments of a call
+;; and returns the R6RS form to replace it with.
 (define substitutions
-  '((arithmetic-shift bitwise-arithmetic-shift #f)
+  `((arithmetic-shift bitwise-arithmetic-shift #f)
+    (bytevector-copy
+     ,(lambda (b start end)
+        `(let ((new (make-bytevector ,(difference end start))))
+           (bytevector-copy! ,b ,start new 0 ,(difference end start))
+           new)))
+    (bytevector-copy!
+     ,(lambda (to at from start end)
+        `(bytevector-copy! ,from ,start ,to ,at ,(difference end start))))
     (read-bytevector get-bytevector-n #t)
+    (read-bytevector!
+     ,(lambda (b in start end)
+        `(get-bytevector-n! ,in ,b ,start ,(difference end start))))
+    (read-some ,(lambda (in max) `(get-bytevector-some ,in)))
     (read-u8 get-u8 #f)
-    (write-bytevector put-bytevector #t)
+    (write-bytevector
+     ,(lambda (b out . range)
+        (if (null? range)
+            `(put-bytevector ,out ,b)
+            `(put-bytevector ,out ,b ,(car range)
+                             ,(difference (cadr range) (car range))))))
     (write-u8 put-u8 #t)))
 
 (define (substitute form)
   (if (not (pair? form))
       form
       (let ((sub (assoc (car form) substitutions)))
-        (if (not sub)
-            (cons (substitute (car form))
-                  (substitute (cdr form)))
-            (let ((new-head (list-ref sub 1))
-                  (reverse? (list-ref sub 2)))
-              (cons new-head
-                    (map substitute (if reverse?
-                                        (reverse (cdr form))
-                                        (cdr form)))))))))
+        (cond ((not sub)
+               (cons (substitute (car form))
+                     (substitute (cdr form))))
+              ((procedure? (list-ref sub 1))
+               (apply (list-ref sub 1) (map substitute (cdr form))))
+              (else
+               (let ((new-head (list-ref sub 1))
+                     (reverse? (list-ref sub 2)))
+                 (cons new-head
+                       (map substitute (if reverse?
+                                           (reverse (cdr form))
+                                           (cdr form))))))))))
+
+;; Definitions of procedures that R6RS has built in, such as read-some,
+;; are dropped since every call to them is substituted.
+(define (substituted-definition? form)
+  (and (eqv? 'define (car form))
+       (pair? (cadr form))
+       (assoc (car (cadr form)) substitutions)))
 
 (define (pretty-print out form)
   (cond-expand
@@ -36,7 +75,8 @@
 
 (define (r7rs->r6rs filename)
   (substitute
-   (remove (lambda (form) (eqv? 'import (car form)))
+   (remove (lambda (form) (or (eqv? 'import (car form))
+                              (substituted-definition? form)))
            (call-with-input-file filename read-all))))
 
 (define (write-r6rs-file filename . forms)
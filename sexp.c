@@ -5,6 +5,8 @@
 #include <string.h>
 #include <stdint.h>
 
+#include "sexp.h"
+
 #define SEXP_NULL 0
 #define SEXP_FALSE 1
 #define SEXP_TRUE 2
@@ -13,10 +15,11 @@
 #define SEXP_VECTOR 4
 
 #define SEXP_INT64 5
+#define SEXP_FLOAT64 6
 
-#define SEXP_SYMBOL 6
-#define SEXP_STRING 7
-#define SEXP_BYTEVECTOR 8
+#define SEXP_SYMBOL 7
+#define SEXP_STRING 8
+#define SEXP_BYTEVECTOR 9
 
 #define SEXP_TYPE_BITS 4
 #define SEXP_TYPE_MASK 15
@@ -47,6 +50,46 @@ struct sexp_int64 {
     int64_t value;
 };
 
+struct sexp_float64 {
+    uintptr_t bits;
+    double value;
+};
+
+// Symbols carry this header in front of their struct sexp_bytes.
+// The symbol id is the symbol's 1-based position in intern order, or zero
+// for a symbol that was not interned.
+struct sexp_symbol_header {
+    size_t id;
+    size_t hash;
+};
+
+static struct sexp **symbols;  // by id - 1
+static size_t nsymbol;
+static size_t *symbol_slots;  // open-addressing hash table of symbol ids
+static size_t nsymbol_slot;  // power of two
+static size_t nsymbol_byte;  // allocated for interned symbols
+
+// Interned symbols are never freed, so a peer sending ever new names would
+// grow the table without bound. Past this many bytes, new names get
+// uninterned symbols instead, which sexp_free() frees.
+#define MAX_SYMBOL_NBYTE (4 << 20)
+#define SYMBOL_OVERHEAD \
+    (sizeof(struct sexp_symbol_header) + sizeof(struct sexp_bytes))
+
+static uint64_t alloc_count;
+static uint64_t alloc_nbyte;
+
+static void *sexp_calloc(size_t n, size_t size)
+{
+    alloc_count++;
+    alloc_nbyte += n * size;
+    return calloc(n, size);
+}
+
+uint64_t sexp_alloc_count(void) { return alloc_count; }
+
+uint64_t sexp_alloc_nbyte(void) { return alloc_nbyte; }
+
 static uintptr_t sexp_type(struct sexp *sexp)
 {
     return sexp ? (sexp->bits & SEXP_TYPE_MASK) : SEXP_NULL;
@@ -82,7 +125,7 @@ char *sexp_strdup(struct sexp *sexp)
     if (memchr(bytes, 0, len)) {
         return 0;  // null bytes cannot appear in a null-terminated string
     }
-    if (!(str = calloc(len + 1, 1))) {
+    if (!(str = sexp_calloc(len + 1, 1))) {
         return 0;
     }
     memcpy(str, bytes, len);
@@ -101,7 +144,7 @@ struct sexp *sexp_new_bool(int value)
 {
     struct sexp *sexp;
 
-    if (!(sexp = calloc(1, sizeof(*sexp)))) {
+    if (!(sexp = sexp_calloc(1, sizeof(*sexp)))) {
         return 0;
     }
     sexp->bits = value ? SEXP_TRUE : SEXP_FALSE;
@@ -114,7 +157,7 @@ struct sexp *sexp_new_pair(struct sexp *head, struct sexp *tail)
 {
     struct sexp_pair *pair;
 
-    if (!(pair = calloc(1, sizeof(*pair)))) {
+    if (!(pair = sexp_calloc(1, sizeof(*pair)))) {
         return 0;
     }
     pair->bits = SEXP_PAIR;
@@ -195,7 +238,7 @@ static void *sexp_new_bytes_zeros(size_t bits, size_t nbyte)
 {
     struct sexp_bytes *sb;
 
-    if (!(sb = calloc(1, nbyte + sizeof(*sb)))) {
+    if (!(sb = sexp_calloc(1, nbyte + sizeof(*sb)))) {
         return 0;
     }
     sb->bits = bits | (nbyte << SEXP_TYPE_BITS);
@@ -209,7 +252,9 @@ static void *sexp_new_bytes(size_t bits, const void *bytes, size_t nbyte)
     if (!(sb = sexp_new_bytes_zeros(bits, nbyte))) {
         return 0;
     }
-    memcpy(sb->bytes, bytes, nbyte);
+    if (nbyte) {
+        memcpy(sb->bytes, bytes, nbyte);  // bytes may be null if empty
+    }
     return sb;
 }
 
@@ -230,19 +275,156 @@ int sexp_is_symbol_name(struct sexp *sexp, const char *name)
     return !memcmp(name, sexp_bytes(sexp), len);
 }
 
-struct sexp *sexp_new_symbol(const char *str)
+static struct sexp_symbol_header *symbol_header(struct sexp *sexp)
+{
+    return (struct sexp_symbol_header *)sexp - 1;
+}
+
+size_t sexp_hash_bytes(const void *bytes, size_t nbyte)
+{
+    const unsigned char *p = bytes;
+    size_t hash = 2166136261u;  // FNV-1a
+
+    while (nbyte--) {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+    return hash;
+}
+
+static int grow_symbol_slots(void)
 {
-    return sexp_new_bytes(SEXP_SYMBOL, str, strlen(str));
+    size_t *slots;
+    size_t nslot, i, j;
+
+    nslot = nsymbol_slot ? 2 * nsymbol_slot : 64;
+    if (!(slots = calloc(nslot, sizeof(*slots)))) {
+        return 0;
+    }
+    for (i = 0; i < nsymbol; i++) {
+        j = symbol_header(symbols[i])->hash & (nslot - 1);
+        while (slots[j]) {
+            j = (j + 1) & (nslot - 1);
+        }
+        slots[j] = i + 1;
+    }
+    free(symbol_slots);
+    symbol_slots = slots;
+    nsymbol_slot = nslot;
+    return 1;
 }
 
-struct sexp *sexp_new_symbol_zeros(size_t nbyte)
+static struct sexp *new_symbol(const void *bytes, size_t nbyte, size_t hash)
+{
+    struct sexp_symbol_header *header;
+    struct sexp_bytes *sb;
+
+    if (!(header = sexp_calloc(1, sizeof(*header) + sizeof(*sb) + nbyte))) {
+        return 0;
+    }
+    sb = (struct sexp_bytes *)(header + 1);
+    sb->bits = SEXP_SYMBOL | (nbyte << SEXP_TYPE_BITS);
+    if (nbyte) {
+        memcpy(sb->bytes, bytes, nbyte);  // bytes may be null if empty
+    }
+    header->hash = hash;
+    return (struct sexp *)sb;
+}
+
+static struct sexp *intern_symbol(const void *bytes, size_t nbyte)
+{
+    struct sexp **new_symbols;
+    struct sexp *sym;
+    size_t hash, i, id;
+
+    hash = sexp_hash_bytes(bytes, nbyte);
+    if (nsymbol_slot) {
+        for (i = hash & (nsymbol_slot - 1); (id = symbol_slots[i]);
+             i = (i + 1) & (nsymbol_slot - 1)) {
+            sym = symbols[id - 1];
+            if ((symbol_header(sym)->hash == hash) &&
+                (sexp_nbyte(sym) == nbyte) &&
+                (!nbyte || !memcmp(sexp_bytes(sym), bytes, nbyte))) {
+                return sym;
+            }
+        }
+    }
+    if (nbyte + SYMBOL_OVERHEAD > MAX_SYMBOL_NBYTE - nsymbol_byte) {
+        return new_symbol(bytes, nbyte, hash);
+    }
+    if (2 * (nsymbol + 1) > nsymbol_slot) {
+        if (!grow_symbol_slots()) {
+            return 0;
+        }
+    }
+    if (!(new_symbols =
+          realloc(symbols, (nsymbol + 1) * sizeof(*new_symbols)))) {
+        return 0;
+    }
+    symbols = new_symbols;
+    if (!(sym = new_symbol(bytes, nbyte, hash))) {
+        return 0;
+    }
+    symbol_header(sym)->id = ++nsymbol;
+    nsymbol_byte += nbyte + SYMBOL_OVERHEAD;
+    symbols[nsymbol - 1] = sym;
+    for (i = hash & (nsymbol_slot - 1); symbol_slots[i];
+         i = (i + 1) & (nsymbol_slot - 1))
+        ;
+    symbol_slots[i] = nsymbol;
+    return sym;
+}
+
+// Symbols are interned: equal names give the same pointer, and the
+// symbol lives until the process exits. Once MAX_SYMBOL_NBYTE is reached,
+// new names give symbols with id zero that are freed like strings, so
+// compare those by name.
+struct sexp *sexp_new_symbol(const char *str)
 {
-    return sexp_new_bytes_zeros(SEXP_SYMBOL, nbyte);
+    return intern_symbol(str, strlen(str));
 }
 
 struct sexp *sexp_new_symbol_bytes(const void *bytes, size_t nbyte)
 {
-    return sexp_new_bytes(SEXP_SYMBOL, bytes, nbyte);
+    return intern_symbol(bytes, nbyte);
+}
+
+size_t sexp_symbol_id(struct sexp *sexp)
+{
+    return sexp_is_symbol(sexp) ? symbol_header(sexp)->id : 0;
+}
+
+// Maps the symbol named name to value, which must be nonzero. Returns
+// false if out of memory.
+int sexp_symbol_index_add(struct sexp_symbol_index *index, const char *name,
+                          size_t value)
+{
+    size_t *values;
+    size_t id;
+
+    if (!(id = sexp_symbol_id(sexp_new_symbol(name)))) {
+        return 0;
+    }
+    if (id >= index->len) {
+        if (!(values = realloc(index->values, (id + 1) * sizeof(*values)))) {
+            return 0;
+        }
+        memset(values + index->len, 0,
+               (id + 1 - index->len) * sizeof(*values));
+        index->values = values;
+        index->len = id + 1;
+    }
+    index->values[id] = value;
+    return 1;
+}
+
+// Returns the value mapped to symbol, or zero if there is none.
+size_t sexp_symbol_index_ref(const struct sexp_symbol_index *index,
+                             struct sexp *symbol)
+{
+    size_t id;
+
+    id = sexp_symbol_id(symbol);
+    return (id < index->len) ? index->values[id] : 0;
 }
 
 int sexp_is_string(struct sexp *sexp)
@@ -292,7 +474,7 @@ struct sexp *sexp_new_vector(size_t len)
     if (len == SIZE_MAX) {
         return 0;
     }
-    if (!(sexp = calloc(1 + len, sizeof(struct sexp *)))) {
+    if (!(sexp = sexp_calloc(1 + len, sizeof(struct sexp *)))) {
         return 0;
     }
     sexp->bits = SEXP_VECTOR | (len << SEXP_TYPE_BITS);
@@ -327,7 +509,7 @@ struct sexp *sexp_new_int64(int64_t value)
 {
     struct sexp_int64 *int64;
 
-    if (!(int64 = calloc(1, sizeof(*int64)))) {
+    if (!(int64 = sexp_calloc(1, sizeof(*int64)))) {
         return 0;
     }
     int64->bits = SEXP_INT64;
@@ -335,27 +517,60 @@ struct sexp *sexp_new_int64(int64_t value)
     return (struct sexp *)int64;
 }
 
-int sexp_int64_value(struct sexp *sexp)
+int64_t sexp_int64_value(struct sexp *sexp)
 {
     return sexp_is_int64(sexp) ? ((struct sexp_int64 *)sexp)->value : 0;
 }
 
-void sexp_free_only(struct sexp *sexp) { free(sexp); }
+int sexp_is_float64(struct sexp *sexp)
+{
+    return sexp_type(sexp) == SEXP_FLOAT64;
+}
+
+struct sexp *sexp_new_float64(double value)
+{
+    struct sexp_float64 *float64;
+
+    if (!(float64 = sexp_calloc(1, sizeof(*float64)))) {
+        return 0;
+    }
+    float64->bits = SEXP_FLOAT64;
+    float64->value = value;
+    return (struct sexp *)float64;
+}
+
+double sexp_float64_value(struct sexp *sexp)
+{
+    return sexp_is_float64(sexp) ? ((struct sexp_float64 *)sexp)->value : 0;
+}
+
+void sexp_free_only(struct sexp *sexp)
+{
+    if (!sexp_is_symbol(sexp)) {
+        free(sexp);
+    } else if (!symbol_header(sexp)->id) {
+        free(symbol_header(sexp));
+    }
+}
 
 // Does not detect shared structure!
 void sexp_free(struct sexp *sexp)
 {
+    struct sexp *tail;
     size_t n;
 
-    switch (sexp_type(sexp)) {
-    case SEXP_PAIR:
+    while (sexp_type(sexp) == SEXP_PAIR) {
+        tail = ((struct sexp_pair *)sexp)->tail;
         sexp_free(((struct sexp_pair *)sexp)->head);
-        sexp_free(((struct sexp_pair *)sexp)->tail);
-        break;
+        free(sexp);
+        sexp = tail;
+    }
+    switch (sexp_type(sexp)) {
     case SEXP_VECTOR:
         for (n = sexp_vector_len(sexp); n;) {
             sexp_free(((struct sexp_vector *)sexp)->elts[--n]);
         }
         break;
     }
+    sexp_free_only(sexp);
 }
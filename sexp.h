@@ -3,6 +3,13 @@
 
 struct sexp;
 
+// Maps symbol ids to small integers so that dispatching on a symbol is an
+// array lookup instead of a string comparison.
+struct sexp_symbol_index {
+    size_t *values;
+    size_t len;
+};
+
 size_t sexp_nbyte(struct sexp *sexp);
 void *sexp_bytes(struct sexp *sexp);
 char *sexp_strdup(struct sexp *sexp);
@@ -28,8 +35,13 @@ size_t sexp_list_len(struct sexp *sexp);
 int sexp_is_symbol(struct sexp *sexp);
 int sexp_is_symbol_name(struct sexp *sexp, const char *str);
 struct sexp *sexp_new_symbol(const char *str);
-struct sexp *sexp_new_symbol_zeros(size_t nbyte);
 struct sexp *sexp_new_symbol_bytes(const void *bytes, size_t nbyte);
+size_t sexp_symbol_id(struct sexp *sexp);
+int sexp_symbol_index_add(struct sexp_symbol_index *index, const char *name,
+                          size_t value);
+size_t sexp_symbol_index_ref(const struct sexp_symbol_index *index,
+                             struct sexp *symbol);
+size_t sexp_hash_bytes(const void *bytes, size_t nbyte);
 
 int sexp_is_string(struct sexp *sexp);
 struct sexp *sexp_new_string(const char *str);
@@ -48,7 +60,14 @@ int sexp_vector_set(struct sexp *sexp, size_t idx, struct sexp *elt);
 
 int sexp_is_int64(struct sexp *sexp);
 struct sexp *sexp_new_int64(int64_t value);
-int sexp_int64_value(struct sexp *sexp);
+int64_t sexp_int64_value(struct sexp *sexp);
+
+int sexp_is_float64(struct sexp *sexp);
+struct sexp *sexp_new_float64(double value);
+double sexp_float64_value(struct sexp *sexp);
+
+uint64_t sexp_alloc_count(void);
+uint64_t sexp_alloc_nbyte(void);
 
 void sexp_free_only(struct sexp *sexp);
 void sexp_free(struct sexp *sexp);
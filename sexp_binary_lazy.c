@@ -0,0 +1,326 @@
+// SPDX-FileCopyrightText: 2019 Lassi Kortela
+// SPDX-License-Identifier: ISC
+
+// Reads fields out of an encoded sexp in memory without decoding the rest
+// of it. Finding a field means skipping the ones before it, and skipping
+// a string or bytevector only reads its length, so large values that are
+// never asked for cost next to nothing. A message can be read from a
+// stream with sexp_binary_read_raw().
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sexp.h"
+#include "sexp_binary_lazy.h"
+#include "sexp_binary_read.h"
+
+#define SHORT "did not read enough data"
+
+void sexp_lazy_init(struct sexp_lazy *lz, const void *bytes, size_t nbyte)
+{
+    lz->start = bytes;
+    lz->limit = lz->start + nbyte;
+}
+
+static void *get_varint(const unsigned char **pos,
+                        const unsigned char *limit, uint64_t *out)
+{
+    const unsigned char *p;
+    uint64_t value;
+    unsigned int shift;
+
+    p = *pos;
+    value = shift = 0;
+    for (;;) {
+        if (p >= limit) {
+            return SHORT;
+        }
+        if ((shift == 63) && (*p > 1)) {
+            return "number too big to represent";
+        }
+        value |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+    *pos = p;
+    *out = value;
+    return 0;
+}
+
+// Reads the tag and, for the tags that have one, the length after it.
+static void *get_header(const struct sexp_lazy *lz, uint64_t want_tag,
+                        const unsigned char **pos, uint64_t *out_len)
+{
+    uint64_t tag;
+    void *error;
+
+    *pos = lz->start;
+    if ((error = get_varint(pos, lz->limit, &tag))) {
+        return error;
+    }
+    if (tag != want_tag) {
+        return "wrong type";
+    }
+    return out_len ? get_varint(pos, lz->limit, out_len) : 0;
+}
+
+void *sexp_lazy_tag(const struct sexp_lazy *lz, size_t *out)
+{
+    const unsigned char *p;
+    uint64_t tag;
+    void *error;
+
+    p = lz->start;
+    if ((error = get_varint(&p, lz->limit, &tag))) {
+        return error;
+    }
+    *out = (size_t)tag;
+    return 0;
+}
+
+// Finds the end of the sexp by counting the sexps still to be skipped
+// rather than by recursion, so deep nesting cannot exhaust the C stack.
+void *sexp_lazy_skip(const struct sexp_lazy *lz, struct sexp_lazy *out_next)
+{
+    const unsigned char *p;
+    uint64_t pending, tag, n;
+    void *error;
+
+    p = lz->start;
+    for (pending = 1; pending; pending--) {
+        if ((error = get_varint(&p, lz->limit, &tag))) {
+            return error;
+        }
+        switch (tag) {
+        case 0x0:
+        case 0x1:
+        case 0x2:
+            break;
+        case 0x3:
+        case 0xe:
+        case 0xf:
+            if ((error = get_varint(&p, lz->limit, &n))) {
+                return error;
+            }
+            if (n > (uint64_t)(lz->limit - p)) {
+                return SHORT;
+            }
+            p += n;
+            break;
+        case 0x4:
+        case 0x5:
+            if ((error = get_varint(&p, lz->limit, &n))) {
+                return error;
+            }
+            break;
+        case 0x6:
+            if (lz->limit - p < 8) {
+                return SHORT;
+            }
+            p += 8;
+            break;
+        case 0xc:
+            pending += 2;
+            break;
+        case 0xd:
+            // Every element takes at least a byte.
+            if ((error = get_varint(&p, lz->limit, &n))) {
+                return error;
+            }
+            if (n > (uint64_t)(lz->limit - p)) {
+                return SHORT;
+            }
+            pending += n;
+            break;
+        default:
+            return "unknown type tag";
+        }
+    }
+    out_next->start = p;
+    out_next->limit = lz->limit;
+    return 0;
+}
+
+void *sexp_lazy_pair(const struct sexp_lazy *lz, struct sexp_lazy *out_head,
+                     struct sexp_lazy *out_tail)
+{
+    struct sexp_lazy head;
+    void *error;
+
+    if ((error = get_header(lz, 0xc, &head.start, 0))) {
+        return error;
+    }
+    head.limit = lz->limit;
+    if ((error = sexp_lazy_skip(&head, out_tail))) {
+        return error;
+    }
+    *out_head = head;
+    return 0;
+}
+
+void *sexp_lazy_list_ref(const struct sexp_lazy *lz, size_t n,
+                         struct sexp_lazy *out)
+{
+    struct sexp_lazy head, tail;
+    size_t tag;
+    void *error;
+
+    tail = *lz;
+    do {
+        if ((error = sexp_lazy_pair(&tail, &head, &tail))) {
+            if (!sexp_lazy_tag(&tail, &tag) && !tag) {
+                return "index out of range";
+            }
+            return error;
+        }
+    } while (n--);
+    *out = head;
+    return 0;
+}
+
+void *sexp_lazy_vector_len(const struct sexp_lazy *lz, size_t *out)
+{
+    const unsigned char *p;
+    uint64_t len;
+    void *error;
+
+    if ((error = get_header(lz, 0xd, &p, &len))) {
+        return error;
+    }
+    if (len > SIZE_MAX) {
+        return "number too big to represent";
+    }
+    *out = (size_t)len;
+    return 0;
+}
+
+// Takes time in proportion to n. To visit every element, get the first
+// one and then sexp_lazy_skip() from each to the next.
+void *sexp_lazy_vector_ref(const struct sexp_lazy *lz, size_t n,
+                           struct sexp_lazy *out)
+{
+    struct sexp_lazy elt;
+    uint64_t len;
+    void *error;
+
+    if ((error = get_header(lz, 0xd, &elt.start, &len))) {
+        return error;
+    }
+    if (n >= len) {
+        return "index out of range";
+    }
+    elt.limit = lz->limit;
+    while (n--) {
+        if ((error = sexp_lazy_skip(&elt, &elt))) {
+            return error;
+        }
+    }
+    *out = elt;
+    return 0;
+}
+
+// Gives the bytes of a string, bytevector or symbol where they lie in the
+// buffer, without copying them.
+void *sexp_lazy_bytes(const struct sexp_lazy *lz, const void **out_bytes,
+                      size_t *out_nbyte)
+{
+    const unsigned char *p;
+    uint64_t tag, n;
+    void *error;
+
+    p = lz->start;
+    if ((error = get_varint(&p, lz->limit, &tag))) {
+        return error;
+    }
+    if ((tag != 0x3) && (tag != 0xe) && (tag != 0xf)) {
+        return "wrong type";
+    }
+    if ((error = get_varint(&p, lz->limit, &n))) {
+        return error;
+    }
+    if (n > (uint64_t)(lz->limit - p)) {
+        return SHORT;
+    }
+    *out_bytes = p;
+    *out_nbyte = (size_t)n;
+    return 0;
+}
+
+void *sexp_lazy_int64(const struct sexp_lazy *lz, int64_t *out)
+{
+    const unsigned char *p;
+    uint64_t tag, val;
+    void *error;
+
+    p = lz->start;
+    if ((error = get_varint(&p, lz->limit, &tag))) {
+        return error;
+    }
+    if ((tag != 0x4) && (tag != 0x5)) {
+        return "wrong type";
+    }
+    if ((error = get_varint(&p, lz->limit, &val))) {
+        return error;
+    }
+    if (val > (uint64_t)INT64_MAX + (tag == 0x5)) {
+        return "number bigger than expected";
+    }
+    if (tag == 0x4) {
+        *out = (int64_t)val;
+    } else {
+        *out = (val > INT64_MAX) ? INT64_MIN : -(int64_t)val;
+    }
+    return 0;
+}
+
+void *sexp_lazy_float64(const struct sexp_lazy *lz, double *out)
+{
+    const unsigned char *p;
+    uint64_t bits;
+    size_t i;
+    void *error;
+
+    if ((error = get_header(lz, 0x6, &p, 0))) {
+        return error;
+    }
+    if (lz->limit - p < 8) {
+        return SHORT;
+    }
+    bits = 0;
+    for (i = 8; i;) {
+        bits = (bits << 8) | p[--i];
+    }
+    memcpy(out, &bits, sizeof(*out));
+    return 0;
+}
+
+static void *read_lazy(void *port, void *bytes, size_t nbyte)
+{
+    struct sexp_lazy *lz = port;
+
+    if (nbyte > (size_t)(lz->limit - lz->start)) {
+        return SHORT;
+    }
+    memcpy(bytes, lz->start, nbyte);
+    lz->start += nbyte;
+    return 0;
+}
+
+// Decodes the sexp in full, for the parts that are wanted after all.
+void *sexp_lazy_decode(const struct sexp_lazy *lz, struct sexp **out)
+{
+    struct sexp_binary_read *rd;
+    struct sexp_lazy port;
+    void *error;
+
+    port = *lz;
+    if (!(rd = sexp_binary_read_new(read_lazy, &port))) {
+        return "out of memory";
+    }
+    error = sexp_binary_read(rd, out) ? 0 : sexp_binary_read_error(rd);
+    sexp_binary_read_free(rd);
+    return error;
+}
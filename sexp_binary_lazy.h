@@ -0,0 +1,27 @@
+// SPDX-FileCopyrightText: 2019 Lassi Kortela
+// SPDX-License-Identifier: ISC
+
+struct sexp;
+
+// An encoded sexp that has not been decoded. Nothing is copied: the view
+// points into a buffer that must outlive it.
+struct sexp_lazy {
+    const unsigned char *start;  // first byte of the encoded sexp
+    const unsigned char *limit;  // end of the buffer holding it
+};
+
+void sexp_lazy_init(struct sexp_lazy *lz, const void *bytes, size_t nbyte);
+void *sexp_lazy_tag(const struct sexp_lazy *lz, size_t *out);
+void *sexp_lazy_skip(const struct sexp_lazy *lz, struct sexp_lazy *out_next);
+void *sexp_lazy_pair(const struct sexp_lazy *lz, struct sexp_lazy *out_head,
+                     struct sexp_lazy *out_tail);
+void *sexp_lazy_list_ref(const struct sexp_lazy *lz, size_t n,
+                         struct sexp_lazy *out);
+void *sexp_lazy_vector_len(const struct sexp_lazy *lz, size_t *out);
+void *sexp_lazy_vector_ref(const struct sexp_lazy *lz, size_t n,
+                           struct sexp_lazy *out);
+void *sexp_lazy_bytes(const struct sexp_lazy *lz, const void **out_bytes,
+                      size_t *out_nbyte);
+void *sexp_lazy_int64(const struct sexp_lazy *lz, int64_t *out);
+void *sexp_lazy_float64(const struct sexp_lazy *lz, double *out);
+void *sexp_lazy_decode(const struct sexp_lazy *lz, struct sexp **out);
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
 
@@ -46,15 +48,44 @@ static void *binary_stdio(void)
 }
 #endif
 
-static void *read_from_file(void *file_void, void *bytes, size_t nbyte)
+#ifndef _WIN32
+static void *read_some_from_file(void *file_void, void *bytes, size_t nbyte,
+                                 size_t *out_nbyte)
 {
     FILE *file = file_void;
+    ssize_t n;
 
-    if (fread(bytes, 1, nbyte, file) == nbyte) {
-        return 0;
+    do {
+        n = read(fileno(file), bytes, nbyte);
+    } while ((n == -1) && (errno == EINTR));
+    if (n == -1) {
+        return "read error";
+    }
+    *out_nbyte = (size_t)n;
+    return 0;
+}
+#endif
+
+#ifdef _WIN32
+static void *read_some_from_file(void *file_void, void *bytes, size_t nbyte,
+                                 size_t *out_nbyte)
+{
+    FILE *file = file_void;
+    int n;
+
+    if (nbyte > INT_MAX) {
+        nbyte = INT_MAX;
     }
-    return ferror(file) ? "read error" : "did not read enough data";
+    do {
+        n = _read(_fileno(file), bytes, (unsigned int)nbyte);
+    } while ((n == -1) && (errno == EINTR));
+    if (n == -1) {
+        return "read error";
+    }
+    *out_nbyte = (size_t)n;
+    return 0;
 }
+#endif
 
 static void *write_to_file(void *file_void, void *bytes, size_t nbyte)
 {
@@ -80,7 +111,8 @@ void *sexp_binary_pipe(struct sexp_binary_read **out_rd,
     if ((error = binary_stdio())) {
         return error;
     }
-    if (!(*out_rd = sexp_binary_read_new(read_from_file, stdin))) {
+    if (!(*out_rd = sexp_binary_read_new_buffered(read_some_from_file,
+                                                   stdin))) {
         return "out of memory";
     }
     if (!(*out_wr =
@@ -11,10 +11,37 @@
 #include "sexp.h"
 #include "sexp_binary_read.h"
 
+#define READ_BUFFER_SIZE 65536
+
+// Each level of nested lists or vectors takes a C stack frame, so deeper
+// nesting is refused rather than allowed to overflow the stack.
+#define MAX_DEPTH SEXP_BINARY_MAX_DEPTH
+
+// A vector header can claim any length. Every element takes at least one
+// byte, so a vector longer than this and than the input buffered so far
+// is allocated only once all its elements have been read.
+#define VECTOR_PREALLOC_MAX 1024
+
 struct sexp_binary_read {
     void *(*read)(void *port, void *bytes, size_t nbyte);
+    void *(*read_some)(void *port, void *bytes, size_t nbyte,
+                       size_t *out_nbyte);
     void *port;
     void *error;
+    uint64_t nbyte;
+    char *scratch;
+    size_t nscratch;
+    unsigned char *buf;
+    size_t start;
+    size_t end;
+    uint64_t max_message;  // zero means no limit
+    uint64_t max_object;  // zero means no limit
+    uint64_t message_start;  // input offset where the message began
+    uint64_t alloc_start;  // sexp_alloc_nbyte() when the message began
+    uint64_t alloc_nbyte;  // allocated for the last message
+    size_t depth;  // lists and vectors being read, one inside the next
+    unsigned char *raw;  // encoding of the last message read raw
+    size_t nraw;
 };
 
 struct sexp_binary_read *
@@ -30,33 +57,231 @@ sexp_binary_read_new(void *(*read)(void *, void *, size_t), void *port)
     return rd;
 }
 
+// read_some() blocks until at least one byte is available, then returns
+// as many bytes as it can without blocking again. Zero bytes means EOF.
+struct sexp_binary_read *sexp_binary_read_new_buffered(
+void *(*read_some)(void *, void *, size_t, size_t *), void *port)
+{
+    struct sexp_binary_read *rd;
+
+    if (!(rd = calloc(1, sizeof(*rd)))) {
+        return 0;
+    }
+    if (!(rd->buf = malloc(READ_BUFFER_SIZE))) {
+        free(rd);
+        return 0;
+    }
+    rd->read_some = read_some;
+    rd->port = port;
+    return rd;
+}
+
 void *sexp_binary_read_error(struct sexp_binary_read *rd)
 {
     return rd->error;
 }
 
-void sexp_binary_read_free(struct sexp_binary_read *rd) { free(rd); }
+// Number of bytes that have been read ahead into the input buffer but not
+// yet decoded.
+size_t sexp_binary_read_nbuffered(struct sexp_binary_read *rd)
+{
+    return rd->end - rd->start;
+}
 
-static int read_rawsize(struct sexp_binary_read *rd, size_t *out,
-                        size_t minval, size_t maxval)
+uint64_t sexp_binary_read_nbyte(struct sexp_binary_read *rd)
+{
+    return rd->nbyte;
+}
+
+// Bytes allocated to decode the last message, or the failed part of it.
+uint64_t sexp_binary_read_alloc_nbyte(struct sexp_binary_read *rd)
+{
+    return rd->alloc_nbyte;
+}
+
+// max_message caps both the encoded size of one message and the memory
+// allocated to decode it. max_object caps the length of any one string,
+// bytevector, symbol or vector. Zero means no limit. Exceeding a limit is
+// an error like any other, after which the stream cannot be resumed.
+void sexp_binary_read_set_limits(struct sexp_binary_read *rd,
+                                 uint64_t max_message, uint64_t max_object)
+{
+    rd->max_message = max_message;
+    rd->max_object = max_object;
+}
+
+void sexp_binary_read_free(struct sexp_binary_read *rd)
+{
+    free(rd->buf);
+    free(rd->scratch);
+    free(rd->raw);
+    free(rd);
+}
+
+static void *read_some(struct sexp_binary_read *rd, void *bytes,
+                       size_t nbyte, size_t *out_nbyte)
+{
+    void *error;
+
+    if ((error = rd->read_some(rd->port, bytes, nbyte, out_nbyte))) {
+        return error;
+    }
+    rd->nbyte += *out_nbyte;
+    return *out_nbyte ? 0 : "did not read enough data";
+}
+
+static void *fill_buffer(struct sexp_binary_read *rd)
+{
+    size_t nbyte;
+    void *error;
+
+    memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+    rd->end -= rd->start;
+    rd->start = 0;
+    if ((error = read_some(rd, rd->buf + rd->end,
+                           READ_BUFFER_SIZE - rd->end, &nbyte))) {
+        return error;
+    }
+    rd->end += nbyte;
+    return 0;
+}
+
+static void *read_bytes(struct sexp_binary_read *rd, void *bytes,
+                        size_t nbyte)
+{
+    unsigned char *p = bytes;
+    size_t n;
+    void *error;
+
+    if (!rd->buf) {
+        rd->nbyte += nbyte;
+        return rd->read(rd->port, bytes, nbyte);
+    }
+    n = rd->end - rd->start;
+    if (n > nbyte) {
+        n = nbyte;
+    }
+    memcpy(p, rd->buf + rd->start, n);
+    rd->start += n;
+    p += n;
+    nbyte -= n;
+    while (nbyte >= READ_BUFFER_SIZE) {
+        if ((error = read_some(rd, p, nbyte, &n))) {
+            return error;
+        }
+        p += n;
+        nbyte -= n;
+    }
+    while (nbyte) {
+        if ((error = fill_buffer(rd))) {
+            return error;
+        }
+        n = rd->end - rd->start;
+        if (n > nbyte) {
+            n = nbyte;
+        }
+        memcpy(p, rd->buf + rd->start, n);
+        rd->start += n;
+        p += n;
+        nbyte -= n;
+    }
+    return 0;
+}
+
+static int read_rawuint64_slow(struct sexp_binary_read *rd, uint64_t *out)
 {
-    size_t value, shift;
+    uint64_t value;
+    unsigned int shift;
     unsigned char byte;
 
-    *out = value = shift = 0;
+    value = shift = 0;
     for (;;) {
-        if ((rd->error = rd->read(rd->port, &byte, 1))) {
+        if ((rd->error = read_bytes(rd, &byte, 1))) {
             return 0;
         }
-        value |= (byte & 0x7f) << shift;
+        if ((shift == 63) && (byte > 1)) {
+            rd->error = "number too big to represent";
+            return 0;
+        }
+        value |= (uint64_t)(byte & 0x7f) << shift;
         if (!(byte & 0x80)) {
             break;
         }
         shift += 7;
-        if (shift >= sizeof(size_t) * CHAR_BIT - 7) {
-            rd->error = "number too big to represent";
-            return 0;
-        }
+    }
+    *out = value;
+    return 1;
+}
+
+static uint64_t load_le64(const unsigned char *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+           ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32) |
+           ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) |
+           ((uint64_t)p[7] << 56);
+}
+
+static unsigned int count_trailing_zeros(uint64_t x)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    unsigned int n;
+
+    for (n = 0; !(x & 1); x >>= 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+// Decodes a varint of up to 8 bytes from a word-wide load without
+// branching per byte: the lowest clear high bit marks the last byte, and
+// the 7-bit groups are then packed together pairwise. Returns 0 if fewer
+// than 8 bytes are buffered or the varint is longer than 8 bytes.
+static int read_rawuint64_fast(struct sexp_binary_read *rd, uint64_t *out)
+{
+    uint64_t word, stops;
+
+    if (rd->end - rd->start < 8) {
+        return 0;
+    }
+    word = load_le64(rd->buf + rd->start);
+    if (!(stops = ~word & UINT64_C(0x8080808080808080))) {
+        return 0;
+    }
+    rd->start += (count_trailing_zeros(stops) + 1) / 8;
+    word &= (stops ^ (stops - 1)) & UINT64_C(0x7f7f7f7f7f7f7f7f);
+    word = (word & UINT64_C(0x007f007f007f007f)) |
+           ((word & UINT64_C(0x7f007f007f007f00)) >> 1);
+    word = (word & UINT64_C(0x00003fff00003fff)) |
+           ((word & UINT64_C(0x3fff00003fff0000)) >> 2);
+    word = (word & UINT64_C(0x000000000fffffff)) |
+           ((word & UINT64_C(0x0fffffff00000000)) >> 4);
+    *out = word;
+    return 1;
+}
+
+static int read_rawuint64(struct sexp_binary_read *rd, uint64_t *out)
+{
+    if (rd->buf && read_rawuint64_fast(rd, out)) {
+        return 1;
+    }
+    return read_rawuint64_slow(rd, out);
+}
+
+static int read_rawsize(struct sexp_binary_read *rd, size_t *out,
+                        size_t minval, size_t maxval)
+{
+    uint64_t value;
+
+    *out = 0;
+    if (!read_rawuint64(rd, &value)) {
+        return 0;
+    }
+    if (value > SIZE_MAX) {
+        rd->error = "number too big to represent";
+        return 0;
     }
     if (value < minval) {
         rd->error = "number smaller than expected";
@@ -66,22 +291,121 @@ static int read_rawsize(struct sexp_binary_read *rd, size_t *out,
         rd->error = "number bigger than expected";
         return 0;
     }
-    *out = value;
+    *out = (size_t)value;
+    return 1;
+}
+
+// Input bytes of the current message decoded so far.
+static uint64_t message_nbyte(struct sexp_binary_read *rd)
+{
+    return rd->nbyte - (rd->end - rd->start) - rd->message_start;
+}
+
+// Checks an object of n elements or bytes, which takes nbyte of memory,
+// against the limits before it is allocated. Every element takes at least
+// one byte of input, so n cannot exceed what is left of the message.
+static int check_object(struct sexp_binary_read *rd, size_t n,
+                        uint64_t nbyte)
+{
+    uint64_t used;
+
+    if (rd->max_object && (n > rd->max_object)) {
+        rd->error = "object too big";
+        return 0;
+    }
+    if (!rd->max_message) {
+        return 1;
+    }
+    used = sexp_alloc_nbyte() - rd->alloc_start;
+    if ((message_nbyte(rd) > rd->max_message) ||
+        (n > rd->max_message - message_nbyte(rd)) ||
+        (used > rd->max_message) || (nbyte > rd->max_message - used)) {
+        rd->error = "message too big";
+        return 0;
+    }
     return 1;
 }
 
+static int read_sexp(struct sexp_binary_read *rd, struct sexp **out);
+static int read_tagged(struct sexp_binary_read *rd, size_t tag,
+                       struct sexp **out);
+
+// The tails of a list are read in a loop, not by recursion, so that a
+// long list cannot exhaust the C stack.
 static struct sexp *read_pair(struct sexp_binary_read *rd)
 {
+    struct sexp *list;
+    struct sexp *last;
     struct sexp *head;
     struct sexp *tail;
+    struct sexp *pair;
+    size_t tag;
 
-    if (!sexp_binary_read(rd, &head))
-        return 0;
-    if (!sexp_binary_read(rd, &tail)) {
-        sexp_free(head);
-        return 0;
+    list = last = 0;
+    do {
+        if (!check_object(rd, 0, 0) || !read_sexp(rd, &head)) {
+            goto fail;
+        }
+        if (!(pair = sexp_new_pair(head, 0))) {
+            sexp_free(head);
+            rd->error = "out of memory";
+            goto fail;
+        }
+        if (last) {
+            sexp_set_tail(last, pair);
+        } else {
+            list = pair;
+        }
+        last = pair;
+        if (!read_rawsize(rd, &tag, 0, SIZE_MAX)) {
+            goto fail;
+        }
+    } while (tag == 0xc);
+    if (!read_tagged(rd, tag, &tail)) {
+        goto fail;
+    }
+    sexp_set_tail(last, tail);
+    return list;
+fail:
+    sexp_free(list);
+    return 0;
+}
+
+static struct sexp *read_long_vector(struct sexp_binary_read *rd, size_t n)
+{
+    struct sexp **elts;
+    struct sexp **new_elts;
+    struct sexp *vec;
+    size_t i, cap;
+
+    elts = 0;
+    cap = 0;
+    for (i = 0; i < n; i++) {
+        if (i == cap) {
+            cap = (n - cap < cap) ? n : (cap ? 2 * cap : VECTOR_PREALLOC_MAX);
+            if (!(new_elts = realloc(elts, cap * sizeof(*elts)))) {
+                rd->error = "out of memory";
+                break;
+            }
+            elts = new_elts;
+        }
+        if (!read_sexp(rd, &elts[i])) {
+            break;
+        }
+    }
+    vec = 0;
+    if ((i == n) && !(vec = sexp_new_vector(n))) {
+        rd->error = "out of memory";
+    }
+    while (i--) {
+        if (vec) {
+            sexp_vector_set(vec, i, elts[i]);
+        } else {
+            sexp_free(elts[i]);
+        }
     }
-    return sexp_new_pair(head, tail);
+    free(elts);
+    return vec;
 }
 
 static struct sexp *read_vector(struct sexp_binary_read *rd)
@@ -90,12 +414,19 @@ static struct sexp *read_vector(struct sexp_binary_read *rd)
     struct sexp *elt;
     size_t i, n;
 
-    if (!read_rawsize(rd, &n, 0, SIZE_MAX)) {
+    if (!read_rawsize(rd, &n, 0, SIZE_MAX / sizeof(struct sexp *) - 1) ||
+        !check_object(rd, n, (uint64_t)n * sizeof(struct sexp *))) {
+        return 0;
+    }
+    if ((n > VECTOR_PREALLOC_MAX) && (n > rd->end - rd->start)) {
+        return read_long_vector(rd, n);
+    }
+    if (!(vec = sexp_new_vector(n))) {
+        rd->error = "out of memory";
         return 0;
     }
-    vec = sexp_new_vector(n);
     for (i = 0; i < n; i++) {
-        if (!sexp_binary_read(rd, &elt)) {
+        if (!read_sexp(rd, &elt)) {
             sexp_free(vec);
             return 0;
         }
@@ -109,11 +440,15 @@ static struct sexp *read_bytevector(struct sexp_binary_read *rd)
     struct sexp *bv;
     size_t n;
 
-    if (!read_rawsize(rd, &n, 0, SIZE_MAX)) {
+    if (!read_rawsize(rd, &n, 0, SIZE_MAX) || !check_object(rd, n, n)) {
         return 0;
     }
-    bv = sexp_new_bytevector_zeros(n);
-    if ((rd->error = rd->read(rd->port, sexp_bytes(bv), n))) {
+    if (!(bv = sexp_new_bytevector_zeros(n))) {
+        rd->error = "out of memory";
+        return 0;
+    }
+    if ((rd->error = read_bytes(rd, sexp_bytes(bv), n))) {
+        sexp_free(bv);
         return 0;
     }
     return bv;
@@ -124,38 +459,69 @@ static struct sexp *read_string(struct sexp_binary_read *rd)
     struct sexp *bv;
     size_t n;
 
-    if (!read_rawsize(rd, &n, 0, SIZE_MAX)) {
+    if (!read_rawsize(rd, &n, 0, SIZE_MAX) || !check_object(rd, n, n)) {
         return 0;
     }
-    bv = sexp_new_string_zeros(n);
-    if ((rd->error = rd->read(rd->port, sexp_bytes(bv), n))) {
+    if (!(bv = sexp_new_string_zeros(n))) {
+        rd->error = "out of memory";
+        return 0;
+    }
+    if ((rd->error = read_bytes(rd, sexp_bytes(bv), n))) {
+        sexp_free(bv);
         return 0;
     }
     return bv;
 }
 
+// Symbol names are read into a scratch buffer and then interned, so a
+// name that has been seen before costs no allocation.
 static struct sexp *read_symbol(struct sexp_binary_read *rd)
 {
-    struct sexp *bv;
+    struct sexp *sym;
+    char *scratch;
     size_t n;
 
-    if (!read_rawsize(rd, &n, 0, SIZE_MAX)) {
+    if (!read_rawsize(rd, &n, 0, SIZE_MAX) || !check_object(rd, n, n)) {
         return 0;
     }
-    bv = sexp_new_symbol_zeros(n);
-    if ((rd->error = rd->read(rd->port, sexp_bytes(bv), n))) {
+    if (n > rd->nscratch) {
+        if (!(scratch = realloc(rd->scratch, n))) {
+            rd->error = "out of memory";
+            return 0;
+        }
+        rd->scratch = scratch;
+        rd->nscratch = n;
+    }
+    if ((rd->error = read_bytes(rd, rd->scratch, n))) {
         return 0;
     }
-    return bv;
+    if (!(sym = sexp_new_symbol_bytes(rd->scratch, n))) {
+        rd->error = "out of memory";
+    }
+    return sym;
 }
 
-int sexp_binary_read(struct sexp_binary_read *rd, struct sexp **out)
+static struct sexp *read_float64(struct sexp_binary_read *rd)
 {
-    size_t tag;
+    unsigned char bytes[8];
+    uint64_t bits;
+    double value;
+    size_t i;
 
-    if (!read_rawsize(rd, &tag, 0, SIZE_MAX)) {
+    if ((rd->error = read_bytes(rd, bytes, sizeof(bytes)))) {
         return 0;
     }
+    bits = 0;
+    for (i = sizeof(bytes); i;) {
+        bits = (bits << 8) | bytes[--i];
+    }
+    memcpy(&value, &bits, sizeof(value));
+    return sexp_new_float64(value);
+}
+
+static int read_tagged(struct sexp_binary_read *rd, size_t tag,
+                       struct sexp **out)
+{
     switch (tag) {
     case 0x0:
         *out = sexp_new_null();
@@ -170,23 +536,35 @@ int sexp_binary_read(struct sexp_binary_read *rd, struct sexp **out)
         *out = read_bytevector(rd);
         break;
     case 0x4: {
-        size_t val;
+        uint64_t val;
 
-        if (!read_rawsize(rd, &val, 0, SIZE_MAX)) {
+        if (!read_rawuint64(rd, &val)) {
+            return 0;
+        }
+        if (val > INT64_MAX) {
+            rd->error = "number bigger than expected";
             return 0;
         }
         *out = sexp_new_int64((int64_t)val);
         break;
     }
     case 0x5: {
-        size_t val;
+        uint64_t val;
 
-        if (!read_rawsize(rd, &val, 0, SIZE_MAX)) {
+        if (!read_rawuint64(rd, &val)) {
+            return 0;
+        }
+        if (val > (uint64_t)INT64_MAX + 1) {
+            rd->error = "number bigger than expected";
             return 0;
         }
-        *out = sexp_new_int64(-(int64_t)val);
+        *out = sexp_new_int64((val > INT64_MAX) ? INT64_MIN
+                                                : -(int64_t)val);
         break;
     }
+    case 0x6:
+        *out = read_float64(rd);
+        break;
     case 0xc:
         *out = read_pair(rd);
         break;
@@ -204,5 +582,175 @@ int sexp_binary_read(struct sexp_binary_read *rd, struct sexp **out)
         fprintf(stderr, "unknown type tag #x%02zx\n", tag);
         return 0;  // TODO
     }
+    if (!*out && !rd->error) {
+        rd->error = "out of memory";
+    }
     return !!*out;
 }
+
+static int read_sexp(struct sexp_binary_read *rd, struct sexp **out)
+{
+    size_t tag;
+    int ok;
+
+    if (!read_rawsize(rd, &tag, 0, SIZE_MAX)) {
+        return 0;
+    }
+    if (rd->depth == MAX_DEPTH) {
+        rd->error = "nested too deep";
+        return 0;
+    }
+    rd->depth++;
+    ok = read_tagged(rd, tag, out);
+    rd->depth--;
+    return ok;
+}
+
+int sexp_binary_read(struct sexp_binary_read *rd, struct sexp **out)
+{
+    int ok;
+
+    rd->message_start = rd->nbyte - (rd->end - rd->start);
+    rd->alloc_start = sexp_alloc_nbyte();
+    rd->depth = 0;
+    ok = read_sexp(rd, out);
+    rd->alloc_nbyte = sexp_alloc_nbyte() - rd->alloc_start;
+    return ok;
+}
+
+// Makes room for n more bytes after the first used bytes of the raw
+// message, which may not grow past max_message.
+static int raw_reserve(struct sexp_binary_read *rd, size_t used, uint64_t n)
+{
+    unsigned char *raw;
+    size_t size;
+
+    if (rd->max_message && (n > rd->max_message - used)) {
+        rd->error = "message too big";
+        return 0;
+    }
+    if (n <= rd->nraw - used) {
+        return 1;
+    }
+    if (n > SIZE_MAX / 2 - used) {
+        rd->error = "out of memory";
+        return 0;
+    }
+    size = (used + (size_t)n) * 2;
+    if (!(raw = realloc(rd->raw, size))) {
+        rd->error = "out of memory";
+        return 0;
+    }
+    rd->raw = raw;
+    rd->nraw = size;
+    return 1;
+}
+
+static int raw_varint(struct sexp_binary_read *rd, size_t *used,
+                      uint64_t *out)
+{
+    unsigned char bytes[10];
+    uint64_t value;
+    size_t n;
+
+    if (!read_rawuint64(rd, out)) {
+        return 0;
+    }
+    value = *out;
+    n = 0;
+    do {
+        bytes[n++] = (value & 0x7f) | ((value > 0x7f) ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+    if (!raw_reserve(rd, *used, n)) {
+        return 0;
+    }
+    memcpy(rd->raw + *used, bytes, n);
+    *used += n;
+    return 1;
+}
+
+static int raw_bytes(struct sexp_binary_read *rd, size_t *used,
+                     uint64_t nbyte)
+{
+    if (!raw_reserve(rd, *used, nbyte)) {
+        return 0;
+    }
+    if ((rd->error = read_bytes(rd, rd->raw + *used, (size_t)nbyte))) {
+        return 0;
+    }
+    *used += (size_t)nbyte;
+    return 1;
+}
+
+// Reads the encoding of the next message without decoding it, for use
+// with sexp_lazy_init(). The bytes belong to rd and stay valid until the
+// next read. The message is walked by counting the sexps still to come,
+// so nesting does not use the C stack.
+int sexp_binary_read_raw(struct sexp_binary_read *rd, const void **out_bytes,
+                         size_t *out_nbyte)
+{
+    uint64_t pending, tag, n;
+    size_t used;
+
+    used = 0;
+    for (pending = 1; pending; pending--) {
+        if (!raw_varint(rd, &used, &tag)) {
+            return 0;
+        }
+        switch (tag) {
+        case 0x0:
+        case 0x1:
+        case 0x2:
+            break;
+        case 0x3:
+        case 0xe:
+        case 0xf:
+            if (!raw_varint(rd, &used, &n)) {
+                return 0;
+            }
+            if (rd->max_object && (n > rd->max_object)) {
+                rd->error = "object too big";
+                return 0;
+            }
+            if (!raw_bytes(rd, &used, n)) {
+                return 0;
+            }
+            break;
+        case 0x4:
+        case 0x5:
+            if (!raw_varint(rd, &used, &n)) {
+                return 0;
+            }
+            break;
+        case 0x6:
+            if (!raw_bytes(rd, &used, 8)) {
+                return 0;
+            }
+            break;
+        case 0xc:
+            pending += 2;
+            break;
+        case 0xd:
+            if (!raw_varint(rd, &used, &n)) {
+                return 0;
+            }
+            if (rd->max_object && (n > rd->max_object)) {
+                rd->error = "object too big";
+                return 0;
+            }
+            if (n > UINT64_MAX - pending) {
+                rd->error = "number too big to represent";
+                return 0;
+            }
+            pending += n;
+            break;
+        default:
+            rd->error = "unknown type tag";
+            return 0;
+        }
+    }
+    *out_bytes = rd->raw;
+    *out_nbyte = used;
+    return 1;
+}
@@ -1,10 +1,23 @@
 // SPDX-FileCopyrightText: 2019 Lassi Kortela
 // SPDX-License-Identifier: ISC
 
+// Sexps nest at most this many levels deep. binary_accel.c and binary.py
+// use the same limit, so every reader refuses the same input.
+#define SEXP_BINARY_MAX_DEPTH 400
+
 struct sexp_binary_read;
 
 struct sexp_binary_read *
 sexp_binary_read_new(void *(*read)(void *, void *, size_t), void *port);
+struct sexp_binary_read *sexp_binary_read_new_buffered(
+void *(*read_some)(void *, void *, size_t, size_t *), void *port);
 void *sexp_binary_read_error(struct sexp_binary_read *rd);
+size_t sexp_binary_read_nbuffered(struct sexp_binary_read *rd);
+uint64_t sexp_binary_read_nbyte(struct sexp_binary_read *rd);
+uint64_t sexp_binary_read_alloc_nbyte(struct sexp_binary_read *rd);
+void sexp_binary_read_set_limits(struct sexp_binary_read *rd,
+                                 uint64_t max_message, uint64_t max_object);
 void sexp_binary_read_free(struct sexp_binary_read *rd);
 int sexp_binary_read(struct sexp_binary_read *rd, struct sexp **out);
+int sexp_binary_read_raw(struct sexp_binary_read *rd, const void **out_bytes,
+                         size_t *out_nbyte);
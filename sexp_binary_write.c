@@ -8,11 +8,23 @@
 #include "sexp.h"
 #include "sexp_binary_write.h"
 
+#define WRITE_BUFFER_SIZE 65536
+
 struct sexp_binary_write {
     void *(*write)(void *port, void *bytes, size_t nbyte);
     void *(*flush)(void *port);
     void *port;
     void *error;
+    uint64_t nbyte;
+    unsigned char *buf;
+    size_t fill;
+};
+
+// Number of varint bytes needed for a value of the given bit length.
+static const unsigned char varint_nbyte[65] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3,
+    4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7,
+    7, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 10,
 };
 
 int write_nested(struct sexp_binary_write *wr, struct sexp *sexp);
@@ -26,6 +38,10 @@ sexp_binary_write_new(void *(*write)(void *, void *, size_t),
     if (!(wr = calloc(1, sizeof(*wr)))) {
         return 0;
     }
+    if (!(wr->buf = malloc(WRITE_BUFFER_SIZE))) {
+        free(wr);
+        return 0;
+    }
     wr->write = write;
     wr->flush = flush;
     wr->port = port;
@@ -37,21 +53,79 @@ void *sexp_binary_write_error(struct sexp_binary_write *wr)
     return wr->error;
 }
 
-void sexp_binary_write_free(struct sexp_binary_write *wr) { free(wr); }
+uint64_t sexp_binary_write_nbyte(struct sexp_binary_write *wr)
+{
+    return wr->nbyte;
+}
+
+void sexp_binary_write_free(struct sexp_binary_write *wr)
+{
+    free(wr->buf);
+    free(wr);
+}
+
+static int write_buffer(struct sexp_binary_write *wr)
+{
+    if (wr->fill) {
+        wr->error = wr->write(wr->port, wr->buf, wr->fill);
+        wr->nbyte += wr->fill;
+        wr->fill = 0;
+    }
+    return !wr->error;
+}
+
+static int write_bytes(struct sexp_binary_write *wr, const void *bytes,
+                       size_t nbyte)
+{
+    if (nbyte > WRITE_BUFFER_SIZE - wr->fill) {
+        if (!write_buffer(wr)) {
+            return 0;
+        }
+        if (nbyte >= WRITE_BUFFER_SIZE) {
+            wr->error = wr->write(wr->port, (void *)bytes, nbyte);
+            wr->nbyte += nbyte;
+            return !wr->error;
+        }
+    }
+    memcpy(wr->buf + wr->fill, bytes, nbyte);
+    wr->fill += nbyte;
+    return 1;
+}
+
+static unsigned int bit_length(uint64_t value)
+{
+#ifdef __GNUC__
+    return value ? 64 - __builtin_clzll(value) : 0;
+#else
+    unsigned int n;
+
+    for (n = 0; value; value >>= 1) {
+        n++;
+    }
+    return n;
+#endif
+}
 
+// Least significant group first, matching read_rawsize().
 static int write_rawuint64(struct sexp_binary_write *wr, uint64_t value)
 {
-    unsigned char buffer[10];
-    unsigned char *const limit = buffer + sizeof(buffer);
-    unsigned char *bytes = limit;
+    unsigned char *bytes;
+    size_t i, n;
 
-    while (value > 0x7f) {
-        *--bytes = 0x80 | (value & 0x7f);
+    if (WRITE_BUFFER_SIZE - wr->fill < 10) {
+        if (!write_buffer(wr)) {
+            return 0;
+        }
+    }
+    bytes = wr->buf + wr->fill;
+    n = varint_nbyte[bit_length(value)];
+    for (i = 0; i < n - 1; i++) {
+        bytes[i] = 0x80 | (value & 0x7f);
         value >>= 7;
     }
-    *--bytes = value;
-    wr->error = wr->write(wr->port, bytes, limit - bytes);
-    return !wr->error;
+    bytes[i] = value;
+    wr->fill += n;
+    return 1;
 }
 
 static int write_rawsize(struct sexp_binary_write *wr, size_t value)
@@ -71,8 +145,7 @@ static int write_tagged_bytes(struct sexp_binary_write *wr, size_t tag,
     if (!write_rawsize(wr, n)) {
         return 0;
     }
-    wr->error = wr->write(wr->port, sexp_bytes(sb), n);
-    return !wr->error;
+    return write_bytes(wr, sexp_bytes(sb), n);
 }
 
 static int write_tagged_vector(struct sexp_binary_write *wr, size_t tag,
@@ -104,6 +177,25 @@ static int write_tagged_uint64(struct sexp_binary_write *wr, size_t tag,
     return write_rawuint64(wr, value);
 }
 
+// IEEE 754 double, least significant byte first like the varints.
+static int write_tagged_float64(struct sexp_binary_write *wr, size_t tag,
+                                double value)
+{
+    unsigned char bytes[8];
+    uint64_t bits;
+    size_t i;
+
+    if (!write_rawsize(wr, tag)) {
+        return 0;
+    }
+    memcpy(&bits, &value, sizeof(bits));
+    for (i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = bits & 0xff;
+        bits >>= 8;
+    }
+    return write_bytes(wr, bytes, sizeof(bytes));
+}
+
 int write_nested(struct sexp_binary_write *wr, struct sexp *sexp)
 {
     if (sexp_is_null(sexp)) {
@@ -123,9 +215,12 @@ int write_nested(struct sexp_binary_write *wr, struct sexp *sexp)
         if (value >= 0) {
             return write_tagged_uint64(wr, 4, value);
         } else {
-            return write_tagged_uint64(wr, 5, -value);
+            return write_tagged_uint64(wr, 5, -(uint64_t)value);
         }
     }
+    if (sexp_is_float64(sexp)) {
+        return write_tagged_float64(wr, 6, sexp_float64_value(sexp));
+    }
     if (sexp_is_pair(sexp)) {
         if (!write_rawsize(wr, 0xc))
             return 0;
@@ -148,9 +243,26 @@ int write_nested(struct sexp_binary_write *wr, struct sexp *sexp)
     return 0;
 }
 
+// Writes bytes that already hold one encoded object, e.g. a cached
+// response, and flushes them.
+int sexp_binary_write_raw(struct sexp_binary_write *wr, const void *bytes,
+                          size_t nbyte)
+{
+    if (!write_bytes(wr, bytes, nbyte) || !write_buffer(wr)) {
+        wr->fill = 0;
+        return 0;
+    }
+    wr->error = wr->flush(wr->port);
+    return !wr->error;
+}
+
 int sexp_binary_write(struct sexp_binary_write *wr, struct sexp *sexp)
 {
     if (!write_nested(wr, sexp)) {
+        wr->fill = 0;
+        return 0;
+    }
+    if (!write_buffer(wr)) {
         return 0;
     }
     wr->error = wr->flush(wr->port);
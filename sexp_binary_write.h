@@ -7,5 +7,8 @@ struct sexp_binary_write *
 sexp_binary_write_new(void *(*write)(void *, void *, size_t),
                       void *(*flush)(void *), void *port);
 void *sexp_binary_write_error(struct sexp_binary_write *wr);
+uint64_t sexp_binary_write_nbyte(struct sexp_binary_write *wr);
 void sexp_binary_write_free(struct sexp_binary_write *wr);
 int sexp_binary_write(struct sexp_binary_write *wr, struct sexp *sexp);
+int sexp_binary_write_raw(struct sexp_binary_write *wr, const void *bytes,
+                          size_t nbyte);
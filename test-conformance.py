@@ -0,0 +1,443 @@
+#! /usr/bin/env python3
+
+"""Checks that the implementations of the binary sexp format agree.
+
+Random sexps are encoded by binary.py and piped through an echo program
+for each other implementation, which must decode them and write back
+exactly the same bytes. binary.py decodes them too, with and without
+_binary_accel and lazily; each way must stop at the same nesting depth
+and read a large sexp arriving over a pipe in small pieces without
+slowing down. Then mutated encodings are fed to all of them to look for
+crashes and for decoders that accept the same bytes but disagree on
+what they mean. Last, encode and decode throughput is
+measured for each implementation.
+
+    python3 test-conformance.py
+    python3 test-conformance.py \\
+        --impl chibi='chibi-scheme -I . echo-binary.scm' \\
+        --impl chez='scheme --libdirs . --program echo-binary.sps' \\
+        --impl sbcl='sbcl --script echo-binary.lisp'
+
+./echo-binary, built by build.sh, is always checked. Integers stay in
+the 64-bit range of the C sexps, and floats are finite since Common Lisp
+has no infinities or NaNs.
+
+--record FILE saves the throughput figures and --gate FILE fails if any
+has fallen more than --tolerance below them. --corpus DIR writes the
+generated encodings as a seed corpus for fuzz-binary-read.
+"""
+
+import argparse
+import json
+import math
+import os
+import random
+import shlex
+import struct
+import subprocess
+import sys
+import threading
+import time
+from io import BytesIO
+
+import binary
+from binary import (Eof, LazyList, LazyVector, Reader, Sym,
+                    encode_binary_sexp)
+
+_accel = binary._binary_accel
+_ints = (0, 1, 127, 128, 16383, 16384, 2**32, 2**63 - 1,
+         -1, -127, -128, -2**32, -2**63)
+_floats = (0.0, -0.0, 1.5, -2.5e300, 5e-324, 2.2250738585072014e-308,
+           1.7976931348623157e308)
+_lengths = (0, 1, 127, 128, 300)
+_symbol_chars = "abcdefghijklmnopqrstuvwxyz0123456789-_?!*éλ"
+
+
+def random_char(rng):
+    return chr(rng.choice((rng.randrange(0, 0x80),
+                           rng.randrange(0x80, 0x800),
+                           rng.randrange(0x800, 0xd800),
+                           rng.randrange(0x10000, 0x110000))))
+
+
+def random_length(rng):
+    if rng.random() < 0.2:
+        return rng.choice(_lengths)
+    return rng.randrange(12)
+
+
+def random_float(rng):
+    if rng.random() < 0.3:
+        return rng.choice(_floats)
+    while True:
+        x = struct.unpack("<d", struct.pack("<Q", rng.getrandbits(64)))[0]
+        if math.isfinite(x):
+            return x
+
+
+def random_sexp(rng, depth=0):
+    kind = rng.randrange(11 if depth < 6 else 8)
+    if kind == 0:
+        return rng.choice((None, False, True))
+    if kind == 1:
+        return rng.choice(_ints)
+    if kind == 2:
+        return rng.randint(-2**63, 2**63 - 1) >> rng.randrange(64)
+    if kind == 3:
+        return random_float(rng)
+    if kind == 4:
+        return "".join(random_char(rng) for _ in range(random_length(rng)))
+    if kind == 5:
+        return bytes(rng.getrandbits(8) for _ in range(random_length(rng)))
+    if kind in (6, 7):
+        return Sym("".join(rng.choice(_symbol_chars)
+                           for _ in range(rng.randrange(1, 10))))
+    n = rng.randrange(7)
+    if kind in (8, 9):
+        return [random_sexp(rng, depth + 1) for _ in range(n)]
+    return tuple(random_sexp(rng, depth + 1) for _ in range(n))
+
+
+def edge_cases():
+    deep = None
+    for _ in range(50):
+        deep = [deep]
+    return ([None, False, True, Sym(""), Sym("x" * 128), [], (), deep,
+             list(range(1000)), (False,) * 200]
+            + list(_ints) + list(_floats)
+            + ["x" * n for n in _lengths] + [b"\0" * n for n in _lengths])
+
+
+def to_plain(obj):
+    if isinstance(obj, LazyList):
+        return [to_plain(elt) for elt in obj]
+    if isinstance(obj, LazyVector):
+        return tuple(to_plain(elt) for elt in obj)
+    return obj
+
+
+def decode_all(data, mode):
+    """Decodes sexps from data until the end or an error. Returns the
+    encodings of those decoded, and the error if there was one."""
+    binary._binary_accel = _accel if mode == "accel" else None
+    reader = Reader(BytesIO(data))
+    outs = []
+    try:
+        while True:
+            if mode == "lazy":
+                obj = to_plain(reader.read_lazy())
+            else:
+                obj = reader.read()
+            if isinstance(obj, Eof):
+                return outs, None
+            outs.append(encode_binary_sexp(obj))
+    except Exception as e:
+        return outs, e
+    finally:
+        binary._binary_accel = _accel
+
+
+def python_modes():
+    return ("pure", "lazy") + (("accel",) if _accel else ())
+
+
+def run(args, data, timeout):
+    """Pipes data through an echo program. Returns the finished process,
+    or None if it did not finish in time."""
+    try:
+        proc = subprocess.run(args, input=data, timeout=timeout,
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    except subprocess.TimeoutExpired:
+        return None
+    return proc
+
+
+def show(data, pos):
+    return data[pos:pos + 24].hex(" ") + (" ..." if len(data) > pos + 24
+                                         else "")
+
+
+def report_mismatch(name, sexps, encodings, got):
+    pos = 0
+    for sexp, enc in zip(sexps, encodings):
+        if got[pos:pos + len(enc)] != enc:
+            print("%s: wrong output for %.200r" % (name, sexp))
+            print("  want: " + show(enc, 0))
+            print("  got:  " + show(got, pos))
+            return
+        pos += len(enc)
+    print("%s: %d bytes of output beyond the end" % (name, len(got) - pos))
+
+
+def check_round_trip(impls, sexps):
+    encodings = [encode_binary_sexp(sexp) for sexp in sexps]
+    data = b"".join(encodings)
+    failed = False
+    for mode in python_modes():
+        outs, error = decode_all(data, mode)
+        if error or outs != encodings:
+            report_mismatch(mode, sexps, encodings, b"".join(outs))
+            if error:
+                print("  %s: %s" % (type(error).__name__, error))
+            failed = True
+    for name, args in impls:
+        proc = run(args, data, 300)
+        if proc is None:
+            print("%s: timed out" % name)
+        elif proc.stdout != data or proc.returncode:
+            report_mismatch(name, sexps, encodings, proc.stdout)
+            print("  exit %d: %s" % (proc.returncode,
+                                     proc.stderr.decode(errors="replace")
+                                     .strip()[-300:]))
+        else:
+            continue
+        failed = True
+    return not failed, encodings
+
+
+def mutate(rng, data):
+    data = bytearray(data)
+    for _ in range(rng.randrange(1, 4)):
+        op = rng.randrange(5)
+        pos = rng.randrange(len(data) + 1)
+        if op == 0 and data:
+            data[min(pos, len(data) - 1)] = rng.getrandbits(8)
+        elif op == 1:
+            del data[pos:]
+        elif op == 2:
+            data[pos:pos] = bytes(rng.getrandbits(8)
+                                  for _ in range(rng.randrange(1, 4)))
+        elif op == 3:
+            data[pos:pos] = b"\xff" * rng.randrange(1, 10)  # long varint
+        else:
+            data[pos:pos] = data[rng.randrange(len(data) + 1):][:16]
+    return bytes(data)
+
+
+def prefixes(a, b):
+    return a.startswith(b) or b.startswith(a)
+
+
+def check_fuzz(impls, encodings, count, rng):
+    # Decoders may differ in what they accept: C refuses big integers and
+    # binary.py refuses bad UTF-8. But where two of them both accept some
+    # bytes, they must agree on what those bytes mean.
+    seeds = [enc for enc in encodings if len(enc) < 200]
+    failed = 0
+    for _ in range(count):
+        data = mutate(rng, rng.choice(seeds))
+        want, error = decode_all(data, "pure")
+        want = b"".join(want)
+        problems = []
+        for mode in python_modes()[1:]:
+            outs, err = decode_all(data, mode)
+            if b"".join(outs) != want or (err is None) != (error is None):
+                problems.append("%s: %r, %r" % (mode, outs, err))
+        for name, args in impls:
+            proc = run(args, data, 10)
+            if proc is None:
+                problems.append("%s: timed out" % name)
+            elif proc.returncode < 0:
+                problems.append("%s: killed by signal %d" %
+                                (name, -proc.returncode))
+            elif not prefixes(proc.stdout, want):
+                problems.append("%s: %s" % (name, show(proc.stdout, 0)))
+        if problems:
+            failed += 1
+            if failed <= 10:
+                print("fuzz input: " + data.hex(" "))
+                print("  pure: %s, %r" % (show(want, 0), error))
+                for problem in problems:
+                    print("  " + problem)
+    return not failed
+
+
+def nested(depth):
+    return b"\x0c" * (depth - 1) + b"\x00" * depth
+
+
+def check_depth(impls):
+    # Every Python mode and the C reader must stop at the same depth, the
+    # Python ones with binary.Error.
+    failed = False
+    limit = nested(binary._MAX_DEPTH)
+    past = nested(binary._MAX_DEPTH + 1)
+    for mode in python_modes():
+        outs, error = decode_all(limit, mode)
+        deep, deep_error = decode_all(past, mode)
+        if error or len(outs) != 1 or not isinstance(deep_error,
+                                                     binary.Error):
+            print("%s: %r at the depth limit, %r past it" %
+                  (mode, error, deep_error))
+            failed = True
+    for name, args in impls:
+        if name != "c":
+            continue
+        ok, refused = run(args, limit, 10), run(args, past, 10)
+        if (not ok or ok.returncode or ok.stdout != limit or not refused or
+                not refused.returncode):
+            print("%s: does not stop at depth %d" % (name, binary._MAX_DEPTH))
+            failed = True
+    return not failed
+
+
+def check_pipe(size=8 << 20):
+    # A sexp much bigger than a pipe holds arrives in many small reads,
+    # which must not make the Reader skip over it again for each one.
+    sexp = [[i, "x" * 20] for i in range(size // 30)]
+    data = encode_binary_sexp(sexp)
+    failed = False
+    for mode in python_modes():
+        binary._binary_accel = _accel if mode == "accel" else None
+        proc = subprocess.Popen(["cat"], stdin=subprocess.PIPE,
+                                stdout=subprocess.PIPE)
+        writer = threading.Thread(target=feed, args=(proc.stdin, data))
+        start = time.perf_counter()
+        writer.start()
+        try:
+            reader = Reader(proc.stdout)
+            if mode == "lazy":
+                obj = to_plain(reader.read_lazy())
+            else:
+                obj = reader.read()
+        finally:
+            binary._binary_accel = _accel
+            writer.join()
+            proc.stdout.close()
+            proc.wait()
+        seconds = time.perf_counter() - start
+        if obj != sexp:
+            print("%s: large sexp over a pipe read back wrong" % mode)
+            failed = True
+        elif seconds > 30:
+            print("%s: large sexp over a pipe took %.1fs" % (mode, seconds))
+            failed = True
+    return not failed
+
+
+def feed(out, data):
+    for i in range(0, len(data), 4096):
+        out.write(data[i:i + 4096])
+        out.flush()
+    out.close()
+
+
+def bench_rows(nrow=20000):
+    row = [Sym("row"), 123456, "some text value here", 4.5, b"\0" * 40,
+           None, -7, "x" * 100, (1.25, False, Sym("z"))]
+    return [row] * nrow
+
+
+def best_of(n, func):
+    times = []
+    for _ in range(n):
+        start = time.perf_counter()
+        func()
+        times.append(time.perf_counter() - start)
+    return min(times)
+
+
+def measure(impls):
+    rows = bench_rows()
+    data = b"".join(encode_binary_sexp(row) for row in rows)
+    mb = len(data) / 1e6
+    results = {}
+    results["python encode"] = mb / best_of(
+        3, lambda: [encode_binary_sexp(row) for row in rows])
+    for mode in python_modes():
+        results["python %s decode" % mode] = mb / best_of(
+            3, lambda: decode_all(data, mode))
+    for name, args in impls:
+        # Both ways through the echo program, less its startup time.
+        startup = best_of(3, lambda: run(args, b"", 300))
+        results["%s echo" % name] = mb / max(
+            best_of(3, lambda: run(args, data, 300)) - startup, 1e-6)
+    return results
+
+
+def gate(results, path, tolerance):
+    with open(path) as f:
+        saved = json.load(f)
+    ok = True
+    for name, mbps in sorted(results.items()):
+        if name in saved and mbps < saved[name] * (1 - tolerance):
+            print("%s: %.1f MB/s is down from %.1f MB/s" %
+                  (name, mbps, saved[name]))
+            ok = False
+    return ok
+
+
+def write_corpus(path, encodings):
+    os.makedirs(path, exist_ok=True)
+    for i, enc in enumerate(encodings):
+        with open(os.path.join(path, "seed-%05d" % i), "wb") as f:
+            f.write(enc)
+
+
+def parse_impl(text):
+    name, sep, command = text.partition("=")
+    if not sep or not name or not command:
+        raise argparse.ArgumentTypeError("expected NAME=COMMAND")
+    return name, shlex.split(command)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Cross-implementation tests for binary sexps.")
+    parser.add_argument("--impl", type=parse_impl, action="append",
+                        default=[], metavar="NAME=COMMAND",
+                        help="echo program of another implementation")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--count", type=int, default=2000,
+                        help="random sexps to round-trip")
+    parser.add_argument("--fuzz", type=int, default=500,
+                        help="mutated inputs to try")
+    parser.add_argument("--record", metavar="FILE",
+                        help="save throughput figures")
+    parser.add_argument("--gate", metavar="FILE",
+                        help="fail if throughput falls below saved figures")
+    parser.add_argument("--tolerance", type=float, default=0.25)
+    parser.add_argument("--corpus", metavar="DIR",
+                        help="write a seed corpus for fuzz-binary-read")
+    opts = parser.parse_args()
+
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+    impls = list(opts.impl)
+    if os.path.exists("echo-binary"):
+        impls.insert(0, ("c", ["./echo-binary"]))
+    else:
+        print("c: ./echo-binary is not built")
+    if not _accel:
+        print("accel: _binary_accel is not built")
+
+    rng = random.Random(opts.seed)
+    sexps = edge_cases() + [random_sexp(rng) for _ in range(opts.count)]
+    ok, encodings = check_round_trip(impls, sexps)
+    print("round trip: %d sexps, %d bytes: %s" %
+          (len(sexps), sum(map(len, encodings)), "ok" if ok else "FAILED"))
+    if opts.corpus:
+        write_corpus(opts.corpus, encodings)
+    depth_ok = check_depth(impls)
+    print("depth limit: %s" % ("ok" if depth_ok else "FAILED"))
+    pipe_ok = check_pipe()
+    print("large sexp over a pipe: %s" % ("ok" if pipe_ok else "FAILED"))
+    ok = ok and depth_ok and pipe_ok
+    if opts.fuzz:
+        fuzz_ok = check_fuzz(impls, encodings, opts.fuzz, rng)
+        print("fuzz: %d inputs: %s" % (opts.fuzz,
+                                       "ok" if fuzz_ok else "FAILED"))
+        ok = ok and fuzz_ok
+
+    results = measure(impls)
+    for name, mbps in results.items():
+        print("%s: %.1f MB/s" % (name, mbps))
+    if opts.gate:
+        ok = gate(results, opts.gate, opts.tolerance) and ok
+    if opts.record:
+        with open(opts.record, "w") as f:
+            json.dump(results, f, indent=1, sort_keys=True)
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
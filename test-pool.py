@@ -0,0 +1,119 @@
+#! /usr/bin/env python3
+
+"""Checks binary.DriverPool against ./driver-sqlite.
+
+Writes, transactions and savepoints must stay on the first driver and in
+order, while reads spread over the others. Drivers are then killed: a
+read running on one is retried, and a transaction on one fails as a
+whole.
+
+    python3 test-pool.py
+"""
+
+import os
+import signal
+import sys
+import tempfile
+import time
+
+from binary import DriverPool, Error, Sym
+
+_heavy = ("with recursive c(x) as (select 1 union all select x + 1 from c"
+          " where x < 2000000) select count(*), sum(x) from c")
+
+
+def check(ok, what):
+    if not ok:
+        print("pool: " + what)
+        sys.exit(1)
+
+
+def fails(job):
+    try:
+        job.result()
+    except Error:
+        return True
+    return False
+
+
+def check_routing(pool):
+    pool.execute("create table t (a integer, b text)")
+    jobs = [pool.submit("execute", "insert into t values (%d, 'x')" % i)
+            for i in range(50)]
+    check(pool.execute("select count(*) from t") == [[50]],
+          "a read ran before the writes ahead of it")
+    check(all(job.result() == [] for job in jobs), "an insert failed")
+    check(pool.submit("execute", "explain select * from t").read_only,
+          "explain is not read-only")
+    job = pool.submit("execute", "explain analyze delete from t")
+    check(not job.read_only, "explain analyze is read-only")
+    fails(job)  # SQLite has no explain analyze
+
+    pool.submit("execute", "begin")
+    pool.submit("execute", "insert into t values (1000, 'tx')")
+    job = pool.submit("execute", "select count(*) from t")
+    pool.submit("execute", "rollback")
+    check(job.result() == [[51]], "a transaction did not see its writes")
+    check(pool.execute("select count(*) from t") == [[50]],
+          "rollback did not undo the transaction")
+
+    pool.submit("execute", "savepoint outer1")
+    pool.submit("execute", "savepoint inner2")
+    pool.submit("execute", "insert into t values (1001, 'sp')")
+    pool.submit("execute", "release inner2")
+    check(not pool.submit("execute", "select 1").read_only,
+          "releasing a nested savepoint ended the transaction")
+    pool.submit("execute", "release outer1")
+    job = pool.submit("execute", "select count(*) from t")
+    check(job.read_only, "releasing the outer savepoint did not end the "
+          "transaction")
+    check(job.result() == [[51]], "release did not commit")
+
+
+def check_crashes(pool):
+    # A read killed while it runs is retried on a new driver.
+    want = pool.execute(_heavy)
+    job = pool.submit("execute", _heavy)
+    pool.submit("execute", _heavy)
+    driver = [d for d in pool.drivers if pool._running.get(d) is job][0]
+    os.kill(driver.proc.pid, signal.SIGKILL)
+    check(job.result() == want, "a killed read was not retried")
+
+    # A driver killed between commands comes back with its setup run.
+    os.kill(pool.drivers[0].proc.pid, signal.SIGKILL)
+    time.sleep(0.1)
+    check(pool.execute("insert into t values (2000, 'after')") == [],
+          "a write after a killed driver failed")
+
+    # A transaction whose driver dies fails as a whole.
+    pool.submit("execute", "begin")
+    pool.submit("execute", "insert into t values (3000, 'lost')").result()
+    os.kill(pool.drivers[0].proc.pid, signal.SIGKILL)
+    time.sleep(0.1)
+    insert = pool.submit("execute", "insert into t values (3001, 'lost')")
+    commit = pool.submit("execute", "commit")
+    check(fails(insert) and fails(commit),
+          "a transaction went on after its driver died")
+    check(pool.execute("select count(*) from t where a >= 2000") == [[1]],
+          "part of a lost transaction was committed")
+    check(pool.execute("select 1") == [[1]], "the pool did not recover")
+
+
+def main():
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+    if not os.path.exists("driver-sqlite"):
+        print("pool: ./driver-sqlite is not built")
+        return 1
+    with tempfile.TemporaryDirectory() as tmp:
+        setup = [("connect", Sym("dbname"), os.path.join(tmp, "pool.db")),
+                 ("set-timeout", 60000)]
+        with DriverPool(["./driver-sqlite"], 3, setup) as pool:
+            pool.execute("pragma journal_mode=wal")
+            check_routing(pool)
+            check_crashes(pool)
+    print("pool: ok")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())